@@ -0,0 +1,58 @@
+#include <chrono>
+#include <iostream>
+#include "../src/Processor.h"
+using std::cout;
+using std::endl;
+
+#define		BENCH_BUDGET	50000000
+
+/**
+ * Guest workload; a copy loop with some arithmetic and a compare and branch thrown in, wrapped in an endless outer
+ * loop so that it soaks up whatever budget it's given.
+ */
+static const PWORD workload[] = {
+	012705, 000144,		//mov #100., r5
+	012700, 002000,		//1$: mov #2000, r0
+	012701, 003000,		//mov #3000, r1
+	012702, 000100,		//mov #64., r2
+	012021,				//2$: mov (r0)+, (r1)+
+	060203,				//add r2, r3
+	020327, 001750,		//cmp r3, #1000.
+	001001,				//bne 3$
+	005003,				//clr r3
+	077207,				//3$: sob r2, 2$
+	077516,				//sob r5, 1$
+	000757				//br 0
+};
+
+/**
+ * Run the workload under one dispatch strategy and report how fast it went
+ * @param name What to call it
+ * @param mode Dispatch strategy
+ */
+static void bench(const char* name, ExecMode mode) {
+	Processor proc;
+	for (PWORD i = 0; i < sizeof(workload) / sizeof(workload[0]); i++)
+		proc.mem((PWORD)(01000 + 2 * i), workload[i]);
+	proc.reg(PC, 01000);
+	proc.mode(mode);
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t n = proc.run(BENCH_BUDGET);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	cout << name << ": " << n << " instructions in " << elapsed.count() << "s, "
+		 << n / elapsed.count() / 1e6 << " MIPS" << endl;
+}
+
+int main(){
+	bench("call", EXEC_CALL);
+#ifdef PDP_COMPUTED_GOTO
+	bench("threaded (computed goto)", EXEC_THREADED);
+#else
+	bench("threaded (switch fallback)", EXEC_THREADED);
+#endif
+	bench("switch", EXEC_SWITCH);
+	bench("jit", EXEC_JIT);
+	bench("tiered", EXEC_TIERED);
+	return 0;
+}
@@ -0,0 +1,1010 @@
+#include <algorithm>
+#include <cstring>
+#include "Dispatch.h"
+#include "Native.h"
+#include "WriteGuard.h"
+
+/*
+ * Fetch/decode/execute engine. Every one of the 65536 possible instruction words is decoded exactly once, up front,
+ * into a Decoded entry that names the handler to run and carries the fields the handler needs. Executing an
+ * instruction is then a fetch, one indexed load and an indirect call.
+ *
+ * Handlers resolve operands (including addressing mode side effects) and then hand off to the instruction methods on
+ * Processor, so the instruction semantics still live in exactly one place. Handlers with operands are templates on
+ * their addressing modes, and the dispatch table points at the instantiation for each instruction's modes, so
+ * operand resolution compiles down to straight-line code; register operands never go near core.
+ *
+ * The instruction cache also fuses common pairs, a compare or test and the branch after it or a copy or clear step and
+ * the SOB closing its loop, into superinstructions. These run both instructions for one fetch and dispatch, and only
+ * work out the condition codes the branch looks at; the rest stay pending, as usual. A copy or clear loop that's just
+ * the step and its SOB runs all at once, as a memmove() or memset() over core.
+ */
+
+//Pull apart an instruction word
+#define		SRC_MODE(ir)	(PBYTE)(((ir) >> 9) & 07)
+#define		SRC_REG(ir)		(PBYTE)(((ir) >> 6) & 07)
+#define		DST_MODE(ir)	(PBYTE)(((ir) >> 3) & 07)
+#define		DST_REG(ir)		(PBYTE)((ir) & 07)
+
+//Template argument for handlers that resolve their operands' modes at runtime
+#define		MODE_ANY		-1
+
+#define		OP_HANDLER(name)	Dispatcher::name,
+#define		OP_RR_HANDLER(name)	Dispatcher::name##_rr,
+
+//Every instantiation of a handler template, for indexing by addressing mode
+#define		MODE_ROW(name, ...) { \
+	&name<__VA_ARGS__ MODE_REG>, &name<__VA_ARGS__ MODE_DEF>, &name<__VA_ARGS__ MODE_AINC>, \
+	&name<__VA_ARGS__ MODE_AINCDEF>, &name<__VA_ARGS__ MODE_ADEC>, &name<__VA_ARGS__ MODE_ADECDEF>, \
+	&name<__VA_ARGS__ MODE_INDEX>, &name<__VA_ARGS__ MODE_INDEXDEF>, &name<__VA_ARGS__ MODE_IMM>, \
+	&name<__VA_ARGS__ MODE_ABS>, &name<__VA_ARGS__ MODE_REL>, &name<__VA_ARGS__ MODE_RELDEF>, \
+	&name<__VA_ARGS__ MODE_IDX>, &name<__VA_ARGS__ MODE_IDXDEF> }
+#define		MODE_MATRIX(name) { \
+	MODE_ROW(name, MODE_REG,), MODE_ROW(name, MODE_DEF,), MODE_ROW(name, MODE_AINC,), \
+	MODE_ROW(name, MODE_AINCDEF,), MODE_ROW(name, MODE_ADEC,), MODE_ROW(name, MODE_ADECDEF,), \
+	MODE_ROW(name, MODE_INDEX,), MODE_ROW(name, MODE_INDEXDEF,), MODE_ROW(name, MODE_IMM,), \
+	MODE_ROW(name, MODE_ABS,), MODE_ROW(name, MODE_REL,), MODE_ROW(name, MODE_RELDEF,), \
+	MODE_ROW(name, MODE_IDX,), MODE_ROW(name, MODE_IDXDEF,) }
+
+//Handler generators for the regular instruction formats. Each defines the template, a runtime-mode version and an
+//all-registers version.
+#define		SINGLE_OP(name, store) \
+	template <int D> static void name##_op(Processor& cpu, const Decoded& d) { \
+		PWORD* dst = operand<D>(cpu, d.dstMode, d.dstReg, d.dstWord); \
+		if (canFault(D) && faulted(cpu)) \
+			return; \
+		cpu.name(dst); \
+		if (store && canFault(D)) \
+			cpu.written(dst); \
+	} \
+	static void name(Processor& cpu, const Decoded& d) { name##_op<MODE_ANY>(cpu, d); } \
+	static void name##_rr(Processor& cpu, const Decoded& d) { name##_op<MODE_REG>(cpu, d); }
+
+#define		DOUBLE_OP(name, store) \
+	template <int S, int D> static void name##_op(Processor& cpu, const Decoded& d) { \
+		PWORD src = *operand<S>(cpu, d.srcMode, d.srcReg, d.srcWord); \
+		PWORD* dst = operand<D>(cpu, d.dstMode, d.dstReg, d.dstWord); \
+		if ((canFault(S) || canFault(D)) && faulted(cpu)) \
+			return; \
+		cpu.name(&src, dst); \
+		if (store && canFault(D)) \
+			cpu.written(dst); \
+	} \
+	static void name(Processor& cpu, const Decoded& d) { name##_op<MODE_ANY, MODE_ANY>(cpu, d); } \
+	static void name##_rr(Processor& cpu, const Decoded& d) { name##_op<MODE_REG, MODE_REG>(cpu, d); }
+
+#define		REG_OP(name) \
+	template <int D> static void name##_op(Processor& cpu, const Decoded& d) { \
+		PWORD src = *operand<D>(cpu, d.dstMode, d.dstReg, d.dstWord); \
+		if (canFault(D) && faulted(cpu)) \
+			return; \
+		cpu.name((RegCode)d.srcReg, &src); \
+	} \
+	static void name(Processor& cpu, const Decoded& d) { name##_op<MODE_ANY>(cpu, d); } \
+	static void name##_rr(Processor& cpu, const Decoded& d) { name##_op<MODE_REG>(cpu, d); }
+
+#define		BRANCH_OP(name) \
+	static void name(Processor& cpu, const Decoded& d) { \
+		PWORD ost = (PWORD)d.offset; \
+		cpu.name(&ost); \
+	}
+
+#define		SIMPLE_OP(name, call) \
+	static void name(Processor& cpu, const Decoded&) { \
+		cpu.call; \
+		faulted(cpu); \
+	}
+
+class Dispatcher {
+public:
+	static const Decoded* table();
+	static const Decoded* fetchFault();
+	static void specialize(Decoded& d);
+
+	/**
+	 * Raise a bus error trap if operand resolution faulted
+	 * @return True if the instruction must be abandoned
+	 */
+	static bool faulted(Processor& cpu) {
+		if (!cpu.fault)
+			return false;
+		cpu.trap(VEC_BUSERR);
+		return true;
+	}
+
+	/**
+	 * Whether resolving an operand in the given mode can fault, or write to core
+	 */
+	static constexpr bool canFault(int mode) {
+		return mode != MODE_REG && mode != MODE_IMM;
+	}
+
+	//Operand resolution, specialized below for each addressing mode
+	template <int M> static PWORD* operand(Processor& cpu, PBYTE mode, PBYTE reg, PWORD word);
+
+	SIMPLE_OP(halt, halt())
+	SIMPLE_OP(wait, wait())
+	SIMPLE_OP(rti, rti())
+	SIMPLE_OP(bpt, bpt(VEC_BPT))
+	SIMPLE_OP(iot, iot())
+	SIMPLE_OP(reset, reset())
+	SIMPLE_OP(rtt, rtt())
+	SIMPLE_OP(emt, emt())
+	SIMPLE_OP(trap, trap(VEC_TRAP))
+	SIMPLE_OP(reserved, trap(VEC_RESVD))
+	SIMPLE_OP(buserr, trap(VEC_BUSERR))
+
+	SINGLE_OP(clr, true)
+	SINGLE_OP(com, true)
+	SINGLE_OP(inc, true)
+	SINGLE_OP(dec, true)
+	SINGLE_OP(neg, true)
+	SINGLE_OP(adc, true)
+	SINGLE_OP(sbc, true)
+	SINGLE_OP(tst, false)
+	SINGLE_OP(ror, true)
+	SINGLE_OP(rol, true)
+	SINGLE_OP(asr, true)
+	SINGLE_OP(asl, true)
+	SINGLE_OP(swab, true)
+	SINGLE_OP(sxt, true)
+
+	DOUBLE_OP(mov, true)
+	DOUBLE_OP(cmp, false)
+	DOUBLE_OP(bit, false)
+	DOUBLE_OP(bic, true)
+	DOUBLE_OP(bis, true)
+	DOUBLE_OP(add, true)
+	DOUBLE_OP(sub, true)
+
+	REG_OP(mul)
+	REG_OP(div)
+	REG_OP(ash)
+	REG_OP(ashc)
+	REG_OP(xor_)
+
+	BRANCH_OP(br)
+	BRANCH_OP(bne)
+	BRANCH_OP(beq)
+	BRANCH_OP(bge)
+	BRANCH_OP(blt)
+	BRANCH_OP(bgt)
+	BRANCH_OP(ble)
+	BRANCH_OP(bpl)
+	BRANCH_OP(bmi)
+	BRANCH_OP(bhi)
+	BRANCH_OP(blos)
+	BRANCH_OP(bvc)
+	BRANCH_OP(bvs)
+	BRANCH_OP(bcc)
+	BRANCH_OP(bcs)
+
+	static void jmp(Processor& cpu, const Decoded& d) {
+		PWORD dst = cpu.effective(d.dstMode, d.dstReg, d.dstWord);
+		if (faulted(cpu))
+			return;
+		cpu.jmp(&dst);
+	}
+
+	static void jsr(Processor& cpu, const Decoded& d) {
+		PWORD dst = cpu.effective(d.dstMode, d.dstReg, d.dstWord);
+		if (faulted(cpu))
+			return;
+		cpu.jsr((RegCode)d.srcReg, &dst);
+		faulted(cpu);
+	}
+
+	static void rts(Processor& cpu, const Decoded& d) {
+		cpu.rts((RegCode)d.dstReg);
+		faulted(cpu);
+	}
+
+	static void sob(Processor& cpu, const Decoded& d) {
+		PWORD dst = cpu.registers[PC] - (PWORD)(2 * d.offset);
+		cpu.sob((RegCode)d.srcReg, &dst);
+	}
+
+	static void spl(Processor& cpu, const Decoded& d) {
+		PBYTE lvl = (PBYTE)d.offset;
+		cpu.spl(&lvl);
+	}
+
+	/**
+	 * Condition code operators; bit 4 picks set or clear, bits 0-3 pick which codes
+	 */
+	static void ccop(Processor& cpu, const Decoded& d) {
+		bool set = (d.offset & 020) != 0;
+		if (d.offset & SC) set ? cpu.sec() : cpu.clc();
+		if (d.offset & SV) set ? cpu.sev() : cpu.clv();
+		if (d.offset & SZ) set ? cpu.sez() : cpu.clz();
+		if (d.offset & SN) set ? cpu.sen() : cpu.cln();
+	}
+
+	//Superinstructions, given room for at least two instructions. Each returns the number of instructions it ran, which
+	//is only one if the first one trapped.
+#define		BRANCH_CASE(name)	case OP_##name: name(cpu, d); break;
+
+	/**
+	 * Run the branch fused onto a superinstruction, which comes right after the first instruction's last word
+	 */
+	static int pairedBranch(Processor& cpu, const Decoded& d) {
+		cpu.registers[PC] += (PWORD)(2 + (d.srcMode == MODE_IMM ? 2 : 0) + (d.dstMode != MODE_REG ? 2 : 0));
+		switch (d.pair) {
+			BRANCH_OPS(BRANCH_CASE)
+			default: break;
+		}
+		return 2;
+	}
+
+	/**
+	 * Operand of a superinstruction: a register, or an immediate already in the predecoded word
+	 */
+	static PWORD fusedValue(Processor& cpu, PBYTE mode, PBYTE reg, PWORD word) {
+		return mode == MODE_REG ? cpu.registers[reg] : word;
+	}
+
+	static int cmp_bxx(Processor& cpu, const Decoded& d, uint64_t) {
+		PWORD src = fusedValue(cpu, d.srcMode, d.srcReg, d.srcWord);
+		PWORD dst = fusedValue(cpu, d.dstMode, d.dstReg, d.dstWord);
+		cpu.cmp(&src, &dst);
+		return pairedBranch(cpu, d);
+	}
+
+	static int bit_bxx(Processor& cpu, const Decoded& d, uint64_t) {
+		PWORD src = fusedValue(cpu, d.srcMode, d.srcReg, d.srcWord);
+		PWORD dst = fusedValue(cpu, d.dstMode, d.dstReg, d.dstWord);
+		cpu.bit(&src, &dst);
+		return pairedBranch(cpu, d);
+	}
+
+	static int tst_bxx(Processor& cpu, const Decoded& d, uint64_t) {
+		cpu.tst(&cpu.registers[d.dstReg]);
+		return pairedBranch(cpu, d);
+	}
+
+	static int dec_bxx(Processor& cpu, const Decoded& d, uint64_t) {
+		cpu.dec(&cpu.registers[d.dstReg]);
+		return pairedBranch(cpu, d);
+	}
+
+	static int copy_sob(Processor& cpu, const Decoded& d, uint64_t room);
+	static int clr_sob(Processor& cpu, const Decoded& d, uint64_t room);
+	static int loopSob(Processor& cpu, const Decoded& d, PWORD* dst);
+	static int bulkLaps(Processor& cpu, const Decoded& d, bool copy, uint64_t room);
+
+	static PBYTE indexWord(Processor& cpu, PBYTE mode, PBYTE reg, bool source, PWORD& next, PWORD& word);
+	static void fuse(Processor& cpu, Decoded& d, PWORD pc, PWORD next);
+
+private:
+	static const Decoded* build();
+	static Decoded decode(PWORD ir);
+};
+
+//
+// Operand resolvers, one per addressing mode. These are the same as Processor::operand(), minus the mode switch.
+//
+
+template <> inline PWORD* Dispatcher::operand<MODE_ANY>(Processor& cpu, PBYTE mode, PBYTE reg, PWORD word) {
+	return cpu.operand(mode, reg, word);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_REG>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	return &cpu.registers[reg];
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_DEF>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	return cpu.memory(cpu.registers[reg]);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_AINC>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	PWORD addr = cpu.registers[reg];
+	cpu.registers[reg] += 2;
+	return cpu.memory(addr);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_AINCDEF>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	PWORD addr = *cpu.memory(cpu.registers[reg]);
+	cpu.registers[reg] += 2;
+	return cpu.memory(addr);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_ADEC>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	cpu.registers[reg] -= 2;
+	return cpu.memory(cpu.registers[reg]);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_ADECDEF>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	cpu.registers[reg] -= 2;
+	return cpu.memory(*cpu.memory(cpu.registers[reg]));
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_INDEX>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	PWORD index = *cpu.memory(cpu.registers[PC]);
+	cpu.registers[PC] += 2;
+	return cpu.memory(cpu.registers[reg] + index);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_INDEXDEF>(Processor& cpu, PBYTE, PBYTE reg, PWORD) {
+	PWORD index = *cpu.memory(cpu.registers[PC]);
+	cpu.registers[PC] += 2;
+	return cpu.memory(*cpu.memory(cpu.registers[reg] + index));
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_IMM>(Processor& cpu, PBYTE, PBYTE, PWORD word) {
+	cpu.registers[PC] += 2;
+	cpu.scratch = word;
+	return &cpu.scratch;
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_ABS>(Processor& cpu, PBYTE, PBYTE, PWORD word) {
+	cpu.registers[PC] += 2;
+	return cpu.memory(word);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_REL>(Processor& cpu, PBYTE, PBYTE, PWORD word) {
+	cpu.registers[PC] += 2;
+	return cpu.memory(word);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_RELDEF>(Processor& cpu, PBYTE, PBYTE, PWORD word) {
+	cpu.registers[PC] += 2;
+	return cpu.memory(*cpu.memory(word));
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_IDX>(Processor& cpu, PBYTE, PBYTE reg, PWORD word) {
+	cpu.registers[PC] += 2;
+	return cpu.memory(cpu.registers[reg] + word);
+}
+
+template <> inline PWORD* Dispatcher::operand<MODE_IDXDEF>(Processor& cpu, PBYTE, PBYTE reg, PWORD word) {
+	cpu.registers[PC] += 2;
+	return cpu.memory(*cpu.memory(cpu.registers[reg] + word));
+}
+
+/**
+ * MOV (Rs)+, (Rd)+ then SOB. When the SOB goes straight back to the MOV, every lap but the last is one memmove().
+ */
+inline int Dispatcher::copy_sob(Processor& cpu, const Decoded& d, uint64_t room) {
+	int laps = d.offset == 2 ? bulkLaps(cpu, d, true, room) : 0;
+	PWORD src = *operand<MODE_AINC>(cpu, d.srcMode, d.srcReg, d.srcWord);
+	PWORD* dst = operand<MODE_AINC>(cpu, d.dstMode, d.dstReg, d.dstWord);
+	if (faulted(cpu))
+		return 2 * laps + 1;
+	cpu.mov(&src, dst);
+	return 2 * laps + loopSob(cpu, d, dst);
+}
+
+/**
+ * CLR (Rd)+ then SOB. When the SOB goes straight back to the CLR, every lap but the last is one memset().
+ */
+inline int Dispatcher::clr_sob(Processor& cpu, const Decoded& d, uint64_t room) {
+	int laps = d.offset == 2 ? bulkLaps(cpu, d, false, room) : 0;
+	PWORD* dst = operand<MODE_AINC>(cpu, d.dstMode, d.dstReg, d.dstWord);
+	if (faulted(cpu))
+		return 2 * laps + 1;
+	cpu.clr(dst);
+	return 2 * laps + loopSob(cpu, d, dst);
+}
+
+/**
+ * Finish a copy or clear step that stored to dst, then run the SOB after it, unless the store landed on either
+ * instruction, in which case the SOB is left to be fetched again
+ * @return Instructions run
+ */
+inline int Dispatcher::loopSob(Processor& cpu, const Decoded& d, PWORD* dst) {
+	cpu.written(dst);
+	if (d.handler == nullptr)
+		return 1;
+	cpu.registers[PC] += 2;
+	if (--cpu.registers[d.pair] != 0)
+		cpu.registers[PC] -= (PWORD)(2 * d.offset);
+	return 2;
+}
+
+/**
+ * Run all but the last lap of a copy or clear loop in one go over core, leaving the registers as the laps would. The
+ * last lap is left to the caller, so that it sets the condition codes and PC. Loops that would run off the end of
+ * core, hit an odd address or write over predecoded code, or whose registers double up, are left to run a lap at a
+ * time.
+ * @param copy Whether this is a copy; otherwise it's a clear, and there's no source
+ * @param room Most instructions that may be run
+ * @return Laps run
+ */
+inline int Dispatcher::bulkLaps(Processor& cpu, const Decoded& d, bool copy, uint64_t room) {
+	PBYTE from = d.srcReg, to = d.dstReg, count = d.pair;
+	if (to == count || (copy && (from == to || from == count)))
+		return 0;
+	uint64_t laps = cpu.registers[count] ? cpu.registers[count] : 0x10000;
+	if (laps > room / 2)
+		laps = room / 2;
+	if (laps < 2)
+		return 0;
+	laps--;
+
+	int bytes = (int)(2 * laps);
+	PWORD src = cpu.registers[from], dst = cpu.registers[to];
+	if ((dst & 1) || dst + bytes > cpu.coreSizeBytes || (copy && ((src & 1) || src + bytes > cpu.coreSizeBytes)))
+		return 0;
+	for (int page = dst >> ICACHE_PAGE_BITS; page <= (dst + bytes - 1) >> ICACHE_PAGE_BITS; page++)
+		if (cpu.codePages[page])
+			return 0;
+
+	PWORD* core = cpu.core.word;
+	if (!copy)
+		memset(core + dst / 2, 0, bytes);
+	else if (dst <= src || dst >= src + bytes)
+		memmove(core + dst / 2, core + src / 2, bytes);
+	else {
+		//The destination overlaps the end of the source, so words copied early get copied again
+		for (int i = 0; i < bytes / 2; i++)
+			core[dst / 2 + i] = core[src / 2 + i];
+	}
+	if (copy)
+		cpu.registers[from] += bytes;
+	cpu.registers[to] += bytes;
+	cpu.registers[count] -= laps;
+	return (int)laps;
+}
+
+/**
+ * Get the dispatch table, building it on first use
+ * @return Table of DISPATCH_SIZE entries indexed by instruction word
+ */
+const Decoded* Dispatcher::table() {
+	static const Decoded* entries = build();
+	return entries;
+}
+
+/**
+ * Decode every possible instruction word
+ */
+const Decoded* Dispatcher::build() {
+	static Decoded storage[DISPATCH_SIZE];
+	for (int i = 0; i < DISPATCH_SIZE; i++) {
+		storage[i] = decode((PWORD)i);
+		specialize(storage[i]);
+	}
+	return storage;
+}
+
+/**
+ * Point a decoded instruction at the handler instantiated for its addressing modes, and if all of its operands are
+ * registers, at the register-only handler for the threaded and switch interpreters.
+ * @param d Decoded instruction, with op set to the runtime-mode handler
+ */
+void Dispatcher::specialize(Decoded& d) {
+	static const Handler handlers[OP_COUNT] = { HANDLERS(OP_HANDLER, OP_RR_HANDLER) };
+#define		DOUBLE_MATRIX(name) \
+		case OP_##name: { \
+			static const Handler matrix[MODE_COUNT][MODE_COUNT] = MODE_MATRIX(name##_op); \
+			d.handler = matrix[d.srcMode][d.dstMode]; \
+			break; \
+		}
+#define		SINGLE_ROW(name) \
+		case OP_##name: { \
+			static const Handler row[MODE_COUNT] = MODE_ROW(name##_op,); \
+			d.handler = row[d.dstMode]; \
+			break; \
+		}
+
+	if (d.op >= OP_mov_rr)
+		d.op -= OP_RR_OFFSET;
+	switch (d.op) {
+		DOUBLE_OPS(DOUBLE_MATRIX)
+		SINGLE_OPS(SINGLE_ROW)
+		REG_OPS(SINGLE_ROW)
+		default:
+			d.handler = handlers[d.op];
+			return;
+	}
+	if (d.dstMode == MODE_REG && (!(d.operands & OPND_SRC) || d.srcMode == MODE_REG))
+		d.op += OP_RR_OFFSET;
+}
+
+/**
+ * Pseudo-instruction standing in for an instruction fetch that faulted
+ */
+const Decoded* Dispatcher::fetchFault() {
+	static const Decoded fault = {buserr, OP_buserr, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	return &fault;
+}
+
+/**
+ * Decode a single instruction word. Byte instructions and a handful of memory management instructions (MARK, MFPI,
+ * MTPI, etc.) aren't implemented, and decode as reserved instructions.
+ * @param ir Instruction word
+ * @return Decoded form of the instruction
+ */
+Decoded Dispatcher::decode(PWORD ir) {
+	Decoded d = {nullptr, OP_reserved, SRC_MODE(ir), SRC_REG(ir), DST_MODE(ir), DST_REG(ir), 0, 0, 0, 0, 0};
+
+	//Double operand instructions
+	d.operands = OPND_SRC | OPND_DST;
+	switch (ir >> 12) {
+		case 01: d.op = OP_mov; return d;
+		case 02: d.op = OP_cmp; return d;
+		case 03: d.op = OP_bit; return d;
+		case 04: d.op = OP_bic; return d;
+		case 05: d.op = OP_bis; return d;
+		case 06: d.op = OP_add; return d;
+		case 016: d.op = OP_sub; return d;
+		default: break;
+	}
+
+	//Register and one-and-a-half operand instructions
+	d.operands = OPND_DST;
+	switch (ir >> 9) {
+		case 004: d.op = OP_jsr; return d;
+		case 070: d.op = OP_mul; return d;
+		case 071: d.op = OP_div; return d;
+		case 072: d.op = OP_ash; return d;
+		case 073: d.op = OP_ashc; return d;
+		case 074: d.op = OP_xor_; return d;
+		default: break;
+	}
+
+	d.operands = 0;
+	switch (ir >> 9) {
+		case 077: d.op = OP_sob; d.offset = (SPWORD)(ir & 077); return d;
+		case 0104: d.op = (ir & 0400) ? OP_trap : OP_emt; return d;
+		default: break;
+	}
+
+	//Branches
+	static const PBYTE branches[2][8] = {
+		{OP_reserved, OP_br, OP_bne, OP_beq, OP_bge, OP_blt, OP_bgt, OP_ble},
+		{OP_bpl, OP_bmi, OP_bhi, OP_blos, OP_bvc, OP_bvs, OP_bcc, OP_bcs}
+	};
+	PBYTE branch = branches[ir >> 15][(ir >> 8) & 07];
+	if ((ir & 074000) == 0 && branch != OP_reserved) {
+		d.op = branch;
+		d.offset = (SPWORD)(int8_t)(ir & 0xFF);
+		return d;
+	}
+
+	//Single operand instructions
+	static const PBYTE singles[2][8] = {
+		{OP_clr, OP_com, OP_inc, OP_dec, OP_neg, OP_adc, OP_sbc, OP_tst},
+		{OP_ror, OP_rol, OP_asr, OP_asl, OP_reserved, OP_reserved, OP_reserved, OP_sxt}
+	};
+	if ((ir & 0177000) == 0005000 || (ir & 0177000) == 0006000) {
+		d.op = singles[(ir >> 9) - 05][(ir >> 6) & 07];
+		d.operands = OPND_DST;
+		return d;
+	}
+
+	if ((ir & 0177700) == 0000100) {
+		d.op = OP_jmp;
+		d.operands = OPND_DST;
+		return d;
+	}
+	if ((ir & 0177700) == 0000300) {
+		d.op = OP_swab;
+		d.operands = OPND_DST;
+		return d;
+	}
+	if ((ir & 0177770) == 0000200) {
+		d.op = OP_rts;
+		return d;
+	}
+	if ((ir & 0177770) == 0000230) {
+		d.op = OP_spl;
+		d.offset = (SPWORD)(ir & 07);
+		return d;
+	}
+	if ((ir & 0177740) == 0000240) {
+		d.op = OP_ccop;
+		d.offset = (SPWORD)(ir & 037);
+		return d;
+	}
+
+	//Zero operand instructions
+	static const PBYTE zeros[8] = {OP_halt, OP_wait, OP_rti, OP_bpt, OP_iot, OP_reset, OP_rtt, OP_reserved};
+	if (ir < 010)
+		d.op = zeros[ir];
+	return d;
+}
+
+/**
+ * Work out whether an operand is followed by an index or immediate word, and if so, fold that word into the
+ * predecoded instruction.
+ * @param mode Addressing mode of the operand
+ * @param reg Register of the operand
+ * @param source Whether this is a source operand; immediate destinations are left alone, since they can be written
+ * @param next Address of the next word of the instruction, advanced past the word if there is one
+ * @param word Receives the value for the pseudo mode
+ * @return Addressing mode to execute the operand with
+ */
+PBYTE Dispatcher::indexWord(Processor& cpu, PBYTE mode, PBYTE reg, bool source, PWORD& next, PWORD& word) {
+	if (mode < 6 && (reg != PC || (mode != 2 && mode != 3)))
+		return mode;
+	PWORD at = next;
+	next += 2;
+	if (at >= cpu.coreSizeBytes)
+		return mode; //Let it fault when it runs
+	word = cpu.core.word[at >> 1];
+	switch (mode) {
+		case 2: if (!source) return mode; return MODE_IMM;
+		case 3: return MODE_ABS;
+		case 6: if (reg != PC) return MODE_IDX; word += next; return MODE_REL;
+		default: if (reg != PC) return MODE_IDXDEF; word += next; return MODE_RELDEF;
+	}
+}
+
+/**
+ * Turn a predecoded instruction into a superinstruction if it and the instruction after it make one. Pairs are kept
+ * to three words, so that the instruction cache drops them whenever it drops an instruction built from those words.
+ * @param d Predecoded instruction at pc, already specialized
+ * @param next Address just past it
+ */
+void Dispatcher::fuse(Processor& cpu, Decoded& d, PWORD pc, PWORD next) {
+	if (next >= cpu.coreSizeBytes || next - pc > 4)
+		return;
+	const Decoded& after = cpu.dispatch[cpu.core.word[next >> 1]];
+	auto reg = [](PBYTE mode, PBYTE r) { return mode == MODE_REG && r != PC; };
+	bool srcValue = reg(d.srcMode, d.srcReg) || d.srcMode == MODE_IMM;
+	bool dstValue = reg(d.dstMode, d.dstReg) || (d.dstMode == MODE_AINC && d.dstReg == PC);
+	PBYTE op = plainOp(d.op);
+	PBYTE fused = OP_COUNT;
+
+	if (after.op >= OP_bne && after.op <= OP_bcs) {
+		if (op == OP_cmp && srcValue && dstValue)
+			fused = OP_cmp_bxx;
+		else if (op == OP_bit && srcValue && dstValue)
+			fused = OP_bit_bxx;
+		else if (op == OP_tst && reg(d.dstMode, d.dstReg))
+			fused = OP_tst_bxx;
+		else if (op == OP_dec && reg(d.dstMode, d.dstReg))
+			fused = OP_dec_bxx;
+	}
+	else if (after.op == OP_sob && after.srcReg != PC && d.dstMode == MODE_AINC && d.dstReg != PC) {
+		if (op == OP_mov && d.srcMode == MODE_AINC && d.srcReg != PC)
+			fused = OP_copy_sob;
+		else if (op == OP_clr)
+			fused = OP_clr_sob;
+	}
+	if (fused == OP_COUNT)
+		return;
+	d.op = fused;
+	d.pair = after.op == OP_sob ? after.srcReg : after.op;
+	d.offset = after.offset;
+	cpu.holdsCode(next >> ICACHE_PAGE_BITS);
+}
+
+/**
+ * Decode the instruction at pc into the instruction cache, along with any index or immediate words that follow it
+ * @param pc Address of a word in core
+ * @return Cache entry for pc
+ */
+const Decoded& Processor::predecode(PWORD pc) {
+	Decoded& d = icache[pc >> 1];
+	Decoded entry = dispatch[core.word[pc >> 1]];
+	holdsCode(pc >> ICACHE_PAGE_BITS);
+	PWORD next = pc + (PWORD)2;
+	if (entry.operands & OPND_SRC)
+		entry.srcMode = Dispatcher::indexWord(*this, entry.srcMode, entry.srcReg, true, next, entry.srcWord);
+	if (entry.operands & OPND_DST)
+		entry.dstMode = Dispatcher::indexWord(*this, entry.dstMode, entry.dstReg, false, next, entry.dstWord);
+	for (PWORD at = pc + (PWORD)2; at != next; at += 2) {
+		if (at < coreSizeBytes)
+			holdsCode(at >> ICACHE_PAGE_BITS);
+	}
+	Dispatcher::specialize(entry);
+	Dispatcher::fuse(*this, entry, pc, next);
+	d = entry;
+	return d;
+}
+
+/**
+ * Fetch the next instruction out of the instruction cache, decoding it if need be, and step PC past it
+ * @return Instruction to execute
+ */
+inline const Decoded* Processor::fetch() {
+	PWORD pc = registers[PC];
+	if ((pc & 1) || pc >= coreSizeBytes)
+		return Dispatcher::fetchFault();
+	const Decoded* d = &icache[pc >> 1];
+	if (d->handler == nullptr)
+		d = &predecode(pc);
+	registers[PC] = pc + (PWORD)2;
+	return d;
+}
+
+/**
+ * Decode the instruction at PC straight from core, leaving the instruction cache alone, and step PC past it. Index
+ * and immediate words are read from where they follow the instruction, as predecode() reads them, rather than from
+ * wherever PC has got to by the time the instruction reaches them; the two differ once a source operand moves PC.
+ * @return Instruction to execute
+ */
+const Decoded* Processor::decode() {
+	PWORD pc = registers[PC];
+	if ((pc & 1) || pc >= coreSizeBytes)
+		return Dispatcher::fetchFault();
+	registers[PC] = pc + (PWORD)2;
+	const Decoded* d = &dispatch[core.word[pc >> 1]];
+	if (!(d->operands & (OPND_SRC | OPND_DST)))
+		return d;
+	PWORD next = pc + (PWORD)2;
+	fresh = *d;
+	if (fresh.operands & OPND_SRC)
+		fresh.srcMode = Dispatcher::indexWord(*this, fresh.srcMode, fresh.srcReg, true, next, fresh.srcWord);
+	if (fresh.operands & OPND_DST)
+		fresh.dstMode = Dispatcher::indexWord(*this, fresh.dstMode, fresh.dstReg, false, next, fresh.dstWord);
+	if (next == (PWORD)(pc + 2))
+		return d;
+	Dispatcher::specialize(fresh);
+	return &fresh;
+}
+
+/**
+ * Fetch, decode and execute a single instruction. Instructions are decoded once into the instruction cache and run
+ * from there until something writes over them.
+ * @return True if the processor is still running afterwards
+ */
+bool Processor::step() {
+	if (halted)
+		return false;
+	const Decoded* d = fetch();
+	d->handler(*this, *d);
+	return !halted;
+}
+
+/**
+ * Run the instruction at PC, or if it's a superinstruction, as much of it as there's room for. The translator hands
+ * copy and clear loops to this.
+ * @param room Most instructions that may be run, at least one
+ * @return Number of instructions run
+ */
+uint64_t Processor::stepFused(uint64_t room) {
+#define		FUSED_CASE(name) \
+		case OP_##name: \
+			return (uint64_t)Dispatcher::name(*this, *d, room);
+
+	const Decoded* d = fetch();
+	if (room >= 2) {
+		switch (d->op) {
+			FUSED_OPS(FUSED_CASE)
+			default:
+				break;
+		}
+	}
+	d->handler(*this, *d);
+	return 1;
+}
+
+/**
+ * Execute instructions until the budget runs out or the processor halts. The engine picked by mode() is handed a slice
+ * of the budget at a time as its deadline, running up to the next scheduled interrupt at most; it counts the deadline
+ * down and only looks at it, once per instruction or once per translated block, to see whether to come back here.
+ * Anything that needs seeing to sooner, like a halt or an interrupt the processor's priority now lets through, stops
+ * it by pushing the deadline far below zero. Interrupts are taken and trace traps made in between slices.
+ * @param budget Maximum number of instructions to execute, with time spent waiting for an interrupt counted as well
+ * @return Number of instructions executed, and instructions' worth of time spent waiting for an interrupt
+ */
+uint64_t Processor::run(uint64_t budget) {
+	if (guard && guard->thrashing())
+		writeGuard(false);
+	uint64_t n = 0;
+	while (n < budget) {
+		if (!service()) {
+			if (halted || scheduled.empty())
+				break;
+			//Nothing to do until the next scheduled interrupt
+			uint64_t idle = std::min(scheduled.front().due - clock, budget - n);
+			n += idle;
+			clock += idle;
+			continue;
+		}
+		uint64_t room = budget - n;
+		if (!scheduled.empty())
+			room = std::min(room, scheduled.front().due - clock);
+		room = std::min(room, (uint64_t)DEADLINE_SLICE);
+		stopped = false;
+		if (ps & ST) {
+			//Trace trap after every instruction, besides the one that set the trace bit
+			step();
+			if (!halted)
+				trap(VEC_BPT);
+			n++;
+			clock++;
+			continue;
+		}
+		slice = deadline = (int64_t)room;
+		if (native && execMode != EXEC_TIERED)
+			runNative();
+		else {
+			switch (execMode) {
+				case EXEC_THREADED:
+					runThreaded();
+					break;
+				case EXEC_SWITCH:
+					runSwitch();
+					break;
+				case EXEC_JIT:
+					runJit();
+					break;
+				case EXEC_TIERED:
+					runTiered();
+					break;
+				default:
+					runCall();
+					break;
+			}
+		}
+		if (stopped)
+			deadline += DEADLINE_STOP;
+		uint64_t ran = (uint64_t)(slice - deadline);
+		n += ran;
+		clock += ran;
+		slice = deadline = 0;
+		stopped = false;
+	}
+	return n;
+}
+
+/**
+ * Central dispatch loop; one indirect call per instruction
+ */
+void Processor::runCall() {
+	while (deadline > 0) {
+		const Decoded* d = fetch();
+		d->handler(*this, *d);
+		deadline--;
+	}
+}
+
+/**
+ * Switch interpreter; the handlers are inlined into the cases of one big switch
+ */
+void Processor::runSwitch() {
+#define		SWITCH_CASE(name) \
+		case OP_##name: \
+			Dispatcher::name(*this, *d); \
+			break;
+#define		SWITCH_RR_CASE(name)	SWITCH_CASE(name##_rr)
+#define		SWITCH_FUSED_CASE(name) \
+		case OP_##name: \
+			if (deadline >= 2) { \
+				deadline -= (int64_t)Dispatcher::name(*this, *d, (uint64_t)deadline); \
+				continue; \
+			} \
+			d->handler(*this, *d); \
+			break;
+
+	while (deadline > 0) {
+		const Decoded* d = fetch();
+		switch (d->op) {
+			HANDLERS(SWITCH_CASE, SWITCH_RR_CASE)
+			FUSED_OPS(SWITCH_FUSED_CASE)
+			default:
+				break;
+		}
+		deadline--;
+	}
+}
+
+/**
+ * Direct threaded interpreter. Each handler is inlined at its own label and ends by fetching the next instruction and
+ * jumping straight to its label, so every handler gets its own indirect jump for the host to predict. Without
+ * computed goto support (see the PDP_COMPUTED_GOTO build option) this is the switch interpreter.
+ */
+void Processor::runThreaded() {
+#ifdef PDP_COMPUTED_GOTO
+#define		LABEL_ADDR(name)	&&L_##name,
+#define		LABEL_RR_ADDR(name)	LABEL_ADDR(name##_rr)
+#define		LABEL_BODY(name) \
+	L_##name: \
+		Dispatcher::name(*this, *d); \
+		if (--deadline <= 0) \
+			return; \
+		d = fetch(); \
+		goto *labels[d->op];
+#define		LABEL_RR_BODY(name)	LABEL_BODY(name##_rr)
+#define		LABEL_FUSED_BODY(name) \
+	L_##name: \
+		if (deadline < 2) { \
+			d->handler(*this, *d); \
+			deadline--; \
+			return; \
+		} \
+		deadline -= (int64_t)Dispatcher::name(*this, *d, (uint64_t)deadline); \
+		if (deadline <= 0) \
+			return; \
+		d = fetch(); \
+		goto *labels[d->op];
+
+	static void* const labels[] = { HANDLERS(LABEL_ADDR, LABEL_RR_ADDR) FUSED_OPS(LABEL_ADDR) };
+	if (deadline <= 0)
+		return;
+	const Decoded* d = fetch();
+	goto *labels[d->op];
+	HANDLERS(LABEL_BODY, LABEL_RR_BODY)
+	FUSED_OPS(LABEL_FUSED_BODY)
+#else
+	runSwitch();
+#endif
+}
+
+/**
+ * Tiered engine: every block starts out decoded afresh each time it runs, which costs nothing up front; once it has
+ * been entered warmAt times its instructions are predecoded, and once it has been entered hotAt times it's queued
+ * for translation on a background thread, carrying on predecoded until that's done. Translated blocks chain straight
+ * into each other, so only entries to blocks that haven't been translated yet come back here to be counted. Blocks
+ * recompiled ahead of time (see loadNative()) skip all of that and run natively from the start.
+ */
+void Processor::runTiered() {
+	while (deadline > 0) {
+		if (native && native->run())
+			continue;
+		PWORD pc = registers[PC];
+		uint32_t count = 0;
+		if (!(pc & 1) && pc < coreSizeBytes) {
+			count = heat[pc >> 1];
+			if (count < hotAt)
+				heat[pc >> 1] = ++count;
+		}
+		if (count < hotAt || !runTranslated(true))
+			runBlock(count >= warmAt);
+	}
+}
+
+/**
+ * Run blocks recompiled ahead of time wherever PC reaches one, and everything else a basic block at a time, so as to
+ * look for one at every block boundary: interpreted, or under EXEC_JIT translated, in which case only blocks that
+ * translated code doesn't chain straight past are looked for. The tiered engine looks for them itself.
+ */
+void Processor::runNative() {
+	while (deadline > 0) {
+		if (native->run())
+			continue;
+		if (execMode == EXEC_JIT && runTranslated(false))
+			continue;
+		runBlock(true);
+	}
+}
+
+/**
+ * Interpret instructions up to and including the next one that ends a basic block, or until the deadline passes
+ * @param predecoded Whether to run out of the instruction cache, or decode every instruction from scratch
+ */
+void Processor::runBlock(bool predecoded) {
+	while (deadline > 0) {
+		const Decoded* d = predecoded ? fetch() : decode();
+		d->handler(*this, *d);
+		deadline--;
+		if (endsBlock(plainOp(d->op)))
+			break;
+	}
+}
+
+/**
+ * Set how many times the tiered engine has to enter a block before it predecodes it, and before it translates it.
+ * Blocks already promoted stay that way.
+ * @param warm Entries before predecoding; 0 predecodes everything
+ * @param hot Entries before translating; 0 translates everything
+ */
+void Processor::tiers(uint32_t warm, uint32_t hot) {
+	warmAt = warm;
+	hotAt = hot;
+}
+
+/**
+ * Get the interpreter run() uses
+ */
+ExecMode Processor::mode() const {
+	return execMode;
+}
+
+/**
+ * Pick the interpreter run() uses. They all behave identically; only their speed differs.
+ */
+void Processor::mode(ExecMode mode) {
+	execMode = mode;
+}
+
+/**
+ * Hand out the dispatch table to the Processor constructors
+ */
+const Decoded* Processor::dispatchTable() {
+	return Dispatcher::table();
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "Processor.h"
+
+/*
+ * Handler numbering shared by the interpreters in Dispatch.cpp and the translator in Jit.cpp. Decoded::op holds one of
+ * these.
+ */
+
+//Handlers, by format. The threaded and switch interpreters generate their labels and cases from these.
+#define		BRANCH_OPS(X) \
+	X(bne) X(beq) X(bge) X(blt) X(bgt) X(ble) X(bpl) X(bmi) X(bhi) X(blos) X(bvc) X(bvs) X(bcc) X(bcs)
+#define		OTHER_OPS(X) \
+	X(halt) X(wait) X(rti) X(bpt) X(iot) X(reset) X(rtt) X(emt) X(trap) X(reserved) X(buserr) \
+	X(br) BRANCH_OPS(X) \
+	X(jmp) X(jsr) X(rts) X(sob) X(spl) X(ccop)
+#define		DOUBLE_OPS(X)	X(mov) X(cmp) X(bit) X(bic) X(bis) X(add) X(sub)
+#define		SINGLE_OPS(X) \
+	X(clr) X(com) X(inc) X(dec) X(neg) X(adc) X(sbc) X(tst) X(ror) X(rol) X(asr) X(asl) X(swab) X(sxt)
+#define		REG_OPS(X)		X(mul) X(div) X(ash) X(ashc) X(xor_)
+#define		MODAL_OPS(X)	DOUBLE_OPS(X) SINGLE_OPS(X) REG_OPS(X)
+#define		HANDLERS(X, X_RR)	OTHER_OPS(X) MODAL_OPS(X) MODAL_OPS(X_RR)
+
+//Superinstructions, each an instruction fused with the conditional branch or SOB after it. Only the threaded and
+//switch interpreters run these; everything else runs the first instruction's own handler.
+#define		FUSED_OPS(X)	X(cmp_bxx) X(bit_bxx) X(tst_bxx) X(dec_bxx) X(copy_sob) X(clr_sob)
+
+#define		OP_ID(name)			OP_##name,
+#define		OP_RR_ID(name)		OP_##name##_rr,
+#define		OP_NAME(name)		#name,
+
+//Handler numbers; the all-register versions of the modal handlers follow the modal handlers, in the same order, and
+//the superinstructions come last
+enum OpId : PBYTE { OTHER_OPS(OP_ID) MODAL_OPS(OP_ID) MODAL_OPS(OP_RR_ID) FUSED_OPS(OP_ID) OP_COUNT };
+#define		OP_RR_OFFSET	(OP_mov_rr - OP_mov)
+
+/**
+ * Handler number of an instruction on its own, leaving out register-only versions and superinstructions
+ */
+inline PBYTE plainOp(PBYTE op) {
+	switch (op) {
+		case OP_cmp_bxx: return OP_cmp;
+		case OP_bit_bxx: return OP_bit;
+		case OP_tst_bxx: return OP_tst;
+		case OP_dec_bxx: return OP_dec;
+		case OP_copy_sob: return OP_mov;
+		case OP_clr_sob: return OP_clr;
+		default: return (PBYTE)(op >= OP_mov_rr ? op - OP_RR_OFFSET : op);
+	}
+}
+
+/**
+ * Name of a plain handler, which is also the name of the Processor method it runs
+ */
+inline const char* opName(PBYTE op) {
+	static const char* const names[] = { OTHER_OPS(OP_NAME) MODAL_OPS(OP_NAME) };
+	return names[op];
+}
+
+/**
+ * Whether an instruction, by its plain handler number, always ends a basic block: branches, jumps, traps and the like
+ */
+inline bool endsBlock(PBYTE op) {
+	switch (op) {
+		case OP_reset:
+		case OP_spl:
+		case OP_ccop:
+			return false;
+		default:
+			return op <= OP_ccop;
+	}
+}
+
+/**
+ * Whether a predecoded operand in this mode is followed by an index or immediate word
+ */
+inline bool extraWord(PBYTE mode, PBYTE reg) {
+	return mode >= MODE_INDEX || (reg == PC && (mode == MODE_AINC || mode == MODE_AINCDEF));
+}
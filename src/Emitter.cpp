@@ -0,0 +1,337 @@
+#include <cstring>
+#include "Emitter.h"
+
+/**
+ * Start emitting at the beginning of a buffer
+ * @param buf Buffer to emit into
+ * @param cap Size of the buffer in bytes; anything past it is dropped, and full() says so
+ */
+Emitter::Emitter(PBYTE* buf, size_t cap) : buf(buf), pos(0), cap(cap), overflowed(false) {
+}
+
+/**
+ * Address the next byte will be emitted at
+ */
+PBYTE* Emitter::here() const {
+	return buf + pos;
+}
+
+/**
+ * Positions of the rel32 fields that point outside the buffer, which would need adjusting if the code were moved
+ */
+const std::vector<size_t>& Emitter::relocations() const {
+	return relocs;
+}
+
+/**
+ * Bytes emitted so far
+ */
+size_t Emitter::size() const {
+	return pos;
+}
+
+/**
+ * Whether the buffer ran out, in which case the code emitted is incomplete and mustn't be run
+ */
+bool Emitter::full() const {
+	return overflowed;
+}
+
+void Emitter::byte(PBYTE b) {
+	if (pos >= cap) {
+		overflowed = true;
+		return;
+	}
+	buf[pos++] = b;
+}
+
+void Emitter::dword(uint32_t d) {
+	for (int i = 0; i < 4; i++)
+		byte((PBYTE)(d >> (8 * i)));
+}
+
+/**
+ * Operand size prefix and REX prefix, if needed
+ * @param byteRegs Force a REX prefix, so that byte registers 4-7 mean SPL-DIL rather than AH-BH
+ */
+void Emitter::rex(Width w, int reg, int index, int base, bool byteRegs) {
+	if (w == W16)
+		byte(0x66);
+	PBYTE bits = (PBYTE)((w == W64 ? 8 : 0) | (reg & 8 ? 4 : 0) | (index & 8 ? 2 : 0) | (base & 8 ? 1 : 0));
+	if (bits || byteRegs)
+		byte((PBYTE)(0x40 | bits));
+}
+
+/**
+ * Register-direct instruction; opcodes over 0xFF are two byte 0F xx opcodes
+ */
+void Emitter::op(Width w, unsigned opcode, int reg, HostReg rm) {
+	bool byteRegs = w == W8 && ((reg >= 4 && reg < 8) || (rm >= 4 && rm < 8));
+	rex(w, reg, 0, rm, byteRegs);
+	if (opcode > 0xFF)
+		byte((PBYTE)(opcode >> 8));
+	byte((PBYTE)opcode);
+	byte((PBYTE)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+/**
+ * Instruction with a memory operand
+ */
+void Emitter::op(Width w, unsigned opcode, int reg, const Mem& rm) {
+	rex(w, reg, rm.index == NOREG ? 0 : rm.index, rm.base, w == W8 && reg >= 4 && reg < 8);
+	if (opcode > 0xFF)
+		byte((PBYTE)(opcode >> 8));
+	byte((PBYTE)opcode);
+	modrm(reg, rm);
+}
+
+/**
+ * ModRM, SIB and displacement bytes for a memory operand. RSP and R12 as a base need a SIB byte, and RBP and R13 as a
+ * base need a displacement.
+ */
+void Emitter::modrm(int reg, const Mem& rm) {
+	int base = rm.base & 7;
+	bool sib = rm.index != NOREG || base == 4;
+	int mod = (rm.disp == 0 && base != 5) ? 0 : (rm.disp >= -128 && rm.disp <= 127 ? 1 : 2);
+	byte((PBYTE)(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base)));
+	if (sib)
+		byte((PBYTE)(((rm.index == NOREG ? 4 : rm.index) & 7) << 3 | base));
+	if (mod == 1)
+		byte((PBYTE)rm.disp);
+	else if (mod == 2)
+		dword((uint32_t)rm.disp);
+}
+
+/**
+ * Immediate operand; 64 bit operations take a sign-extended 32 bit immediate
+ */
+void Emitter::imm(Width w, int32_t imm) {
+	if (w == W8)
+		byte((PBYTE)imm);
+	else if (w == W16) {
+		byte((PBYTE)imm);
+		byte((PBYTE)(imm >> 8));
+	}
+	else
+		dword((uint32_t)imm);
+}
+
+void Emitter::mov(Width w, HostReg dst, HostReg src) {
+	op(w, w == W8 ? 0x88 : 0x89, src, dst);
+}
+
+void Emitter::mov(Width w, HostReg dst, const Mem& src) {
+	op(w, w == W8 ? 0x8A : 0x8B, dst, src);
+}
+
+void Emitter::mov(Width w, const Mem& dst, HostReg src) {
+	op(w, w == W8 ? 0x88 : 0x89, src, dst);
+}
+
+void Emitter::mov(Width w, const Mem& dst, int32_t imm) {
+	op(w, w == W8 ? 0xC6 : 0xC7, 0, dst);
+	this->imm(w == W64 ? W32 : w, imm);
+}
+
+/**
+ * Load a 32 bit immediate, zero extending it into the whole register
+ */
+void Emitter::mov(HostReg dst, uint32_t imm) {
+	rex(W32, 0, 0, dst, false);
+	byte((PBYTE)(0xB8 | (dst & 7)));
+	dword(imm);
+}
+
+void Emitter::mov64(HostReg dst, uint64_t imm) {
+	rex(W64, 0, 0, dst, false);
+	byte((PBYTE)(0xB8 | (dst & 7)));
+	dword((uint32_t)imm);
+	dword((uint32_t)(imm >> 32));
+}
+
+/**
+ * Zero extend a byte or word into a 32 bit register
+ * @param w Width of the source
+ */
+void Emitter::movzx(HostReg dst, Width w, HostReg src) {
+	rex(W32, dst, 0, src, w == W8 && src >= 4 && src < 8);
+	byte(0x0F);
+	byte(w == W8 ? 0xB6 : 0xB7);
+	byte((PBYTE)(0xC0 | (dst & 7) << 3 | (src & 7)));
+}
+
+void Emitter::movzx(HostReg dst, Width w, const Mem& src) {
+	op(W32, w == W8 ? 0x0FB6 : 0x0FB7, dst, src);
+}
+
+void Emitter::lea(HostReg dst, const Mem& src) {
+	op(W64, 0x8D, dst, src);
+}
+
+/**
+ * Load an address, RIP-relative, so it has to be within 2GB of the code
+ */
+void Emitter::lea(HostReg dst, const void* target) {
+	rex(W64, dst, 0, 0, false);
+	byte(0x8D);
+	byte((PBYTE)((dst & 7) << 3 | 5));
+	outside(pos, target);
+	dword((uint32_t)((const PBYTE*)target - (const PBYTE*)(buf + pos + 4)));
+}
+
+void Emitter::alu(AluOp aluOp, Width w, HostReg dst, HostReg src) {
+	op(w, (unsigned)(aluOp << 3 | (w == W8 ? 0 : 1)), src, dst);
+}
+
+void Emitter::alu(AluOp aluOp, Width w, HostReg dst, const Mem& src) {
+	op(w, (unsigned)(aluOp << 3 | (w == W8 ? 2 : 3)), dst, src);
+}
+
+void Emitter::alu(AluOp aluOp, Width w, const Mem& dst, HostReg src) {
+	op(w, (unsigned)(aluOp << 3 | (w == W8 ? 0 : 1)), src, dst);
+}
+
+void Emitter::alu(AluOp aluOp, Width w, HostReg dst, int32_t imm) {
+	bool short8 = w != W8 && imm >= -128 && imm <= 127;
+	op(w, w == W8 ? 0x80 : (short8 ? 0x83 : 0x81), aluOp, dst);
+	this->imm(short8 ? W8 : (w == W64 ? W32 : w), imm);
+}
+
+void Emitter::alu(AluOp aluOp, Width w, const Mem& dst, int32_t imm) {
+	bool short8 = w != W8 && imm >= -128 && imm <= 127;
+	op(w, w == W8 ? 0x80 : (short8 ? 0x83 : 0x81), aluOp, dst);
+	this->imm(short8 ? W8 : (w == W64 ? W32 : w), imm);
+}
+
+void Emitter::test(Width w, HostReg a, HostReg b) {
+	op(w, w == W8 ? 0x84 : 0x85, b, a);
+}
+
+void Emitter::test(Width w, HostReg a, int32_t imm) {
+	op(w, w == W8 ? 0xF6 : 0xF7, 0, a);
+	this->imm(w == W64 ? W32 : w, imm);
+}
+
+void Emitter::test(Width w, const Mem& a, int32_t imm) {
+	op(w, w == W8 ? 0xF6 : 0xF7, 0, a);
+	this->imm(w == W64 ? W32 : w, imm);
+}
+
+void Emitter::unary(UnaryOp unaryOp, Width w, HostReg reg) {
+	op(w, w == W8 ? 0xF6 : 0xF7, unaryOp, reg);
+}
+
+void Emitter::shift(ShiftOp shiftOp, Width w, HostReg reg, PBYTE n) {
+	if (n == 1)
+		op(w, w == W8 ? 0xD0 : 0xD1, shiftOp, reg);
+	else {
+		op(w, w == W8 ? 0xC0 : 0xC1, shiftOp, reg);
+		byte(n);
+	}
+}
+
+void Emitter::bt(Width w, HostReg base, HostReg bit) {
+	op(w, 0x0FA3, bit, base);
+}
+
+void Emitter::setcc(Cond cc, HostReg dst) {
+	op(W8, 0x0F90u | cc, 0, dst);
+}
+
+size_t Emitter::jcc(Cond cc) {
+	byte(0x0F);
+	byte((PBYTE)(0x80 | cc));
+	size_t at = pos;
+	dword(0);
+	return at;
+}
+
+size_t Emitter::jmp() {
+	byte(0xE9);
+	size_t at = pos;
+	dword(0);
+	return at;
+}
+
+void Emitter::jcc(Cond cc, const PBYTE* target) {
+	bind(jcc(cc), target);
+}
+
+void Emitter::jmp(const PBYTE* target) {
+	bind(jmp(), target);
+}
+
+void Emitter::jmp(HostReg target) {
+	op(W32, 0xFF, 4, target);
+}
+
+void Emitter::jmp(const Mem& target) {
+	op(W32, 0xFF, 4, target);
+}
+
+/**
+ * Call through a pointer, RIP-relative, so the pointer has to be within 2GB of the code
+ */
+void Emitter::call(const void* const* slot) {
+	byte(0xFF);
+	byte(0x15);
+	outside(pos, slot);
+	dword((uint32_t)((const PBYTE*)slot - (const PBYTE*)(buf + pos + 4)));
+}
+
+void Emitter::push(HostReg reg) {
+	rex(W32, 0, 0, reg, false);
+	byte((PBYTE)(0x50 | (reg & 7)));
+}
+
+void Emitter::pop(HostReg reg) {
+	rex(W32, 0, 0, reg, false);
+	byte((PBYTE)(0x58 | (reg & 7)));
+}
+
+void Emitter::ret() {
+	byte(0xC3);
+}
+
+/**
+ * Point a jump emitted earlier at the current position
+ * @param at Position of the jump's rel32 field
+ */
+void Emitter::bind(size_t at) {
+	bind(at, buf + pos);
+}
+
+/**
+ * Seven byte NOP whose displacement is a rel32 field, for bind(), pointing somewhere from the instruction after it.
+ * Nothing ever jumps through it, but a signal handler can read it back; see Jit::divert().
+ * @return Position of the rel32 field
+ */
+size_t Emitter::hint() {
+	byte(0x0F);
+	byte(0x1F);
+	byte(0x80);
+	size_t at = pos;
+	dword(0);
+	return at;
+}
+
+/**
+ * Point a jump emitted earlier at the given address
+ * @param at Position of the jump's rel32 field
+ * @param target Address to jump to
+ */
+void Emitter::bind(size_t at, const PBYTE* target) {
+	if (at + 4 > cap)
+		return;
+	outside(at, target);
+	int32_t rel = (int32_t)(target - (const PBYTE*)(buf + at + 4));
+	memcpy(buf + at, &rel, 4);
+}
+
+/**
+ * Note a rel32 field if it points outside the buffer
+ */
+void Emitter::outside(size_t at, const void* target) {
+	if ((const PBYTE*)target < buf || (const PBYTE*)target >= buf + cap)
+		relocs.push_back(at);
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "defs.h"
+
+/*
+ * Just enough of an x86-64 assembler for the translator: moves, ALU operations, shifts, setcc and jumps, on general
+ * purpose registers and [base + index + disp] memory operands.
+ */
+
+//x86-64 general purpose registers, in encoding order
+enum HostReg : PBYTE {RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, NOREG = 0xFF};
+
+//Operand sizes
+enum Width : PBYTE {W8, W16, W32, W64};
+
+//Condition codes, for jcc and setcc
+enum Cond : PBYTE {CC_O = 0, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE,
+	CC_LE, CC_G};
+
+//Group 1 ALU operations, by their /r field
+enum AluOp : PBYTE {ALU_ADD = 0, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP};
+
+//Group 2 shifts and rotates, by their /r field
+enum ShiftOp : PBYTE {SH_ROL = 0, SH_ROR, SH_RCL, SH_RCR, SH_SHL, SH_SHR, SH_SAL, SH_SAR};
+
+//Group 3 unary operations, by their /r field
+enum UnaryOp : PBYTE {UN_NOT = 2, UN_NEG = 3};
+
+/**
+ * Memory operand, [base + index + disp]
+ */
+struct Mem {
+	HostReg base;
+	HostReg index;
+	int32_t disp;
+};
+
+inline Mem mem(HostReg base, int32_t disp = 0) {
+	return Mem{base, NOREG, disp};
+}
+
+inline Mem mem(HostReg base, HostReg index, int32_t disp = 0) {
+	return Mem{base, index, disp};
+}
+
+class Emitter {
+public:
+	Emitter(PBYTE* buf, size_t cap);
+
+	PBYTE* here() const;
+	size_t size() const;
+	bool full() const;
+	const std::vector<size_t>& relocations() const;
+
+	//Data movement
+	void mov(Width w, HostReg dst, HostReg src);
+	void mov(Width w, HostReg dst, const Mem& src);
+	void mov(Width w, const Mem& dst, HostReg src);
+	void mov(Width w, const Mem& dst, int32_t imm);
+	void mov(HostReg dst, uint32_t imm);
+	void mov64(HostReg dst, uint64_t imm);
+	void movzx(HostReg dst, Width w, HostReg src);
+	void movzx(HostReg dst, Width w, const Mem& src);
+	void lea(HostReg dst, const Mem& src);
+	void lea(HostReg dst, const void* target);
+
+	//Arithmetic and logic
+	void alu(AluOp op, Width w, HostReg dst, HostReg src);
+	void alu(AluOp op, Width w, HostReg dst, const Mem& src);
+	void alu(AluOp op, Width w, const Mem& dst, HostReg src);
+	void alu(AluOp op, Width w, HostReg dst, int32_t imm);
+	void alu(AluOp op, Width w, const Mem& dst, int32_t imm);
+	void test(Width w, HostReg a, HostReg b);
+	void test(Width w, HostReg a, int32_t imm);
+	void test(Width w, const Mem& a, int32_t imm);
+	void unary(UnaryOp op, Width w, HostReg reg);
+	void shift(ShiftOp op, Width w, HostReg reg, PBYTE n);
+	void bt(Width w, HostReg base, HostReg bit);
+	void setcc(Cond cc, HostReg dst);
+
+	//Control flow. The jumps return the position of their rel32 field, for bind().
+	size_t jcc(Cond cc);
+	size_t jmp();
+	void jcc(Cond cc, const PBYTE* target);
+	void jmp(const PBYTE* target);
+	void jmp(HostReg target);
+	void jmp(const Mem& target);
+	void call(const void* const* slot);
+	void push(HostReg reg);
+	void pop(HostReg reg);
+	void ret();
+	void bind(size_t at);
+	void bind(size_t at, const PBYTE* target);
+	size_t hint();
+
+	void byte(PBYTE b);
+	void dword(uint32_t d);
+
+private:
+	void rex(Width w, int reg, int index, int base, bool byteRegs);
+	void op(Width w, unsigned opcode, int reg, HostReg rm);
+	void op(Width w, unsigned opcode, int reg, const Mem& rm);
+	void modrm(int reg, const Mem& rm);
+	void imm(Width w, int32_t imm);
+
+	void outside(size_t at, const void* target);
+
+	PBYTE* buf;
+	size_t pos;
+	size_t cap;
+	bool overflowed;
+	std::vector<size_t> relocs;	//!< Positions of rel32 fields that point outside the buffer
+};
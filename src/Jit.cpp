@@ -0,0 +1,2098 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include "Jit.h"
+#include "WriteGuard.h"
+
+/*
+ * Translated code runs with r15 pointing at the Processor and r14 at core. eax, ecx, edx and r11 are scratch: by
+ * convention the destination value and then the result go in eax, the address of a memory destination in ecx and the
+ * source value in edx, while r11 collects condition codes.
+ *
+ * R0-SP and ps are kept in host registers, zero extended, from entry until the exit code, across chained blocks, and
+ * are only spilled to the Processor around helper calls. PC is only stored on the way out of a block, since within a
+ * block it's known at translation time.
+ *
+ * ps is always settled while translated code runs; the interpreter's lazy flags are settled before entering a block
+ * and after every instruction the interpreter runs on a block's behalf.
+ */
+
+#ifdef PDP_JIT
+#include <sys/mman.h>
+
+static_assert(std::is_standard_layout<Processor>::value, "translated code addresses Processor fields by offset");
+static_assert(sizeof(JitTarget) == 16, "translated code indexes the indirect branch table by shifting");
+
+#define		OFF(member)		offsetof(Processor, member)
+#define		HOST_PS			RSI		//!< Host register ps is kept in
+
+//Host registers R0-SP are kept in
+static const HostReg pinned[PC] = {RBX, RBP, R12, R13, R8, R9, R10};
+
+/**
+ * Set up the code buffer, with the helper table, indirect branch table, entry and exit code at the start of it
+ * @param cpu Processor to translate code for
+ */
+Jit::Jit(Processor& cpu) : cpu(cpu), used(0), window(0), limit(0), codeStart(0), entry(nullptr), exit(nullptr),
+						   helpers(nullptr), hits(nullptr), stats(), dirty(false), guarded(cpu.guard != nullptr),
+						   fenced(cpu.guard && cpu.guard->fenced() && (!cpu.ports || WriteGuard::diverts())),
+						   bussed(cpu.ports != nullptr),
+						   targets(nullptr), returns(nullptr), ports(nullptr), ready(false), stopping(false), epoch(0),
+						   cache(nullptr), symbols(nullptr), dumped(nullptr), out(nullptr), length(0), done(0), site(0),
+						   current(nullptr), accessed(0), irInst(0), irAccesses(0) {
+	int pages = (cpu.coreSizeBytes >> ICACHE_PAGE_BITS) + 1;
+	blocks = new JitBlock*[cpu.coreSizeBytes / 2]();
+	queued = new bool[cpu.coreSizeBytes / 2]();
+	pageWrites = new uint32_t[pages]();
+	cacheChecked = new bool[pages]();
+	pageFresh = new bool[pages]();
+	buffer = (PBYTE*)mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+						  -1, 0);
+	if (buffer == MAP_FAILED) {
+		buffer = nullptr;
+		return;
+	}
+
+	//Helpers are called through this table, and the indirect branch table is addressed, RIP-relative, so that
+	//they're in reach wherever the buffer ends up and translated code can be moved about within it
+	helpers = (const void**)buffer;
+	helpers[HELPER_STEP] = (const void*)&helperStep;
+	helpers[HELPER_TRAP] = (const void*)&helperTrap;
+	helpers[HELPER_WRITTEN] = (const void*)&helperWritten;
+	helpers[HELPER_LOOP] = (const void*)&helperLoop;
+	helpers[HELPER_READ] = (const void*)&helperRead;
+	helpers[HELPER_WRITE] = (const void*)&helperWrite;
+	size_t tableAt = (HELPER_COUNT * sizeof(void*) + 63) & ~(size_t)63;
+	targets = (JitTarget*)(buffer + tableAt);
+	for (int i = 0; i < 1 << JIT_TARGET_BITS; i++)
+		targets[i] = JitTarget{JIT_TARGET_NONE, 0, nullptr};
+	size_t returnsAt = tableAt + sizeof(JitTarget) * (1 << JIT_TARGET_BITS);
+	returns = (JitReturnStack*)(buffer + returnsAt);
+	forgetReturns();
+	size_t portsAt = returnsAt + sizeof(JitReturnStack);
+	ports = (JitPort*)(buffer + portsAt);
+	forgetPorts();
+	size_t hitsAt = portsAt + sizeof(JitPort) * (1 << JIT_PORT_BITS);
+	hits = buffer + hitsAt;
+
+	//Code starts on a page of its own, away from the hit flags blocks keep writing to
+	size_t stubsAt = (hitsAt + (size_t)cpu.coreSizeBytes / 2 + 4095) & ~(size_t)4095;
+
+	//entry(cpu, code, core): save callee-saved registers, keeping the stack 16 byte aligned, then jump into the block
+	Emitter e(buffer + stubsAt, 256);
+	out = &e;
+	entry = (Entry)(void*)e.here();
+	for (HostReg r : {RBX, RBP, R12, R13, R14, R15})
+		e.push(r);
+	e.alu(ALU_SUB, W64, RSP, 8);
+	e.mov(W64, R15, RDI);
+	e.mov(W64, R14, RDX);
+	e.mov(W64, RAX, RSI);
+	reload();
+	e.jmp(RAX);
+
+	//Blocks leave by jumping here
+	exit = e.here();
+	spill();
+	e.alu(ALU_ADD, W64, RSP, 8);
+	for (HostReg r : {R15, R14, R13, R12, RBP, RBX})
+		e.pop(r);
+	e.ret();
+	out = nullptr;
+
+	codeStart = (stubsAt + e.size() + 15) & ~(size_t)15;
+	used = codeStart;
+	window = limit = JIT_BUFFER_SIZE;
+}
+
+Jit::~Jit() {
+	stop();
+	flush();
+	delete cache;
+	delete symbols;
+	if (dumped)
+		fclose(dumped);
+	delete[] blocks;
+	delete[] queued;
+	delete[] pageWrites;
+	delete[] cacheChecked;
+	delete[] pageFresh;
+	if (buffer)
+		munmap(buffer, JIT_BUFFER_SIZE);
+}
+
+/**
+ * Whether a code buffer could be had; without one nothing can be translated
+ */
+bool Jit::usable() const {
+	return buffer != nullptr;
+}
+
+/**
+ * Find the translation of the block starting at pc, translating it if there isn't one yet
+ * @param pc Guest address
+ * @return Translated block, or null if there's nothing at pc that can be translated
+ */
+const JitBlock* Jit::lookup(PWORD pc) {
+	if (!buffer || (pc & 1) || pc >= cpu.coreSizeBytes)
+		return nullptr;
+	if (cache && !cacheChecked[pc >> ICACHE_PAGE_BITS])
+		restore(pc >> ICACHE_PAGE_BITS);
+	JitBlock* block = blocks[pc >> 1];
+	stats.lookups++;
+	if (block)
+		stats.hits++;
+	else
+		block = translate(pc);
+	if (block)
+		remember(block);
+	return block;
+}
+
+/**
+ * Find the translation of the block starting at pc, queueing it to be translated in the background if there isn't one
+ * yet. Blocks translated since the last call are installed first.
+ * @param pc Guest address
+ * @return Translated block, or null if it hasn't been translated yet or there's nothing at pc that can be
+ */
+const JitBlock* Jit::prepare(PWORD pc) {
+	if (ready.load(std::memory_order_acquire))
+		collect();
+	if (!buffer || (pc & 1) || pc >= cpu.coreSizeBytes)
+		return nullptr;
+	if (cache && !cacheChecked[pc >> ICACHE_PAGE_BITS])
+		restore(pc >> ICACHE_PAGE_BITS);
+	JitBlock* block = blocks[pc >> 1];
+	stats.lookups++;
+	if (block) {
+		stats.hits++;
+		remember(block);
+		return block;
+	}
+	if (queued[pc >> 1])
+		return nullptr;
+
+	Job job = {scan(pc), epoch, 0, nullptr};
+	if (job.insts.empty())
+		return nullptr;
+	job.stamp = stamp(pc, job.insts.back().next);
+	queued[pc >> 1] = true;
+	{
+		std::lock_guard<std::mutex> hold(queueLock);
+		queue.push_back(std::move(job));
+	}
+	if (!worker.joinable())
+		worker = std::thread(&Jit::work, this);
+	wake.notify_one();
+	return nullptr;
+}
+
+/**
+ * Run a translated block, and whatever it chains on to, taking what runs off the processor's deadline
+ * @param block Block to run; it must be no longer than the deadline
+ */
+void Jit::enter(const JitBlock* block) {
+	cpu.settleFlags();
+	if (cpu.codeWritten)
+		cpu.guard->settle();
+	entry(&cpu, block->code, cpu.core.word);
+	if (cpu.guard)
+		cpu.guard->close();
+}
+
+/**
+ * Drop the translations of any blocks built from words in the same page as addr. Their host code stays put until the
+ * next flush, since one of them may be running.
+ * @param addr Byte address written to
+ */
+void Jit::invalidate(PWORD addr) {
+	pageWrites[addr >> ICACHE_PAGE_BITS]++;
+	cacheChecked[addr >> ICACHE_PAGE_BITS] = false;
+	pageFresh[addr >> ICACHE_PAGE_BITS] = false;
+	int first = addr >> ICACHE_PAGE_BITS << ICACHE_PAGE_BITS;
+	int last = first + (1 << ICACHE_PAGE_BITS);
+	if (last > cpu.coreSizeBytes)
+		last = cpu.coreSizeBytes;
+	for (int a = first < JIT_BLOCK_SPAN ? 0 : first - JIT_BLOCK_SPAN; a < last; a += 2) {
+		JitBlock* block = blocks[a >> 1];
+		if (block && block->end > first) {
+			blocks[a >> 1] = nullptr;
+			dirty = true;
+
+			//Nothing may jump into it any more
+			auto incoming = links.find(block->start);
+			if (incoming != links.end())
+				for (PBYTE* at : incoming->second)
+					link(at, at + 4);
+			JitTarget& target = targets[targetSlot(block->start)];
+			if (target.pc == block->start)
+				target = JitTarget{JIT_TARGET_NONE, 0, nullptr};
+		}
+	}
+}
+
+/**
+ * Throw away every translation and start the code buffer over, saving new translations to the cache first if there is
+ * one. Never call this from inside translated code.
+ */
+void Jit::flush() {
+	if (cache)
+		save();
+	std::lock_guard<std::mutex> hold(building);
+	for (auto& at : resident) {
+		if (at.second->installed)
+			delete at.second;
+		else
+			at.second->code = nullptr; //Still to be collected, and thrown away then
+	}
+	resident.clear();
+	memset(blocks, 0, sizeof(JitBlock*) * (cpu.coreSizeBytes / 2));
+	links.clear();
+	if (targets) {
+		for (int i = 0; i < 1 << JIT_TARGET_BITS; i++)
+			targets[i] = JitTarget{JIT_TARGET_NONE, 0, nullptr};
+		forgetReturns();
+	}
+	used = codeStart;
+	window = limit;
+	epoch++;
+	stats.flushes++;
+}
+
+/**
+ * Keep translations in a cache on disk, reading them back from there rather than translating where possible
+ * @param dir Directory to keep the cache in
+ * @param cap Most bytes of cache files to keep
+ */
+void Jit::persist(const std::string& dir, uint64_t cap) {
+	if (!buffer)
+		return;
+	if (cache)
+		save();
+	delete cache;
+
+	cache = new JitCache(dir, cap, model());
+	memset(cacheChecked, 0, (size_t)(cpu.coreSizeBytes >> ICACHE_PAGE_BITS) + 1);
+}
+
+/**
+ * Name translated code for host profilers from now on, starting with the entry and exit code and whatever has been
+ * translated already
+ * @param formats SYMBOLS_PERF_MAP and/or SYMBOLS_JITDUMP; none to stop
+ * @param dir Directory to write the files to
+ * @return Whether any of them could be opened
+ */
+bool Jit::symbolize(int formats, const std::string& dir) {
+	delete symbols;
+	symbols = nullptr;
+	if (!buffer || formats == 0)
+		return false;
+	symbols = new JitSymbols(formats, dir);
+	if (!symbols->usable()) {
+		delete symbols;
+		symbols = nullptr;
+		return false;
+	}
+	symbols->name("pdp11 entry", (const PBYTE*)(void*)entry, (size_t)(exit - (const PBYTE*)(void*)entry));
+	symbols->name("pdp11 exit", exit, (size_t)(buffer + codeStart - exit));
+	std::lock_guard<std::mutex> hold(building);
+	for (const auto& at : resident)
+		if (live(at.second))
+			symbols->block(at.second->start, at.second->end, at.second->code, at.second->size);
+	return true;
+}
+
+/**
+ * Translate loads and stores for however core is set up now: write-protected where there's code or not, fenced off
+ * past its end or not, and with devices attached or not. Everything translated so far assumed otherwise, so it's all
+ * thrown away, along with whatever the inline caches had bound to devices.
+ */
+void Jit::reconfigure() {
+	flush();
+	{
+		std::lock_guard<std::mutex> hold(building);
+		guarded = cpu.guard != nullptr;
+		bussed = cpu.ports != nullptr;
+		fenced = guarded && cpu.guard->fenced() && (!bussed || WriteGuard::diverts());
+	}
+	forgetPorts();
+	if (cache) {
+		cache->remodel(model());
+		memset(cacheChecked, 0, (size_t)(cpu.coreSizeBytes >> ICACHE_PAGE_BITS) + 1);
+	}
+}
+
+/**
+ * Hash of everything besides the guest code that the generated code depends on
+ */
+uint64_t Jit::model() const {
+	uint64_t layout[] = {JIT_CACHE_VERSION, sizeof(Processor), OFF(registers), OFF(ps), OFF(deadline),
+						 OFF(codeWritten), OFF(fault), guarded, fenced, bussed, (uint64_t)cpu.coreSizeBytes,
+						 (uint64_t)((PBYTE*)targets - buffer), (uint64_t)((PBYTE*)returns - buffer),
+						 (uint64_t)((PBYTE*)ports - buffer), (uint64_t)(exit - buffer), codeStart, JIT_TARGET_BITS,
+						 JIT_RETURN_DEPTH, JIT_PORT_BITS, HELPER_COUNT};
+	return JitCache::hash(layout, sizeof(layout), 0);
+}
+
+/**
+ * Install whatever blocks the cache has for a page of core, as long as the words they were built from are still
+ * there, and the buffer has room for them
+ */
+void Jit::restore(int page) {
+	cacheChecked[page] = true;
+	int first = page << ICACHE_PAGE_BITS;
+	if (first + (1 << ICACHE_PAGE_BITS) > cpu.coreSizeBytes)
+		return;
+	std::vector<JitCacheEntry> entries;
+	if (!cache->load(cache->key(cpu.core.word + (first >> 1), ICACHE_PAGE_WORDS, page), entries))
+		return;
+
+	bool fresh = pageFresh[page];
+	for (const JitCacheEntry& entry : entries) {
+		if (entry.start >> ICACHE_PAGE_BITS != page || entry.end > cpu.coreSizeBytes || blocks[entry.start >> 1] ||
+			memcmp(entry.guest.data(), cpu.core.word + (entry.start >> 1), entry.guest.size() * sizeof(PWORD)) != 0)
+			continue;
+
+		JitBlock* block;
+		{
+			std::lock_guard<std::mutex> hold(building);
+			if (!room(entry.code.size()))
+				break;
+			block = new JitBlock{entry.start, entry.end, entry.length, buffer + used, entry.code.size(), entry.chains,
+								 entry.relocs, false};
+			resident[used] = block;
+			memcpy(block->code, entry.code.data(), entry.code.size());
+			for (size_t at : entry.relocs) {
+				int32_t offset;
+				memcpy(&offset, block->code + at, 4);
+				link(block->code + at, buffer + offset);
+			}
+			used = (used + entry.code.size() + 15) & ~(size_t)15;
+		}
+		install(block);
+		stats.translations++;
+
+		//Writes to the words it was built from have to throw it away, as if they'd been predecoded
+		cpu.holdsCode(entry.start >> ICACHE_PAGE_BITS);
+		cpu.holdsCode((entry.end - 1) >> ICACHE_PAGE_BITS);
+	}
+	pageFresh[page] = fresh;
+}
+
+/**
+ * Write every page with blocks translated since it was last saved or restored to the cache, along with the rest of
+ * its blocks
+ */
+void Jit::save() {
+	int pages = cpu.coreSizeBytes >> ICACHE_PAGE_BITS;
+	for (int page = 0; page < pages; page++) {
+		if (!pageFresh[page])
+			continue;
+		pageFresh[page] = false;
+		std::vector<JitCacheEntry> entries;
+		int first = page << ICACHE_PAGE_BITS;
+		for (int a = first; a < first + (1 << ICACHE_PAGE_BITS); a += 2) {
+			const JitBlock* block = blocks[a >> 1];
+			if (block == nullptr || block->end > cpu.coreSizeBytes)
+				continue;
+			JitCacheEntry entry = {block->start, block->end, block->length,
+								   std::vector<PWORD>(cpu.core.word + (block->start >> 1),
+													  cpu.core.word + (block->end >> 1)),
+								   std::vector<PBYTE>(block->code, block->code + block->size), block->chains,
+								   block->relocs};
+			for (const JitChain& chain : block->chains)
+				memset(&entry.code[chain.at], 0, 4);
+			for (size_t at : block->relocs) {
+				int32_t rel;
+				memcpy(&rel, block->code + at, 4);
+				int32_t offset = (int32_t)(block->code + at + 4 + rel - buffer);
+				memcpy(&entry.code[at], &offset, 4);
+			}
+			entries.push_back(entry);
+		}
+		if (!entries.empty())
+			cache->store(cache->key(cpu.core.word + (first >> 1), ICACHE_PAGE_WORDS, page), entries);
+	}
+}
+
+/**
+ * Writes to the pages of core a block was built from so far
+ * @param start Address of the block's first word
+ * @param end Address just past its last word
+ */
+uint32_t Jit::stamp(PWORD start, PWORD end) const {
+	uint32_t writes = 0;
+	for (int page = start >> ICACHE_PAGE_BITS; page <= (end - 1) >> ICACHE_PAGE_BITS; page++)
+		writes += pageWrites[page];
+	return writes;
+}
+
+/**
+ * Background thread: translate queued blocks until told to stop
+ */
+void Jit::work() {
+	std::unique_lock<std::mutex> hold(queueLock);
+	for (;;) {
+		wake.wait(hold, [this] { return stopping || !queue.empty(); });
+		if (stopping)
+			return;
+		Job job = std::move(queue.front());
+		queue.pop_front();
+		hold.unlock();
+
+		job.block = build(job.insts);
+
+		hold.lock();
+		finished.push_back(std::move(job));
+		ready.store(true, std::memory_order_release);
+	}
+}
+
+/**
+ * Install the blocks the background thread has finished, apart from any whose code has been written over or flushed
+ * since they were scanned. If the buffer ran out, it's flushed, and the blocks that didn't fit get queued again the
+ * next time they're asked for.
+ */
+void Jit::collect() {
+	std::vector<Job> jobs;
+	{
+		std::lock_guard<std::mutex> hold(queueLock);
+		jobs.swap(finished);
+		ready.store(false, std::memory_order_relaxed);
+	}
+	bool full = false;
+	for (Job& job : jobs) {
+		PWORD pc = job.insts[0].pc;
+		queued[pc >> 1] = false;
+		if (job.block == nullptr)
+			full = true;
+		else if (job.block->code && job.epoch == epoch && job.stamp == stamp(pc, job.block->end) &&
+				 blocks[pc >> 1] == nullptr) {
+			install(job.block);
+			pageFresh[pc >> ICACHE_PAGE_BITS] = true;
+			stats.translations++;
+		}
+		else
+			drop(job.block);
+	}
+	if (full) {
+		std::lock_guard<std::mutex> hold(building);
+		room(JIT_BLOCK_ROOM);
+	}
+}
+
+/**
+ * Stop the background thread, if it was ever started, and throw away whatever it hadn't handed over
+ */
+void Jit::stop() {
+	if (!worker.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> hold(queueLock);
+		stopping = true;
+	}
+	wake.notify_one();
+	worker.join();
+	for (Job& job : finished)
+		if (job.block)
+			drop(job.block);
+	finished.clear();
+}
+
+//
+// HELPERS
+//
+
+/**
+ * Run one instruction in the interpreter on behalf of translated code
+ * @param pc Address of the instruction
+ * @param next Address of the instruction after it
+ * @return Non-zero if the block has to be left: control went somewhere other than next, the processor was stopped, or
+ * code was overwritten
+ */
+int Jit::helperStep(Processor* cpu, uint32_t pc, uint32_t next) {
+	cpu->jit->dirty = false;
+	cpu->registers[PC] = (PWORD)pc;
+	cpu->step();
+	cpu->settleFlags();
+	return cpu->registers[PC] != next || cpu->deadline < 0 || cpu->jit->dirty;
+}
+
+/**
+ * Trap on behalf of translated code; PC must already be stored. A fault past the end of a fenced core is over with
+ * once it's trapped, and the pages it opened up are closed again.
+ */
+void Jit::helperTrap(Processor* cpu, uint32_t vector) {
+	if (cpu->guard)
+		cpu->guard->close();
+	cpu->trap((PWORD)vector);
+}
+
+/**
+ * Note a store to a page with code in it, or one that hit a write-protected page
+ * @return Non-zero if translations were thrown away, in which case the block has to be left
+ */
+int Jit::helperWritten(Processor* cpu, uint32_t addr) {
+	cpu->jit->dirty = false;
+	cpu->written((PWORD)addr);
+	return cpu->jit->dirty;
+}
+
+/**
+ * Read a device register on behalf of translated code whose inline cache missed, binding the cache to it
+ * @return Value read, or zero with fault set if there's no register at addr
+ */
+uint32_t Jit::helperRead(Processor* cpu, uint32_t addr, JitPort* cache) {
+	const Port* port = cpu->port((PWORD)addr);
+	if (port == nullptr) {
+		cpu->fault = true;
+		return 0;
+	}
+	*cache = JitPort{addr, 0, port->device, port->read, port->write};
+	return port->read(port->device, (PWORD)addr);
+}
+
+/**
+ * Write a device register on behalf of translated code whose inline cache missed, binding the cache to it. There's
+ * always one there, since the instruction would have faulted already otherwise.
+ */
+void Jit::helperWrite(Processor* cpu, uint32_t addr, uint32_t val, JitPort* cache) {
+	const Port* port = cpu->port((PWORD)addr);
+	if (port == nullptr) {
+		cpu->fault = true;
+		return;
+	}
+	*cache = JitPort{addr, 0, port->device, port->read, port->write};
+	port->write(port->device, (PWORD)addr, (PWORD)val);
+}
+
+/**
+ * Run a copy or clear loop on behalf of translated code, which has taken budget for one lap already; PC must be
+ * stored
+ */
+void Jit::helperLoop(Processor* cpu) {
+	uint64_t room = (uint64_t)cpu->deadline + 2;
+	cpu->deadline = (int64_t)(room - cpu->stepFused(room));
+	cpu->settleFlags();
+}
+
+//
+// TRANSLATION
+//
+
+/**
+ * Collect the instructions of the block starting at pc: up to and including the first control transfer that isn't a
+ * branch worth tracing through, stopping early at the block size limit, the block span or the end of core
+ */
+std::vector<Jit::Inst> Jit::scan(PWORD pc) {
+	std::vector<Inst> insts;
+	PWORD start = pc;
+	while (insts.size() < JIT_BLOCK_LIMIT && !(pc & 1) && pc < cpu.coreSizeBytes && pc - start <= JIT_BLOCK_SPAN - 6) {
+		const Decoded& d = cpu.icache[pc >> 1].handler ? cpu.icache[pc >> 1] : cpu.predecode(pc);
+		Inst inst = {pc, (PWORD)(pc + 2), d, plainOp(d.op), JIT_ALL_CODES, 0, 0, {-1, -1, -1, -1}, false, false, 0};
+		if ((d.operands & OPND_SRC) && extraWord(d.srcMode, d.srcReg))
+			inst.next += 2;
+		if ((d.operands & OPND_DST) && extraWord(d.dstMode, d.dstReg))
+			inst.next += 2;
+		if (endsBlock(inst.op))
+			inst.onto = trace(inst);
+		insts.push_back(inst);
+		pc = inst.onto ? inst.onto : inst.next;
+		if (endsBlock(inst.op) && !inst.onto)
+			break;
+	}
+
+	//A trace cut short by the limits ends at its last branch after all
+	if (!insts.empty())
+		insts.back().onto = 0;
+	return insts;
+}
+
+/**
+ * Which side of a branch to trace a block on through: the one the tiered engine has entered JIT_TRACE_BIAS times as
+ * often as the other, if there is one and it's further on. Plain jumps by BR are always traced through going forwards.
+ * @return Address of the side to go on to, or 0 to end the block at the branch
+ */
+PWORD Jit::trace(const Inst& inst) const {
+	if (inst.op < OP_br || inst.op > OP_bcs)
+		return 0;
+	PWORD target = (PWORD)(inst.next + 2 * inst.d.offset);
+	bool forward = target > inst.pc;
+	if (inst.op == OP_br)
+		return forward ? target : 0;
+
+	auto entered = [this](PWORD pc) -> uint64_t {
+		return pc < cpu.coreSizeBytes ? cpu.heat[pc >> 1] : 0;
+	};
+	if (forward && entered(target) >= JIT_TRACE_BIAS * (entered(inst.next) + 1))
+		return target;
+	if (entered(inst.next) >= JIT_TRACE_BIAS * (entered(target) + 1))
+		return inst.next;
+	return 0;
+}
+
+/**
+ * Whether an operand can be translated; PC as a general register is left to the interpreter
+ */
+static bool translatable(PBYTE mode, PBYTE reg) {
+	return mode >= MODE_IMM || (mode < MODE_INDEX && reg != PC);
+}
+
+/**
+ * Whether the translator handles an instruction itself, rather than calling the interpreter for it
+ */
+bool Jit::native(const Inst& inst) {
+	const Decoded& d = inst.d;
+	switch (inst.op) {
+		case OP_mov: case OP_cmp: case OP_bit: case OP_bic: case OP_bis: case OP_add: case OP_sub:
+			return translatable(d.srcMode, d.srcReg) && translatable(d.dstMode, d.dstReg) && d.dstMode != MODE_IMM;
+		case OP_clr: case OP_com: case OP_inc: case OP_dec: case OP_neg: case OP_adc: case OP_sbc: case OP_tst:
+		case OP_ror: case OP_rol: case OP_asr: case OP_asl: case OP_swab: case OP_sxt:
+			return translatable(d.dstMode, d.dstReg) && d.dstMode != MODE_IMM;
+		case OP_xor_:
+			return d.srcReg != PC && translatable(d.dstMode, d.dstReg);
+		case OP_br: case OP_bne: case OP_beq: case OP_bge: case OP_blt: case OP_bgt: case OP_ble: case OP_bpl:
+		case OP_bmi: case OP_bhi: case OP_blos: case OP_bvc: case OP_bvs: case OP_bcc: case OP_bcs:
+		case OP_ccop:
+			return true;
+		case OP_sob:
+			return d.srcReg != PC;
+		case OP_jmp:
+			return d.dstMode != MODE_REG && d.dstMode != MODE_IMM && translatable(d.dstMode, d.dstReg);
+		case OP_jsr:
+			return d.dstMode != MODE_REG && d.dstMode != MODE_IMM && translatable(d.dstMode, d.dstReg);
+		case OP_rts:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Work out which combinations of condition codes a branch is taken for
+ * @return Bit n set if the branch is taken when the low four bits of ps are n
+ */
+uint16_t Jit::branchMask(PBYTE op) {
+	uint16_t mask = 0;
+	for (int f = 0; f < 16; f++) {
+		bool n = (f & SN) != 0, z = (f & SZ) != 0, v = (f & SV) != 0, c = (f & SC) != 0;
+		bool taken;
+		switch (op) {
+			case OP_bne: taken = !z; break;
+			case OP_beq: taken = z; break;
+			case OP_bge: taken = !(n ^ v); break;
+			case OP_blt: taken = n ^ v; break;
+			case OP_bgt: taken = !(z || (n ^ v)); break;
+			case OP_ble: taken = z || (n ^ v); break;
+			case OP_bpl: taken = !n; break;
+			case OP_bmi: taken = n; break;
+			case OP_bhi: taken = !(c || z); break;
+			case OP_blos: taken = c || z; break;
+			case OP_bvc: taken = !v; break;
+			case OP_bvs: taken = v; break;
+			case OP_bcc: taken = !c; break;
+			case OP_bcs: taken = c; break;
+			default: taken = true; break;
+		}
+		if (taken)
+			mask |= 1 << f;
+	}
+	return mask;
+}
+
+/**
+ * Which condition codes a translated instruction reads and which it sets
+ * @param reads Set to the codes read
+ * @return Codes set
+ */
+PBYTE Jit::flagEffects(const Inst& inst, PBYTE& reads) {
+	reads = 0;
+	switch (inst.op) {
+		case OP_mov: case OP_cmp: case OP_bit: case OP_bic: case OP_bis: case OP_add: case OP_sub: case OP_xor_:
+		case OP_inc: case OP_dec:
+			return SN | SZ | SV;
+		case OP_adc: case OP_sbc:
+			reads = SC;
+			return SN | SZ | SV;
+		case OP_com:
+			//N is left alone when the result is zero
+			reads = SN;
+			return JIT_ALL_CODES;
+		case OP_sxt:
+			reads = SN;
+			return SZ;
+		case OP_clr: case OP_neg: case OP_tst: case OP_ror: case OP_rol: case OP_asr: case OP_asl: case OP_swab:
+			return JIT_ALL_CODES;
+		case OP_ccop:
+			return (PBYTE)(inst.d.offset & 017);
+		case OP_sob: case OP_jmp: case OP_jsr: case OP_rts:
+			return 0;
+		default: {
+			//Branches read whichever codes flipping changes the outcome
+			uint16_t mask = branchMask(inst.op);
+			for (PBYTE code : {SN, SZ, SV, SC})
+				for (int f = 0; f < 16; f++)
+					if (((mask >> f) ^ (mask >> (f ^ code))) & 1)
+						reads |= code;
+			return 0;
+		}
+	}
+}
+
+/**
+ * Whether a block is a copy or clear loop the interpreter runs in bulk: a MOV (Rs)+, (Rd)+ or CLR (Rd)+ and a SOB
+ * straight back to it, fused together by the instruction cache
+ */
+bool Jit::bulkLoop(const std::vector<Inst>& insts) {
+	const Decoded& d = insts[0].d;
+	return insts.size() == 2 && (d.op == OP_copy_sob || d.op == OP_clr_sob) && d.offset == 2;
+}
+
+/**
+ * Translate the block starting at pc into the code buffer, flushing the buffer first if it's full
+ * @return Translated block, or null if there's nothing at pc that can be translated
+ */
+JitBlock* Jit::translate(PWORD pc) {
+	std::vector<Inst> insts = scan(pc);
+	if (insts.empty())
+		return nullptr;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		{
+			std::lock_guard<std::mutex> hold(building);
+			if (!room(JIT_BLOCK_ROOM))
+				return nullptr;
+		}
+		JitBlock* block = build(insts);
+		if (block) {
+			install(block);
+			pageFresh[pc >> ICACHE_PAGE_BITS] = true;
+			stats.translations++;
+			return block;
+		}
+	}
+	return nullptr;
+}
+
+/**
+ * Optimize a scanned block and generate the code for it at the end of the buffer, without making it reachable
+ * @param insts The block's instructions
+ * @return Translated block, or null if the buffer is full
+ */
+JitBlock* Jit::build(std::vector<Inst> insts) {
+	std::lock_guard<std::mutex> hold(building);
+	optimize(insts);
+	PWORD pc = insts[0].pc;
+	Emitter e(buffer + used, window - used);
+	out = &e;
+	cold.clear();
+	chains.clear();
+	length = (int)insts.size();
+	done = 0;
+
+	//Leave straight away if the deadline won't cover the whole block, which it never does once the processor's stopped
+	e.alu(ALU_CMP, W64, field(OFF(deadline)), length);
+	later(e.jcc(CC_L), [=] { exitTo(pc, 0); });
+	e.alu(ALU_SUB, W64, field(OFF(deadline)), length);
+	e.lea(R11, hits + (pc >> 1));
+	e.mov(W8, mem(R11), 1);
+
+	if (bulkLoop(insts))
+		emitLoop(insts[0]);
+	else {
+		for (const Inst& inst : insts) {
+			done++;
+			emit(inst);
+		}
+	}
+	if (!endsBlock(insts.back().op))
+		chainTo(insts.back().next);
+	for (size_t i = 0; i < cold.size(); i++)
+		cold[i]();
+	out = nullptr;
+
+	if (e.full())
+		return nullptr;
+	JitBlock* block = new JitBlock{pc, insts.back().next, (PWORD)length, buffer + used, e.size(), chains,
+								   e.relocations(), false};
+	resident[used] = block;
+	used = (used + e.size() + 15) & ~(size_t)15;
+	return block;
+}
+
+/**
+ * Make a newly translated block the one for its address, chaining it to the blocks it branches to and the blocks that
+ * branch to it
+ */
+void Jit::install(JitBlock* block) {
+	blocks[block->start >> 1] = block;
+	block->installed = true;
+	for (const JitChain& chain : block->chains) {
+		PBYTE* at = block->code + chain.at;
+		links[chain.target].push_back(at);
+		if (blocks[chain.target >> 1])
+			link(at, blocks[chain.target >> 1]->code);
+	}
+	for (PBYTE* at : links[block->start])
+		link(at, block->code);
+	if (symbols)
+		symbols->block(block->start, block->end, block->code, block->size);
+}
+
+/**
+ * Make sure there are at least bytes free at used, moving the clock hand on past blocks that have run since it last
+ * came by and evicting the rest, and wrapping around to the start of the buffer when the end is too close. Only call
+ * this holding building, and never from inside translated code.
+ * @return Whether there's room; there can't be if the buffer is capped below bytes
+ */
+bool Jit::room(size_t bytes) {
+	if (bytes > limit - codeStart)
+		return false;
+	for (int wraps = 0;;) {
+		auto next = resident.lower_bound(used);
+		window = next == resident.end() ? limit : next->first;
+		if (window - used >= bytes)
+			return true;
+		if (next == resident.end()) {
+			//Every block has had its second chance by the time the hand has been all the way round twice
+			if (++wraps > 2)
+				return false;
+			used = codeStart;
+			continue;
+		}
+		JitBlock* block = next->second;
+		if (live(block) && hits[block->start >> 1]) {
+			hits[block->start >> 1] = 0;
+			used = (next->first + block->size + 15) & ~(size_t)15;
+		}
+		else
+			evict(next);
+	}
+}
+
+/**
+ * Throw a block out of the buffer. Nothing may jump into it afterwards, and nothing may patch its jumps out either.
+ * Blocks still waiting to be collected are only marked, for collect() to throw away.
+ * @param at The block's entry in resident
+ */
+void Jit::evict(std::map<size_t, JitBlock*>::iterator at) {
+	JitBlock* block = at->second;
+	resident.erase(at);
+	stats.evictions++;
+	if (!block->installed) {
+		block->code = nullptr;
+		return;
+	}
+	if (live(block)) {
+		blocks[block->start >> 1] = nullptr;
+		auto incoming = links.find(block->start);
+		if (incoming != links.end())
+			for (PBYTE* from : incoming->second)
+				link(from, from + 4);
+		JitTarget& target = targets[targetSlot(block->start)];
+		if (target.code == block->code)
+			target = JitTarget{JIT_TARGET_NONE, 0, nullptr};
+	}
+	for (const JitChain& chain : block->chains) {
+		std::vector<PBYTE*>& from = links[chain.target];
+		from.erase(std::remove(from.begin(), from.end(), block->code + chain.at), from.end());
+	}
+	forgetReturns();
+	delete block;
+}
+
+/**
+ * Throw away a block that was never installed, freeing its space if it hasn't been already
+ */
+void Jit::drop(JitBlock* block) {
+	if (block->code) {
+		std::lock_guard<std::mutex> hold(building);
+		auto at = resident.find((size_t)(block->code - buffer));
+		if (at != resident.end() && at->second == block)
+			resident.erase(at);
+	}
+	delete block;
+}
+
+/**
+ * Whether a block is the current translation of the code at its address
+ */
+bool Jit::live(const JitBlock* block) const {
+	return block->installed && blocks[block->start >> 1] == block;
+}
+
+/**
+ * Cap the bytes of the buffer translations may take up, throwing away everything translated so far
+ * @param bytes Cap; anything over what the buffer has room for is the same as no cap
+ */
+void Jit::bound(size_t bytes) {
+	if (!buffer)
+		return;
+	flush();
+	std::lock_guard<std::mutex> hold(building);
+	limit = bytes < JIT_BUFFER_SIZE - codeStart ? (codeStart + bytes) & ~(size_t)15 : JIT_BUFFER_SIZE;
+	used = codeStart;
+	window = limit;
+}
+
+/**
+ * Counts of what the buffer has been through, and how it's taken up now
+ */
+JitStats Jit::statistics() {
+	std::lock_guard<std::mutex> hold(building);
+	JitStats now = stats;
+	now.capacity = buffer ? limit - codeStart : 0;
+	size_t at = codeStart;
+	for (const auto& block : resident) {
+		size_t gap = block.first - at;
+		now.free += gap;
+		now.largestFree = std::max<uint64_t>(now.largestFree, gap);
+		size_t size = (block.second->size + 15) & ~(size_t)15;
+		if (live(block.second))
+			now.live += size;
+		else
+			now.dead += size;
+		at = block.first + size;
+	}
+	if (buffer) {
+		now.free += limit - at;
+		now.largestFree = std::max<uint64_t>(now.largestFree, limit - at);
+	}
+	return now;
+}
+
+/**
+ * Point a chained jump somewhere else
+ * @param at The jump's rel32 field
+ * @param target Where to jump to; the four bytes after the field, to leave it unchained
+ */
+void Jit::link(PBYTE* at, const PBYTE* target) {
+	int32_t rel = (int32_t)(target - (at + 4));
+	memcpy(at, &rel, 4);
+}
+
+/**
+ * Put a block in the indirect branch table, in place of whatever shared its slot
+ */
+void Jit::remember(const JitBlock* block) {
+	targets[targetSlot(block->start)] = JitTarget{block->start, 0, block->code};
+}
+
+/**
+ * Empty the return stack, before the code its entries point into can be reused
+ */
+void Jit::forgetReturns() {
+	returns->top = 0;
+	for (JitTarget& entry : returns->entries)
+		entry = JitTarget{JIT_TARGET_NONE, 0, nullptr};
+}
+
+/**
+ * Empty the inline caches for device registers, before the registers they're bound to change
+ */
+void Jit::forgetPorts() {
+	for (int i = 0; i < 1 << JIT_PORT_BITS; i++)
+		ports[i] = JitPort{JIT_PORT_NONE, 0, nullptr, nullptr, nullptr};
+}
+
+size_t Jit::targetSlot(PWORD pc) {
+	return (size_t)(pc >> 1) & ((1 << JIT_TARGET_BITS) - 1);
+}
+
+/**
+ * Translate one instruction
+ */
+void Jit::emit(const Inst& inst) {
+	site = inst.pc;
+	current = &inst;
+	accessed = 0;
+	if (inst.dead)
+		return;
+	if (!native(inst)) {
+		emitFallback(inst);
+		return;
+	}
+	switch (inst.op) {
+		case OP_mov: case OP_cmp: case OP_bit: case OP_bic: case OP_bis: case OP_add: case OP_sub:
+			emitDouble(inst);
+			break;
+		case OP_xor_:
+			emitXor(inst);
+			break;
+		case OP_sob:
+			emitSob(inst);
+			break;
+		case OP_jmp:
+			emitJmp(inst);
+			break;
+		case OP_jsr:
+			emitJsr(inst);
+			break;
+		case OP_rts:
+			emitRts(inst);
+			break;
+		case OP_ccop:
+			emitCcop(inst);
+			break;
+		default:
+			if (inst.op >= OP_br && inst.op <= OP_bcs)
+				emitBranch(inst);
+			else
+				emitSingle(inst);
+			break;
+	}
+}
+
+/**
+ * Two operand instructions. The source is read before the destination is resolved, like DOUBLE_OP does it.
+ */
+void Jit::emitDouble(const Inst& inst) {
+	const Decoded& d = inst.d;
+	PBYTE op = inst.op;
+	bool flags = (inst.live & (SN | SZ | SV)) != 0;
+	if (!flags && d.dstMode == MODE_REG && !memoryMode(d.srcMode)) {
+		emitRegisterDouble(inst);
+		return;
+	}
+
+	source(d.srcMode, d.srcReg, d.srcWord, RDX);
+	if (d.dstMode == MODE_REG) {
+		if (op != OP_mov)
+			out->mov(W32, RAX, reg(d.dstReg));
+	}
+	else {
+		address(d.dstMode, d.dstReg, d.dstWord);
+		op == OP_mov ? check(RCX) : load(RAX, RCX);
+	}
+	if ((memoryMode(d.srcMode) || memoryMode(d.dstMode)) && !faultless(inst))
+		faultCheck(inst, false);
+
+	bool overflow = false;
+	switch (op) {
+		case OP_mov:
+			out->mov(W32, RAX, RDX);
+			break;
+		case OP_bit:
+		case OP_bic:
+			out->alu(ALU_AND, W32, RAX, RDX);
+			break;
+		case OP_bis:
+			out->alu(ALU_OR, W32, RAX, RDX);
+			break;
+		default:
+			//V when the operands have the same sign and the result doesn't; valFlags(src, dst, res)
+			overflow = (inst.live & SV) != 0;
+			if (overflow) {
+				out->mov(W32, R11, RDX);
+				out->alu(ALU_XOR, W32, R11, RAX);
+				out->unary(UN_NOT, W32, R11);
+			}
+			if (op == OP_add)
+				out->alu(ALU_ADD, W32, RAX, RDX);
+			else if (op == OP_sub)
+				out->alu(ALU_SUB, W32, RAX, RDX);
+			else {
+				out->unary(UN_NEG, W32, RAX);
+				out->alu(ALU_ADD, W32, RAX, RDX);
+			}
+			if (overflow) {
+				out->alu(ALU_XOR, W32, RDX, RAX);
+				out->alu(ALU_AND, W32, R11, RDX);
+				out->shift(SH_SHR, W32, R11, 14);
+				out->alu(ALU_AND, W32, R11, SV);
+			}
+			break;
+	}
+	if (flags) {
+		if (!overflow)
+			out->alu(ALU_XOR, W32, R11, R11);
+		nz(W16);
+		setFlags(SN | SZ | SV);
+	}
+
+	if (op == OP_cmp || op == OP_bit)
+		return;
+	if (d.dstMode == MODE_REG)
+		out->mov(W16, reg(d.dstReg), RAX);
+	else if (!inst.unstored)
+		store(RCX, RAX, inst, false);
+}
+
+/**
+ * Two operand instructions on a register from a register or an immediate, with none of their condition codes wanted;
+ * each is a single host instruction, or nothing at all
+ */
+void Jit::emitRegisterDouble(const Inst& inst) {
+	const Decoded& d = inst.d;
+	HostReg dst = reg(d.dstReg);
+	AluOp op;
+	switch (inst.op) {
+		case OP_mov:
+			if (d.srcMode == MODE_IMM)
+				out->mov(dst, (uint32_t)d.srcWord);
+			else
+				out->mov(W32, dst, reg(d.srcReg));
+			return;
+		case OP_add: op = ALU_ADD; break;
+		case OP_sub: op = ALU_SUB; break;
+		case OP_bis: op = ALU_OR; break;
+		case OP_bic: op = ALU_AND; break;
+		default:
+			//cmp and bit only set condition codes
+			return;
+	}
+	if (d.srcMode == MODE_IMM)
+		out->alu(op, W16, dst, (SPWORD)d.srcWord);
+	else
+		out->alu(op, W16, dst, reg(d.srcReg));
+}
+
+/**
+ * Single operand instructions
+ */
+void Jit::emitSingle(const Inst& inst) {
+	const Decoded& d = inst.d;
+	PBYTE op = inst.op;
+	PBYTE reads;
+	bool flags = (inst.live & flagEffects(inst, reads)) != 0;
+	bool loads = op != OP_clr && op != OP_sxt;
+	if (d.dstMode == MODE_REG) {
+		if (loads)
+			out->mov(W32, RAX, reg(d.dstReg));
+	}
+	else {
+		address(d.dstMode, d.dstReg, d.dstWord);
+		loads ? load(RAX, RCX) : check(RCX);
+		if (!faultless(inst))
+			faultCheck(inst, false);
+	}
+
+	switch (op) {
+		case OP_clr:
+			out->alu(ALU_XOR, W32, RAX, RAX);
+			if (flags) {
+				out->alu(ALU_AND, W32, HOST_PS, (PBYTE)~(SN | SV | SC));
+				out->alu(ALU_OR, W32, HOST_PS, SZ);
+			}
+			break;
+		case OP_com:
+			//Z by result, N set if the result isn't zero and left alone if it is, V reset, C set
+			out->unary(UN_NOT, W32, RAX);
+			if (flags) {
+				out->alu(ALU_XOR, W32, RDX, RDX);
+				out->test(W16, RAX, RAX);
+				out->setcc(CC_E, RDX);
+				out->shift(SH_SHL, W32, RDX, 2);
+				out->mov(R11, (uint32_t)(SC | SN));
+				out->alu(ALU_SUB, W32, R11, RDX);
+				setFlags(SZ | SV | SC);
+			}
+			break;
+		case OP_inc:
+		case OP_dec:
+		case OP_neg:
+		case OP_adc:
+		case OP_sbc:
+			if (flags)
+				out->mov(W32, RDX, RAX);
+			if (op == OP_inc)
+				out->alu(ALU_ADD, W32, RAX, 1);
+			else if (op == OP_dec)
+				out->alu(ALU_SUB, W32, RAX, 1);
+			else if (op == OP_neg)
+				out->unary(UN_NEG, W32, RAX);
+			else {
+				out->mov(W32, R11, HOST_PS);
+				out->alu(ALU_AND, W32, R11, SC);
+				out->alu(op == OP_adc ? ALU_ADD : ALU_SUB, W32, RAX, R11);
+			}
+			if (!flags)
+				break;
+			//valFlags(prev, prev, res); V if the sign changed
+			out->mov(W32, R11, RDX);
+			out->alu(ALU_XOR, W32, R11, RAX);
+			out->shift(SH_SHR, W32, R11, 14);
+			out->alu(ALU_AND, W32, R11, SV);
+			nz(W16);
+			if (op == OP_neg) {
+				//C if the result isn't zero
+				out->mov(W32, RDX, R11);
+				out->shift(SH_SHR, W32, RDX, 2);
+				out->alu(ALU_AND, W32, RDX, 1);
+				out->alu(ALU_XOR, W32, RDX, 1);
+				out->alu(ALU_OR, W32, R11, RDX);
+				setFlags(SN | SZ | SV | SC);
+			}
+			else
+				setFlags(SN | SZ | SV);
+			break;
+		case OP_tst:
+			if (flags) {
+				out->alu(ALU_XOR, W32, R11, R11);
+				nz(W16);
+				setFlags(SN | SZ | SV | SC);
+			}
+			return;
+		case OP_ror:
+		case OP_rol:
+			out->mov(RDX, 1u);
+			out->shift(op == OP_ror ? SH_ROR : SH_ROL, W16, RAX, 1);
+			if (flags)
+				shiftFlags();
+			break;
+		case OP_asr:
+			if (flags) {
+				out->mov(W32, RDX, RAX);
+				out->alu(ALU_AND, W32, RDX, 1);
+			}
+			out->shift(SH_SAR, W16, RAX, 1);
+			if (flags)
+				shiftFlags();
+			break;
+		case OP_asl:
+			if (flags) {
+				out->mov(W32, RDX, RAX);
+				out->shift(SH_SHR, W32, RDX, 15);
+				out->alu(ALU_AND, W32, RDX, 1);
+			}
+			out->shift(SH_SHL, W32, RAX, 1);
+			if (flags)
+				shiftFlags();
+			break;
+		case OP_swab:
+			//NZ by the low byte of the result
+			out->shift(SH_ROL, W16, RAX, 8);
+			if (flags) {
+				out->alu(ALU_XOR, W32, R11, R11);
+				nz(W8);
+				setFlags(SN | SZ | SV | SC);
+			}
+			break;
+		default:
+			//sxt; every bit from N, Z by result
+			out->mov(W32, RAX, HOST_PS);
+			out->shift(SH_SHL, W32, RAX, 28);
+			out->shift(SH_SAR, W32, RAX, 31);
+			if (flags) {
+				out->alu(ALU_XOR, W32, R11, R11);
+				out->alu(ALU_XOR, W32, RDX, RDX);
+				out->test(W16, RAX, RAX);
+				out->setcc(CC_E, RDX);
+				out->shift(SH_SHL, W32, RDX, 2);
+				out->alu(ALU_OR, W32, R11, RDX);
+				setFlags(SZ);
+			}
+			break;
+	}
+
+	if (d.dstMode == MODE_REG)
+		out->mov(W16, reg(d.dstReg), RAX);
+	else if (!inst.unstored)
+		store(RCX, RAX, inst, false);
+}
+
+/**
+ * XOR; the register is the destination, and the operand the source
+ */
+void Jit::emitXor(const Inst& inst) {
+	const Decoded& d = inst.d;
+	if (!(inst.live & (SN | SZ | SV)) && d.dstMode == MODE_REG) {
+		out->alu(ALU_XOR, W16, reg(d.srcReg), reg(d.dstReg));
+		return;
+	}
+	source(d.dstMode, d.dstReg, d.dstWord, RDX);
+	if (memoryMode(d.dstMode) && !faultless(inst))
+		faultCheck(inst, false);
+	out->mov(W32, RAX, reg(d.srcReg));
+	out->alu(ALU_XOR, W32, RAX, RDX);
+	out->alu(ALU_XOR, W32, R11, R11);
+	nz(W16);
+	setFlags(SN | SZ | SV);
+	out->mov(W16, reg(d.srcReg), RAX);
+}
+
+/**
+ * Conditional branches test ps against a table of the condition code combinations they're taken for
+ */
+void Jit::emitBranch(const Inst& inst) {
+	PWORD target = (PWORD)(inst.next + 2 * inst.d.offset);
+	if (inst.op == OP_br) {
+		if (!inst.onto)
+			chainTo(target);
+		return;
+	}
+	out->mov(W32, RAX, HOST_PS);
+	out->alu(ALU_AND, W32, RAX, 15);
+	out->mov(RDX, (uint32_t)branchMask(inst.op));
+	out->bt(W32, RDX, RAX);
+	if (inst.onto) {
+		//Traced through; the side exit hands back the instructions the trace would have gone on to
+		PWORD side = inst.onto == target ? inst.next : target;
+		int undone = length - done;
+		later(out->jcc(inst.onto == target ? CC_AE : CC_B), [=] { chainTo(side, undone); });
+		return;
+	}
+	later(out->jcc(CC_B), [=] { chainTo(target); });
+	chainTo(inst.next);
+}
+
+void Jit::emitSob(const Inst& inst) {
+	PWORD target = (PWORD)(inst.next - 2 * inst.d.offset);
+	out->alu(ALU_SUB, W16, reg(inst.d.srcReg), 1);
+	later(out->jcc(CC_NE), [=] { chainTo(target); });
+	chainTo(inst.next);
+}
+
+/**
+ * Whether working out an effective address in this mode reads memory
+ */
+static bool indirect(PBYTE mode) {
+	return mode == MODE_AINCDEF || mode == MODE_ADECDEF || mode == MODE_RELDEF || mode == MODE_IDXDEF;
+}
+
+void Jit::emitJmp(const Inst& inst) {
+	const Decoded& d = inst.d;
+	if (d.dstMode == MODE_ABS || d.dstMode == MODE_REL) {
+		chainTo(d.dstWord);
+		return;
+	}
+	address(d.dstMode, d.dstReg, d.dstWord);
+	if (indirect(d.dstMode) && !faultless(inst))
+		faultCheck(inst, false);
+	out->mov(W16, field(OFF(registers) + 2 * PC), RCX);
+	exitIndirect();
+}
+
+/**
+ * JSR; like Processor::jsr(), a fault pushing the register traps after the jump
+ */
+void Jit::emitJsr(const Inst& inst) {
+	const Decoded& d = inst.d;
+	address(d.dstMode, d.dstReg, d.dstWord);
+	if (indirect(d.dstMode))
+		faultCheck(inst, false);
+	out->mov(W16, field(OFF(registers) + 2 * PC), RCX);
+
+	//Calls through PC push the return address itself, and leave PC at the subroutine
+	if (d.srcReg == PC)
+		out->mov(RDX, (uint32_t)inst.next);
+	else
+		out->mov(W32, RDX, reg(d.srcReg));
+	out->alu(ALU_SUB, W16, reg(SP), 2);
+	out->mov(W32, RAX, reg(SP));
+	if (d.srcReg != PC)
+		out->mov(reg(d.srcReg), (uint32_t)inst.next);
+
+	if (bussed) {
+		//Pushing onto a device register reads it first, as any other store does
+		check(RAX);
+		out->alu(ALU_CMP, W8, field(OFF(fault)), 0);
+		size_t faulted = out->jcc(CC_NE);
+		store(RAX, RDX, inst, true);
+		out->bind(faulted);
+	}
+	else {
+		size_t outside = 0;
+		if (!fenced) {
+			out->alu(ALU_CMP, W32, RAX, cpu.coreSizeBytes);
+			outside = out->jcc(CC_AE);
+		}
+		out->test(W8, RAX, 1);
+		size_t odd = out->jcc(CC_NE);
+		store(RAX, RDX, inst, true);
+		PBYTE* resume = out->here();
+		later(odd, [=] {
+			if (!fenced)
+				out->bind(outside);
+			out->mov(W8, field(OFF(fault)), 1);
+			out->jmp(resume);
+		});
+	}
+	faultCheck(inst, true);
+
+	//Push the return, with a way back into the block after this one that can be chained like any other
+	out->lea(RDX, returns);
+	out->mov(W32, RAX, mem(RDX, offsetof(JitReturnStack, top)));
+	out->alu(ALU_ADD, W32, RAX, 1);
+	out->alu(ALU_AND, W32, RAX, JIT_RETURN_DEPTH - 1);
+	out->mov(W32, mem(RDX, offsetof(JitReturnStack, top)), RAX);
+	out->shift(SH_SHL, W32, RAX, 4);
+	out->mov(W32, mem(RDX, RAX, offsetof(JitReturnStack, entries) + offsetof(JitTarget, pc)), (int32_t)inst.next);
+	out->lea(RCX, out->here());
+	size_t back = out->size() - 4;
+	out->mov(W64, mem(RDX, RAX, offsetof(JitReturnStack, entries) + offsetof(JitTarget, code)), RCX);
+	cold.push_back([=] {
+		out->bind(back);
+		chainTo(inst.next);
+	});
+	if (d.dstMode == MODE_ABS || d.dstMode == MODE_REL)
+		chainTo(d.dstWord);
+	else
+		exitIndirect();
+}
+
+/**
+ * RTS; through PC, it just pops PC
+ */
+void Jit::emitRts(const Inst& inst) {
+	PBYTE r = inst.d.dstReg;
+	if (r != PC)
+		out->mov(W16, field(OFF(registers) + 2 * PC), reg(r));
+	out->mov(W32, RAX, reg(SP));
+	load(RDX, RAX);
+	out->alu(ALU_ADD, W16, reg(SP), 2);
+	if (r == PC)
+		out->mov(W16, field(OFF(registers) + 2 * PC), RDX);
+	else
+		out->mov(W16, reg(r), RDX);
+	faultCheck(inst, true);
+
+	//Pop the latest call, going straight back if this is its return and on to the table otherwise
+	out->lea(RDX, returns);
+	out->mov(W32, RAX, mem(RDX, offsetof(JitReturnStack, top)));
+	out->mov(W32, RCX, RAX);
+	out->alu(ALU_SUB, W32, RCX, 1);
+	out->alu(ALU_AND, W32, RCX, JIT_RETURN_DEPTH - 1);
+	out->mov(W32, mem(RDX, offsetof(JitReturnStack, top)), RCX);
+	out->shift(SH_SHL, W32, RAX, 4);
+	out->movzx(RCX, W16, field(OFF(registers) + 2 * PC));
+	out->alu(ALU_CMP, W32, mem(RDX, RAX, offsetof(JitReturnStack, entries) + offsetof(JitTarget, pc)), RCX);
+	size_t miss = out->jcc(CC_NE);
+	out->jmp(mem(RDX, RAX, offsetof(JitReturnStack, entries) + offsetof(JitTarget, code)));
+	out->bind(miss);
+	exitIndirect();
+}
+
+/**
+ * Condition code operators; bit 4 picks set or clear, bits 0-3 pick which codes
+ */
+void Jit::emitCcop(const Inst& inst) {
+	PBYTE codes = (PBYTE)(inst.d.offset & 017);
+	if (codes == 0)
+		return;
+	if (inst.d.offset & 020)
+		out->alu(ALU_OR, W32, HOST_PS, codes);
+	else
+		out->alu(ALU_AND, W32, HOST_PS, (PBYTE)~codes);
+}
+
+/**
+ * Have the interpreter run an instruction, leaving the block if it went anywhere but the next instruction. Block
+ * ending instructions like rti go on to wherever the interpreter left PC, unless they stopped the processor.
+ */
+void Jit::emitFallback(const Inst& inst) {
+	int undone = length - done;
+	spill();
+	out->mov(W64, field(OFF(ahead)), undone + 1);
+	out->mov(W64, RDI, R15);
+	out->mov(RSI, (uint32_t)inst.pc);
+	out->mov(RDX, (uint32_t)inst.next);
+	out->call(&helpers[HELPER_STEP]);
+	out->mov(W64, field(OFF(ahead)), 0);
+	reload();
+	if (endsBlock(inst.op)) {
+		out->alu(ALU_CMP, W64, field(OFF(deadline)), 0);
+		later(out->jcc(CC_L), [=] { exitHere(undone); });
+		exitIndirect();
+		return;
+	}
+	out->test(W32, RAX, RAX);
+	later(out->jcc(CC_NE), [=] { exitHere(undone); });
+}
+
+/**
+ * Hand a copy or clear loop to the interpreter, to run as many laps at once as the deadline allows
+ */
+void Jit::emitLoop(const Inst& inst) {
+	out->mov(W16, field(OFF(registers) + 2 * PC), (int32_t)inst.pc);
+	spill();
+	out->mov(W64, RDI, R15);
+	out->call(&helpers[HELPER_LOOP]);
+	reload();
+	exitIndirect();
+}
+
+/**
+ * Whether resolving an operand in this mode touches core, and so can fault
+ */
+bool Jit::memoryMode(PBYTE mode) const {
+	return mode != MODE_REG && mode != MODE_IMM;
+}
+
+/**
+ * Work out the effective address of an operand into ecx, with its side effects, the same way
+ * Processor::effective() does
+ */
+void Jit::address(PBYTE mode, PBYTE r, PWORD word) {
+	switch (mode) {
+		case MODE_DEF:
+			out->mov(W32, RCX, reg(r));
+			break;
+		case MODE_AINC:
+		case MODE_AINCDEF:
+			out->mov(W32, RCX, reg(r));
+			out->alu(ALU_ADD, W16, reg(r), 2);
+			if (mode == MODE_AINCDEF)
+				load(RCX, RCX);
+			break;
+		case MODE_ADEC:
+		case MODE_ADECDEF:
+			out->alu(ALU_SUB, W16, reg(r), 2);
+			out->mov(W32, RCX, reg(r));
+			if (mode == MODE_ADECDEF)
+				load(RCX, RCX);
+			break;
+		case MODE_ABS:
+		case MODE_REL:
+		case MODE_RELDEF:
+			out->mov(RCX, (uint32_t)word);
+			if (mode == MODE_RELDEF)
+				load(RCX, RCX);
+			break;
+		default:
+			//MODE_IDX, MODE_IDXDEF
+			out->mov(W32, RCX, reg(r));
+			out->alu(ALU_ADD, W16, RCX, (SPWORD)word);
+			if (mode == MODE_IDXDEF)
+				load(RCX, RCX);
+			break;
+	}
+}
+
+/**
+ * Read a source operand's value into dst. Clobbers ecx.
+ */
+void Jit::source(PBYTE mode, PBYTE r, PWORD word, HostReg dst) {
+	if (mode == MODE_REG)
+		out->mov(W32, dst, reg(r));
+	else if (mode == MODE_IMM)
+		out->mov(dst, (uint32_t)word);
+	else {
+		address(mode, r, word);
+		load(dst, RCX);
+	}
+}
+
+/**
+ * Load a word from core. Like Processor::memory(), odd and out of range addresses set fault, and read as zero here.
+ * A fenced core catches out of range addresses in the load itself, leaving only odd ones to check for. With devices
+ * attached, out of range addresses go to them instead; if core is fenced as well, the load is marked with a hint()
+ * for the SIGSEGV handler to send it to them by (see divert()). Where the optimizer found the word is in a register
+ * already, it's read from there, and where it found the address can't fault, it isn't checked.
+ */
+void Jit::load(HostReg dst, HostReg addr) {
+	int n = accessed++;
+	if (current->from[n] >= 0) {
+		out->mov(W32, dst, reg((PBYTE)current->from[n]));
+		return;
+	}
+	if (current->safe & (1 << n)) {
+		out->movzx(dst, W16, mem(R14, addr));
+		return;
+	}
+	size_t outside = 0;
+	if (!fenced) {
+		out->alu(ALU_CMP, W32, addr, cpu.coreSizeBytes);
+		outside = out->jcc(CC_AE);
+	}
+	out->test(W8, addr, 1);
+	size_t odd = out->jcc(CC_NE);
+	if (fenced && bussed)
+		outside = out->hint();
+	out->movzx(dst, W16, mem(R14, addr));
+	PBYTE* resume = out->here();
+	int undone = length - done;
+	if (bussed) {
+		later(outside, [=] {
+			portRead(addr, dst, true, undone);
+			out->jmp(resume);
+		});
+	}
+	later(odd, [=] {
+		if (!fenced && !bussed)
+			out->bind(outside);
+		out->mov(W8, field(OFF(fault)), 1);
+		out->alu(ALU_XOR, W32, dst, dst);
+		out->jmp(resume);
+	});
+}
+
+/**
+ * Check an address the way load() does, without loading anything into a register. A fenced core still has to be read
+ * from, so that the fault comes before the store that follows rather than after whatever it stores has been worked out.
+ */
+void Jit::check(HostReg addr) {
+	if (current->safe & (1 << accessed++))
+		return;
+	size_t outside = 0;
+	if (!fenced) {
+		out->alu(ALU_CMP, W32, addr, cpu.coreSizeBytes);
+		outside = out->jcc(CC_AE);
+	}
+	out->test(W8, addr, 1);
+	size_t odd = out->jcc(CC_NE);
+	if (fenced) {
+		if (bussed)
+			outside = out->hint();
+		out->alu(ALU_CMP, W8, mem(R14, addr), 0);
+	}
+	PBYTE* resume = out->here();
+	int undone = length - done;
+	if (bussed) {
+		later(outside, [=] {
+			portRead(addr, addr, false, undone);
+			out->jmp(resume);
+		});
+	}
+	later(odd, [=] {
+		if (!fenced && !bussed)
+			out->bind(outside);
+		out->mov(W8, field(OFF(fault)), 1);
+		out->jmp(resume);
+	});
+}
+
+/**
+ * Store a word to an address already checked, then see to any predecoded or translated code built from it. If that
+ * code is thrown away the block is left, since it might be this one. When core is write-protected where there's code,
+ * a store there faults, and all that's left is to check whether it did and have the code thrown away if so. With
+ * devices attached, addresses past the end of core go to them.
+ * @param pcStored Whether PC has been stored already; if not, the block is left for the next instruction
+ */
+void Jit::store(HostReg addr, HostReg val, const Inst& inst, bool pcStored) {
+	HostReg page = addr == RDX ? RAX : RDX;
+	size_t device = 0;
+	if (bussed && fenced)
+		device = out->hint();
+	else if (bussed) {
+		out->alu(ALU_CMP, W32, addr, cpu.coreSizeBytes);
+		device = out->jcc(CC_AE);
+	}
+	out->mov(W16, mem(R14, addr), val);
+	PWORD next = inst.next;
+	int undone = length - done;
+	if (guarded) {
+		out->alu(ALU_CMP, W8, field(OFF(codeWritten)), 0);
+		size_t code = out->jcc(CC_NE);
+		later(code, [=] {
+			spill();
+			out->mov(W64, RDI, R15);
+			out->mov(W32, RSI, addr);
+			out->call(&helpers[HELPER_WRITTEN]);
+			reload();
+			if (pcStored)
+				exitHere(undone);
+			else
+				exitTo(next, undone);
+		});
+	}
+	else {
+		out->mov(W32, page, addr);
+		out->shift(SH_SHR, W32, page, ICACHE_PAGE_BITS);
+		out->mov(W64, R11, field(OFF(codePages)));
+		out->alu(ALU_CMP, W8, mem(R11, page), 0);
+		size_t code = out->jcc(CC_NE);
+		PBYTE* resume = out->here();
+		later(code, [=] {
+			spill();
+			out->mov(W64, RDI, R15);
+			out->mov(W32, RSI, addr);
+			out->call(&helpers[HELPER_WRITTEN]);
+			reload();
+			out->test(W32, RAX, RAX);
+			out->bind(out->jcc(CC_E), resume);
+			if (pcStored)
+				exitHere(undone);
+			else
+				exitTo(next, undone);
+		});
+	}
+	if (bussed) {
+		PBYTE* resume = out->here();
+		later(device, [=] {
+			portWrite(addr, val, undone);
+			out->jmp(resume);
+		});
+	}
+}
+
+/**
+ * Where translated code that faulted on an address past the end of a fenced core should carry on, with devices
+ * attached: the hint() just before the access points to the way out of line it would have taken to the device, had it
+ * checked the address first. Called from the SIGSEGV handler, on the thread running guest code.
+ * @param rip Address of the host instruction that faulted
+ * @return Address to carry on from, or 0 if the fault wasn't in such an access
+ */
+uintptr_t Jit::divert(uintptr_t rip) {
+	if (!fenced || !bussed || rip < (uintptr_t)buffer + 7 || rip >= (uintptr_t)buffer + JIT_BUFFER_SIZE)
+		return 0;
+	const PBYTE* at = (const PBYTE*)rip;
+	if (at[-7] != 0x0F || at[-6] != 0x1F || at[-5] != 0x80)
+		return 0;
+	int32_t rel;
+	memcpy(&rel, at - 4, 4);
+	stats.diverted++;
+	return rip + (intptr_t)rel;
+}
+
+/**
+ * Inline cache the instruction being translated shares for device registers
+ */
+JitPort* Jit::portCache() const {
+	return &ports[(site >> 1) & ((1 << JIT_PORT_BITS) - 1)];
+}
+
+/**
+ * Read the device register at an address past the end of core, straight through the inline cache if it's bound to
+ * that address, or else looking the register up and binding the cache to it; if there's none, fault. Scratch registers
+ * are kept, besides dst.
+ * @param keep Whether to keep the value in dst, or only read the register for the sake of the device
+ * @param undone Instructions of the block after this one, taken off the deadline already; they're left in
+ * Processor::ahead meanwhile, for device hooks scheduling interrupts to be timed from this instruction
+ */
+void Jit::portRead(HostReg addr, HostReg dst, bool keep, int undone) {
+	JitPort* cache = portCache();
+	for (HostReg r : {RAX, RCX, RDX, R11})
+		out->push(r);
+	spill();
+	out->mov(W64, field(OFF(ahead)), undone + 1);
+	out->mov(W32, RSI, addr);
+	out->lea(RDX, cache);
+	out->alu(ALU_CMP, W32, mem(RDX, offsetof(JitPort, addr)), RSI);
+	size_t miss = out->jcc(CC_NE);
+	out->mov(W64, RDI, mem(RDX, offsetof(JitPort, device)));
+	out->call((const void* const*)&cache->read);
+	size_t hit = out->jmp();
+	out->bind(miss);
+	out->mov(W64, RDI, R15);
+	out->call(&helpers[HELPER_READ]);
+	out->bind(hit);
+	out->movzx(RDI, W16, RAX);
+	out->mov(W64, field(OFF(ahead)), 0);
+	reload();
+	for (HostReg r : {R11, RDX, RCX, RAX})
+		out->pop(r);
+	if (keep)
+		out->mov(W32, dst, RDI);
+}
+
+/**
+ * Write the device register at an address past the end of core, through the inline cache as portRead() does. Scratch
+ * registers are kept.
+ * @param undone Instructions of the block after this one, as for portRead()
+ */
+void Jit::portWrite(HostReg addr, HostReg val, int undone) {
+	JitPort* cache = portCache();
+	for (HostReg r : {RAX, RCX, RDX, R11})
+		out->push(r);
+	spill();
+	out->mov(W64, field(OFF(ahead)), undone + 1);
+	out->mov(W32, RSI, addr);
+	out->movzx(RDX, W16, val);
+	out->lea(RCX, cache);
+	out->alu(ALU_CMP, W32, mem(RCX, offsetof(JitPort, addr)), RSI);
+	size_t miss = out->jcc(CC_NE);
+	out->mov(W64, RDI, mem(RCX, offsetof(JitPort, device)));
+	out->call((const void* const*)&cache->write);
+	size_t hit = out->jmp();
+	out->bind(miss);
+	out->mov(W64, RDI, R15);
+	out->call(&helpers[HELPER_WRITE]);
+	out->bind(hit);
+	out->mov(W64, field(OFF(ahead)), 0);
+	reload();
+	for (HostReg r : {R11, RDX, RCX, RAX})
+		out->pop(r);
+}
+
+/**
+ * Trap if operand resolution faulted, as Dispatcher::faulted() does
+ * @param pcStored Whether PC has been stored already; if not, the trap is taken with PC at the next instruction
+ */
+void Jit::faultCheck(const Inst& inst, bool pcStored) {
+	out->alu(ALU_CMP, W8, field(OFF(fault)), 0);
+	size_t faulted = out->jcc(CC_NE);
+	PWORD next = inst.next;
+	int undone = length - done;
+	later(faulted, [=] {
+		if (!pcStored)
+			out->mov(W16, field(OFF(registers) + 2 * PC), (int32_t)next);
+		spill();
+		out->mov(W64, RDI, R15);
+		out->mov(RSI, (uint32_t)VEC_BUSERR);
+		out->call(&helpers[HELPER_TRAP]);
+		reload();
+		exitHere(undone);
+	});
+}
+
+/**
+ * Whether none of an instruction's loads and checks can fault, so there's no need to look for one having faulted
+ */
+bool Jit::faultless(const Inst& inst) {
+	return inst.safe == (1 << inst.accesses) - 1;
+}
+
+/**
+ * Add N and Z, worked out from ax (or al), to the condition codes in r11d. Clobbers edx.
+ */
+void Jit::nz(Width w) {
+	out->movzx(RDX, w, RAX);
+	out->shift(SH_SHR, W32, RDX, w == W8 ? 4 : 12);
+	out->alu(ALU_AND, W32, RDX, SN);
+	out->alu(ALU_OR, W32, R11, RDX);
+	out->alu(ALU_XOR, W32, RDX, RDX);
+	out->test(w, RAX, RAX);
+	out->setcc(CC_E, RDX);
+	out->shift(SH_SHL, W32, RDX, 2);
+	out->alu(ALU_OR, W32, R11, RDX);
+}
+
+/**
+ * Replace the condition codes in mask with those in r11d
+ */
+void Jit::setFlags(PBYTE mask) {
+	out->alu(ALU_AND, W32, HOST_PS, (PBYTE)~mask);
+	out->alu(ALU_OR, W32, HOST_PS, R11);
+}
+
+/**
+ * Condition codes for a shift or rotate of ax, as Processor::shiftFlags() sets them, with the new C in edx
+ */
+void Jit::shiftFlags() {
+	out->movzx(RAX, W16, RAX);
+	out->mov(W32, R11, RAX);
+	out->shift(SH_SHR, W32, R11, 15);
+	out->alu(ALU_XOR, W32, R11, RDX);
+	out->alu(ALU_ADD, W32, R11, R11);
+	out->alu(ALU_OR, W32, R11, RDX);
+	nz(W16);
+	setFlags(SN | SZ | SV | SC);
+}
+
+/**
+ * Leave the block for pc
+ * @param undone Instructions of the block not run, to hand back to the deadline
+ */
+void Jit::exitTo(PWORD pc, int undone) {
+	out->mov(W16, field(OFF(registers) + 2 * PC), (int32_t)pc);
+	exitHere(undone);
+}
+
+/**
+ * Leave the block with PC as already stored
+ * @param undone Instructions of the block not run, to hand back to the deadline
+ */
+void Jit::exitHere(int undone) {
+	if (undone)
+		out->alu(ALU_ADD, W64, field(OFF(deadline)), undone);
+	out->jmp(exit);
+}
+
+/**
+ * Leave the block for a fixed address, by way of a jump that can later be chained straight to the block there
+ * @param undone Instructions of the block not run, to hand back to the deadline
+ */
+void Jit::chainTo(PWORD pc, int undone) {
+	if (undone)
+		out->alu(ALU_ADD, W64, field(OFF(deadline)), undone);
+	if (!(pc & 1) && pc < cpu.coreSizeBytes)
+		chains.push_back(JitChain{pc, out->jmp()});
+	exitTo(pc, 0);
+}
+
+/**
+ * Go on to the block at the address in PC if it's in the indirect branch table, and leave the block otherwise
+ */
+void Jit::exitIndirect() {
+	out->movzx(RCX, W16, field(OFF(registers) + 2 * PC));
+	out->mov(W32, RAX, RCX);
+	out->shift(SH_SHR, W32, RAX, 1);
+	out->alu(ALU_AND, W32, RAX, (1 << JIT_TARGET_BITS) - 1);
+	out->shift(SH_SHL, W32, RAX, 4);
+	out->lea(RDX, targets);
+	out->alu(ALU_CMP, W32, mem(RDX, RAX, offsetof(JitTarget, pc)), RCX);
+	size_t miss = out->jcc(CC_NE);
+	out->jmp(mem(RDX, RAX, offsetof(JitTarget, code)));
+	out->bind(miss);
+	out->jmp(exit);
+}
+
+/**
+ * Emit code out of line, after the body of the block, for a jump emitted now
+ * @param jump Jump to the out of line code
+ * @param body Emits the out of line code
+ */
+void Jit::later(size_t jump, std::function<void()> body) {
+	cold.push_back([=] {
+		out->bind(jump);
+		body();
+	});
+}
+
+/**
+ * Host register a guest register is kept in; PC isn't kept in one
+ */
+HostReg Jit::reg(PBYTE r) const {
+	return pinned[r];
+}
+
+/**
+ * Write the guest registers and ps back to the Processor, for helpers and on the way out
+ */
+void Jit::spill() {
+	for (int r = R0; r < PC; r++)
+		out->mov(W16, field(OFF(registers) + 2 * r), pinned[r]);
+	out->mov(W8, field(OFF(ps)), HOST_PS);
+}
+
+/**
+ * Load the guest registers and ps from the Processor, on the way in and after helpers, which may have changed them
+ */
+void Jit::reload() {
+	for (int r = R0; r < PC; r++)
+		out->movzx(pinned[r], W16, field(OFF(registers) + 2 * r));
+	out->movzx(HOST_PS, W8, field(OFF(ps)));
+}
+
+Mem Jit::field(size_t offset) const {
+	return mem(R15, (int32_t)offset);
+}
+
+/**
+ * Run translated code, a block at a time, until the deadline passes. Where no translation can be had, or the deadline
+ * won't cover the whole of one, the interpreter steps through instead.
+ */
+void Processor::runJit() {
+	if (jit == nullptr)
+		jit = new Jit(*this);
+	if (!jit->usable()) {
+		runThreaded();
+		return;
+	}
+	while (deadline > 0) {
+		if (!runTranslated(false)) {
+			step();
+			deadline--;
+		}
+	}
+}
+
+/**
+ * Run the translation of the block at PC, and whatever it chains on to, translating it first if need be
+ * @param background Leave the translation to the background thread, and run nothing until it's done
+ * @return Whether anything ran; nothing does if there's no translation to be had or it won't fit before the deadline
+ */
+bool Processor::runTranslated(bool background) {
+	if (jit == nullptr)
+		jit = new Jit(*this);
+	const JitBlock* block = background ? jit->prepare(registers[PC]) : jit->lookup(registers[PC]);
+	if (block == nullptr || (int64_t)block->length > deadline)
+		return false;
+	jit->enter(block);
+	return true;
+}
+
+/**
+ * Cap the memory translated code may take up. Once it's full, the translations that have gone longest without running
+ * make way for new ones. Anything translated so far is thrown away.
+ * @param bytes Cap
+ */
+void Processor::translationLimit(uint64_t bytes) {
+	if (jit == nullptr)
+		jit = new Jit(*this);
+	jit->bound((size_t)bytes);
+}
+
+/**
+ * How translation has gone so far; all zeroes if nothing has been translated
+ */
+JitStats Processor::translationStats() const {
+	return jit ? jit->statistics() : JitStats();
+}
+
+/**
+ * Write down where each block is translated to and what it was translated from, so that host profilers can put names
+ * to samples in translated code rather than bare addresses. Blocks are named for the guest addresses they start and
+ * end at. perf report reads perf maps by itself, from /tmp; jitdumps need perf record -k mono and perf inject --jit.
+ * @param formats SYMBOLS_PERF_MAP and/or SYMBOLS_JITDUMP; none to stop
+ * @param dir Directory to write the files to, named for the process
+ * @return Whether any of them could be written
+ */
+bool Processor::profilerSymbols(int formats, const char* dir) {
+	if (jit == nullptr)
+		jit = new Jit(*this);
+	return jit->symbolize(formats, dir);
+}
+
+/**
+ * Write each block translated from now on to a file, in the translator's intermediate form after it's been optimized,
+ * marking what was left out: loads read from registers, checks found unneeded, condition codes nothing reads, and
+ * instructions and stores whose results are overwritten before they're seen. For finding out what the optimizer made
+ * of some code, rather than for everyday use.
+ * @param path File to write, emptied first; null to stop
+ * @return Whether it could be written
+ */
+bool Processor::translationDump(const char* path) {
+	if (jit == nullptr)
+		jit = new Jit(*this);
+	return jit->dump(path ? path : "");
+}
+
+/**
+ * Keep translated code in a directory on disk, so that later runs of the same code can read it back rather than
+ * translate it again. New translations are written out when the processor is destroyed.
+ * @param dir Directory to keep the cache in; it's made if need be
+ * @param cap Most bytes the cache may take up; the oldest pages are deleted to make room
+ */
+void Processor::translationCache(const char* dir, uint64_t cap) {
+	if (jit == nullptr)
+		jit = new Jit(*this);
+	jit->persist(dir, cap);
+}
+
+#else
+
+/**
+ * Never made without a translator, but Processor still deletes its pointer to one
+ */
+Jit::~Jit() {
+}
+
+/**
+ * No translator for this host; the threaded interpreter stands in
+ */
+void Processor::runJit() {
+	runThreaded();
+}
+
+/**
+ * Nothing is ever translated
+ */
+bool Processor::runTranslated(bool) {
+	return false;
+}
+
+/**
+ * Nothing is ever translated, so there's nothing to keep
+ */
+void Processor::translationCache(const char*, uint64_t) {
+}
+
+void Processor::translationLimit(uint64_t) {
+}
+
+JitStats Processor::translationStats() const {
+	return JitStats();
+}
+
+bool Processor::profilerSymbols(int, const char*) {
+	return false;
+}
+
+bool Processor::translationDump(const char*) {
+	return false;
+}
+
+#endif
@@ -0,0 +1,348 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Dispatch.h"
+#include "Emitter.h"
+#include "JitCache.h"
+#include "JitSymbols.h"
+
+#define		JIT_BUFFER_SIZE		(16 << 20)	//!< Bytes of host code, for all translated blocks together
+#define		JIT_BLOCK_LIMIT		32			//!< Most guest instructions in one block
+#define		JIT_BLOCK_SPAN		(JIT_BLOCK_LIMIT * 6)	//!< Most bytes of guest code one block can be built from
+#define		JIT_BLOCK_ROOM		(16 << 10)	//!< Free bytes made before translating a block; no block is bigger
+#define		JIT_TARGET_BITS		10			//!< log2 of the number of entries in the indirect branch table
+#define		JIT_TARGET_NONE		0xFFFFFFFF	//!< Guest address of an empty indirect branch table entry
+#define		JIT_RETURN_DEPTH	32			//!< Calls the return stack remembers; a power of two
+#define		JIT_PORT_BITS		6			//!< log2 of the number of inline caches for device registers
+#define		JIT_PORT_NONE		0xFFFFFFFF	//!< Address of an empty inline cache
+#define		JIT_ACCESSES		4			//!< Most loads and checks of core one instruction makes
+#define		JIT_ALL_CODES		(PBYTE)(SN | SZ | SV | SC)
+#define		JIT_TRACE_BIAS		4			//!< Times more often one side of a branch must be taken to trace through it
+
+/**
+ * A block of guest code, translated into host code: a basic block, or a trace of them through the hot side of branches
+ */
+struct JitBlock {
+	PWORD start;	//!< Address of the first instruction
+	PWORD end;		//!< Address just past the last word the block was built from
+	PWORD length;	//!< Number of instructions
+	PBYTE* code;	//!< Host code
+	size_t size;	//!< Bytes of host code
+	std::vector<JitChain> chains;	//!< Jumps out of the block that can be chained
+	std::vector<size_t> relocs;		//!< Positions of rel32 fields pointing outside the block
+	bool installed;					//!< Whether it's been installed, or is still waiting to be collected
+};
+
+/**
+ * Entry in the table translated code looks indirect branch targets up in, hashed by guest address
+ */
+struct JitTarget {
+	uint32_t pc;		//!< Guest address, or JIT_TARGET_NONE
+	uint32_t unused;
+	const PBYTE* code;	//!< Host code of the block starting at pc
+};
+
+/**
+ * Shadow of the guest's call stack, kept by translated code: each jsr pushes the address it will return to and where
+ * to go on from there in host code, and each rts pops the top entry, going straight there if it's for the right
+ * address. The stack wraps rather than overflowing, so calls nested too deep only cost a miss on the way back out.
+ */
+struct JitReturnStack {
+	uint32_t top;		//!< Index of the latest entry
+	uint32_t unused[3];
+	JitTarget entries[JIT_RETURN_DEPTH];
+};
+
+/**
+ * Inline cache for translated loads and stores that reach past the end of core, shared by every site hashed to it: the
+ * device register it last went to, bound straight to that register's hooks. It's only good for that address, so sites
+ * sharing it cost each other a lookup but never go to the wrong register.
+ */
+struct JitPort {
+	uint32_t addr;		//!< Address of the register, or JIT_PORT_NONE
+	uint32_t unused;
+	void* device;
+	PortRead read;
+	PortWrite write;
+};
+
+/**
+ * Dynamic binary translator. Guest code is translated a block at a time into x86-64 code, which runs against the
+ * Processor's own registers and core and hands control back to Processor::runJit() at the end of every block.
+ * Instructions the translator doesn't handle are run by the interpreter from inside the translated code, so anything
+ * that runs under the interpreter runs here too.
+ *
+ * Blocks that end in a branch to a fixed address jump straight into the translation of the block there, once there is
+ * one, and indirect jumps, returns and the like look their target up in a small table; either way control only goes
+ * back to Processor::runJit() when the deadline passes or the next block hasn't been translated. Returns from
+ * subroutines are predicted with a JitReturnStack, and only fall back on the table when the guest has returned
+ * somewhere other than where it was called from.
+ *
+ * Blocks are basic blocks, unless the tiered engine has counted enough entries to the two sides of the conditional
+ * branch one ends in to tell that one of them is far hotter than the other. Then, if that side is further on, the
+ * block is traced on through the branch as a superblock, and the cold side is left by a side exit, so the passes below
+ * see across the branch. Tracing only goes forwards, so a block is never built from words outside its start and end.
+ *
+ * Blocks can also be translated on a background thread, for the tiered engine, which keeps interpreting them in the
+ * meantime. The guest's code is scanned up front, on the thread that runs it; the background thread only generates
+ * host code, into space in the buffer nothing can reach yet, and the block is installed next time the running thread
+ * asks for a block, unless the code it was built from has been written over since.
+ *
+ * The buffer can be capped. Translations are put in it round and round like a clock hand; when the hand comes to a
+ * translation in the way, it's evicted, unless it has been run since the hand last came by, in which case it gets
+ * another lap. Every block marks itself in a table of hit flags whenever it runs, for the hand to check and clear.
+ *
+ * Each block is lowered into an intermediate form before it's translated, and passes over that work out what can be
+ * left out: condition codes nothing reads, loads of values already in a register, checks of addresses that are
+ * constant or have been checked already, and instructions and stores whose results are overwritten before anything
+ * can see them. Code generation still goes an instruction at a time, leaving out what the passes found it could.
+ *
+ * Translations can be kept in a JitCache on disk between runs. Each page of guest code is looked up there the first
+ * time a block in it is asked for, and pages with new translations are written back when the buffer is flushed.
+ * Translated code only refers to things outside itself relative to the start of the buffer, and the cache keeps
+ * those references relative to that, so blocks can be put anywhere in the buffer when they're read back.
+ */
+class Jit {
+public:
+	explicit Jit(Processor& cpu);
+	~Jit();
+	Jit(const Jit&) = delete;
+	void operator=(const Jit&) = delete;
+
+	bool usable() const;
+	const JitBlock* lookup(PWORD pc);
+	const JitBlock* prepare(PWORD pc);
+	void enter(const JitBlock* block);
+	void invalidate(PWORD addr);
+	void flush();
+	void persist(const std::string& dir, uint64_t cap);
+	void reconfigure();
+	void bound(size_t bytes);
+	JitStats statistics();
+	uintptr_t divert(uintptr_t rip);
+	bool symbolize(int formats, const std::string& dir);
+	bool dump(const std::string& path);
+
+private:
+	//One guest instruction, as scanned ahead of translation, with what the optimizer found out about it
+	struct Inst {
+		PWORD pc;
+		PWORD next;
+		Decoded d;
+		PBYTE op;
+		PBYTE live;		//!< Condition codes something reads after this instruction, before they're next set
+		PBYTE accesses;	//!< Loads and checks of core it makes, in the order they're translated
+		PBYTE safe;		//!< Bit n set if the nth of them is known not to fault, so needn't be checked
+		int8_t from[JIT_ACCESSES];	//!< Register already holding what the nth load reads, or -1
+		bool dead;		//!< Nothing it does is ever seen, so it needn't be translated at all
+		bool unstored;	//!< What it stores to core is stored over before anything can see it
+		PWORD onto;		//!< For a branch the block is traced through, the side it goes on to; 0 for anything else
+	};
+
+	/*
+	 * Intermediate form of a block, between scanning and code generation: a list of operations, each defining at most
+	 * one value, named for its position in the list and never redefined. Guest registers are only read by GET and
+	 * written by PUT, core only by LOAD, CHECK and STORE, and condition codes only by FLAGS, so the passes over it can
+	 * tell what each instruction depends on without knowing how it's translated.
+	 */
+	enum IrCode : PBYTE {
+		IR_GET,		//!< Read register reg; a is the value last put there, or -1 if it isn't known
+		IR_PUT,		//!< Write a to register reg
+		IR_CONST,	//!< k
+		IR_OFFSET,	//!< a + k, to 16 bits
+		IR_LOAD,	//!< Word at address a
+		IR_CHECK,	//!< Check address a for a store, as a load would
+		IR_STORE,	//!< Store b at address a
+		IR_ALU,		//!< Whatever the instruction works out from a and b
+		IR_FLAGS,	//!< Set the condition codes in mask, from those in reads and the instruction's result
+		IR_SIDE,	//!< Maybe leave the block for k, at a branch it's traced through; reads everything, writes nothing
+		IR_EXIT		//!< Leave the block, or have the interpreter run the instruction; reads and writes everything
+	};
+	struct IrOp {
+		IrCode code;
+		PBYTE inst;		//!< Instruction it belongs to
+		PBYTE reg;		//!< GET, PUT
+		int8_t from;	//!< LOAD: register already holding its value, or -1
+		PBYTE mask;		//!< FLAGS
+		PBYTE reads;	//!< FLAGS
+		int a;
+		int b;
+		PWORD k;
+		int same;		//!< LOAD: earlier value it's known to equal, or -1
+		int access;		//!< LOAD, CHECK: which of the instruction's accesses it is
+		bool safe;		//!< LOAD, CHECK, STORE: address known not to fault
+		bool dead;		//!< Left out of the translation
+	};
+
+	//Routines translated code calls into
+	enum Helper {HELPER_STEP, HELPER_TRAP, HELPER_WRITTEN, HELPER_LOOP, HELPER_READ, HELPER_WRITE, HELPER_COUNT};
+	static int helperStep(Processor* cpu, uint32_t pc, uint32_t next);
+	static void helperTrap(Processor* cpu, uint32_t vector);
+	static int helperWritten(Processor* cpu, uint32_t addr);
+	static void helperLoop(Processor* cpu);
+	static uint32_t helperRead(Processor* cpu, uint32_t addr, JitPort* cache);
+	static void helperWrite(Processor* cpu, uint32_t addr, uint32_t val, JitPort* cache);
+
+	typedef void (*Entry)(Processor* cpu, const PBYTE* code, PWORD* core);
+
+	//A block handed to the background thread to translate
+	struct Job {
+		std::vector<Inst> insts;
+		uint64_t epoch;				//!< Flushes before the block was scanned
+		uint32_t stamp;				//!< Writes to the pages it was scanned from, before it was scanned
+		JitBlock* block;			//!< Translation, or null if the buffer ran out
+	};
+
+	JitBlock* translate(PWORD pc);
+	JitBlock* build(std::vector<Inst> insts);
+	uint32_t stamp(PWORD start, PWORD end) const;
+	void work();
+	void collect();
+	void stop();
+	std::vector<Inst> scan(PWORD pc);
+	PWORD trace(const Inst& inst) const;
+	static bool native(const Inst& inst);
+	static uint16_t branchMask(PBYTE op);
+	static PBYTE flagEffects(const Inst& inst, PBYTE& reads);
+	static bool bulkLoop(const std::vector<Inst>& insts);
+	void install(JitBlock* block);
+	bool room(size_t bytes);
+	void evict(std::map<size_t, JitBlock*>::iterator at);
+	void drop(JitBlock* block);
+	bool live(const JitBlock* block) const;
+	void restore(int page);
+	void save();
+	uint64_t model() const;
+	static void link(PBYTE* at, const PBYTE* target);
+	void remember(const JitBlock* block);
+	void forgetReturns();
+	void forgetPorts();
+	static size_t targetSlot(PWORD pc);
+
+	//Optimization, in JitIr.cpp, for the block being translated
+	void optimize(std::vector<Inst>& insts);
+	void lower(const std::vector<Inst>& insts);
+	int irOp(IrCode code, int a = -1, int b = -1, PWORD k = 0);
+	int irGet(PBYTE r);
+	void irPut(PBYTE r, int v);
+	int irAccess(IrCode code, int addr, int val = -1);
+	int irAddress(PBYTE mode, PBYTE r, PWORD word);
+	int irSource(PBYTE mode, PBYTE r, PWORD word);
+	void irFlags(const Inst& inst);
+	void fold();
+	void forward(std::vector<Inst>& insts);
+	void eliminateFlags(std::vector<Inst>& insts);
+	void eliminateStores(std::vector<Inst>& insts);
+	int value(int v) const;
+	int base(int v, PWORD& offset) const;
+	bool sameAddress(int a, int b) const;
+	bool mayAlias(int a, int b) const;
+	void print(const std::vector<Inst>& insts);
+
+	//Code generation, for the block being translated
+	void emit(const Inst& inst);
+	void emitDouble(const Inst& inst);
+	void emitRegisterDouble(const Inst& inst);
+	void emitSingle(const Inst& inst);
+	void emitXor(const Inst& inst);
+	void emitBranch(const Inst& inst);
+	void emitSob(const Inst& inst);
+	void emitJmp(const Inst& inst);
+	void emitJsr(const Inst& inst);
+	void emitRts(const Inst& inst);
+	void emitCcop(const Inst& inst);
+	void emitFallback(const Inst& inst);
+	void emitLoop(const Inst& inst);
+	bool memoryMode(PBYTE mode) const;
+	void address(PBYTE mode, PBYTE reg, PWORD word);
+	void source(PBYTE mode, PBYTE reg, PWORD word, HostReg dst);
+	void load(HostReg dst, HostReg addr);
+	void check(HostReg addr);
+	void store(HostReg addr, HostReg val, const Inst& inst, bool pcStored);
+	void portRead(HostReg addr, HostReg dst, bool keep, int undone);
+	void portWrite(HostReg addr, HostReg val, int undone);
+	JitPort* portCache() const;
+	void faultCheck(const Inst& inst, bool pcStored);
+	static bool faultless(const Inst& inst);
+	void nz(Width w);
+	void setFlags(PBYTE mask);
+	void shiftFlags();
+	void exitTo(PWORD pc, int undone);
+	void exitHere(int undone);
+	void chainTo(PWORD pc, int undone = 0);
+	void exitIndirect();
+	void later(size_t jump, std::function<void()> body);
+	HostReg reg(PBYTE r) const;
+	void spill();
+	void reload();
+	Mem field(size_t offset) const;
+
+	Processor& cpu;
+	PBYTE* buffer;
+	size_t used;		//!< Offset the next block goes at; the clock hand
+	size_t window;		//!< Offset just past the free bytes at used
+	size_t limit;		//!< Offset just past the last byte blocks may take up
+	size_t codeStart;	//!< Offset of the first block, past the helpers, tables and the entry and exit code
+	Entry entry;
+	PBYTE* exit;
+	const void** helpers;
+	JitBlock** blocks;	//!< Block starting at each word of core, if there is one
+	std::map<size_t, JitBlock*> resident;	//!< Every block taking up space in the buffer, by offset
+	PBYTE* hits;		//!< Set by each block whenever it runs, by guest address; cleared by the clock hand
+	JitStats stats;
+	bool dirty;			//!< Set when blocks are invalidated, so that helpers can tell translated code to bail out
+	bool guarded;		//!< Whether core is write-protected where there's code, so stores needn't look for it
+	bool fenced;		//!< Whether addresses past the end of core fault, so loads and stores needn't check for them
+	bool bussed;		//!< Whether devices have been attached, so addresses past the end of core may reach them
+	JitTarget* targets;	//!< Indirect branch table
+	JitReturnStack* returns;
+	JitPort* ports;		//!< Inline caches for device registers, hashed by the address of the instruction
+	std::unordered_map<PWORD, std::vector<PBYTE*>> links;	//!< Chained jumps to each guest address, by rel32 field
+
+	//Background translation. Everything above belongs to the thread running guest code, apart from the buffer from
+	//used to window, which belongs to whichever thread holds building, along with used, window and resident.
+	std::thread worker;
+	std::mutex queueLock;				//!< Guards queue, finished and stopping
+	std::condition_variable wake;
+	std::deque<Job> queue;
+	std::vector<Job> finished;
+	std::atomic<bool> ready;			//!< Set when finished has blocks in it
+	bool stopping;
+	bool* queued;						//!< Blocks queued or being translated, by word of core
+	uint32_t* pageWrites;				//!< Times code in each page of core has been written over
+	uint64_t epoch;						//!< Times the buffer has been flushed
+	std::mutex building;				//!< Held while generating code
+
+	//Translations kept on disk
+	JitCache* cache;
+	bool* cacheChecked;					//!< Pages looked up in the cache since they were last written over
+	bool* pageFresh;					//!< Pages with blocks translated since they were last saved
+
+	//Names for host profilers, written as blocks are installed
+	JitSymbols* symbols;
+
+	//Intermediate form of each block translated, written as it's optimized, under building
+	FILE* dumped;
+
+	//Translation in progress
+	Emitter* out;
+	std::vector<std::function<void()>> cold;
+	std::vector<JitChain> chains;
+	int length;
+	int done;
+	PWORD site;			//!< Address of the instruction being translated
+	const Inst* current;	//!< Instruction being translated
+	int accessed;		//!< Loads and checks of core translated for it so far
+	std::vector<IrOp> ir;
+	int irRegs[PC];		//!< Value in each register as the block is lowered, or -1 if it isn't known
+	PBYTE irInst;		//!< Instruction being lowered
+	PBYTE irAccesses;	//!< Loads and checks lowered for it so far
+};
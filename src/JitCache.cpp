@@ -0,0 +1,243 @@
+#include "JitCache.h"
+
+#ifdef PDP_JIT
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Cache files are a header followed by the entries, in host byte order; they're only ever read back on the host that
+ * wrote them. The header repeats the model and key the file is named for, so a file renamed or left over from another
+ * configuration is caught even if its name happens to match.
+ */
+
+//Start of every cache file
+struct CacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t model;
+	uint64_t key;
+	uint64_t size;		//!< Bytes of entries after the header
+	uint64_t checksum;	//!< Hash of those bytes
+};
+
+//Appends values to a file image
+struct CacheWriter {
+	std::vector<PBYTE> bytes;
+
+	template <typename T> void put(T val) {
+		const PBYTE* p = (const PBYTE*)&val;
+		bytes.insert(bytes.end(), p, p + sizeof(T));
+	}
+
+	void put(const void* data, size_t size) {
+		bytes.insert(bytes.end(), (const PBYTE*)data, (const PBYTE*)data + size);
+	}
+};
+
+//Reads values back out of a file image, failing rather than reading past the end
+struct CacheReader {
+	const PBYTE* bytes;
+	size_t size;
+	size_t pos;
+
+	template <typename T> bool get(T& val) {
+		return get(&val, sizeof(T));
+	}
+
+	bool get(void* data, size_t n) {
+		if (n > size - pos)
+			return false;
+		memcpy(data, bytes + pos, n);
+		pos += n;
+		return true;
+	}
+};
+
+/**
+ * @param dir Directory to keep the cache in; it's made if it isn't there
+ * @param cap Most bytes the cache files may take up between them
+ * @param model Hash of everything besides the guest code that translations depend on
+ */
+JitCache::JitCache(const std::string& dir, uint64_t cap, uint64_t model) : dir(dir), cap(cap), model(model) {
+	mkdir(dir.c_str(), 0755);
+}
+
+/**
+ * Key a page of guest code is cached under
+ * @param page Words of the page
+ * @param words Number of words
+ * @param index Page number; code is translated for the address it's at, so the same words elsewhere are different
+ */
+uint64_t JitCache::key(const PWORD* page, size_t words, int index) const {
+	return hash(page, words * sizeof(PWORD), model ^ ((uint64_t)index * 0x9E3779B97F4A7C15ull));
+}
+
+/**
+ * Read the blocks cached for a page
+ * @param key Page's key
+ * @param entries Receives the blocks
+ * @return Whether there was a good cache file for the page; bad ones are deleted
+ */
+bool JitCache::load(uint64_t key, std::vector<JitCacheEntry>& entries) const {
+	std::string file = path(key);
+	FILE* f = fopen(file.c_str(), "rb");
+	if (f == nullptr)
+		return false;
+	std::vector<PBYTE> image;
+	PBYTE chunk[4096];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		image.insert(image.end(), chunk, chunk + n);
+	fclose(f);
+
+	CacheReader in = {image.data(), image.size(), 0};
+	CacheHeader header;
+	bool good = in.get(header) && header.magic == JIT_CACHE_MAGIC && header.version == JIT_CACHE_VERSION &&
+				header.model == model && header.key == key && header.size == image.size() - in.pos &&
+				header.checksum == hash(image.data() + in.pos, (size_t)header.size, model);
+	uint32_t count = 0;
+	good = good && in.get(count);
+	for (uint32_t i = 0; good && i < count; i++) {
+		JitCacheEntry entry;
+		uint32_t codeSize = 0, chainCount = 0, relocCount = 0;
+		good = in.get(entry.start) && in.get(entry.end) && in.get(entry.length) && in.get(codeSize) &&
+			   in.get(chainCount) && in.get(relocCount) && entry.end > entry.start && !(entry.start & 1) &&
+			   !(entry.end & 1) && codeSize <= image.size() && chainCount <= codeSize && relocCount <= codeSize;
+		if (!good)
+			break;
+		entry.guest.resize((entry.end - entry.start) / 2);
+		entry.code.resize(codeSize);
+		good = in.get(entry.guest.data(), entry.guest.size() * sizeof(PWORD)) && in.get(entry.code.data(), codeSize);
+		for (uint32_t c = 0; good && c < chainCount; c++) {
+			uint32_t at = 0;
+			JitChain chain = {0, 0};
+			good = in.get(chain.target) && in.get(at) && at + 4 <= codeSize;
+			chain.at = at;
+			entry.chains.push_back(chain);
+		}
+		for (uint32_t r = 0; good && r < relocCount; r++) {
+			uint32_t at = 0;
+			good = in.get(at) && at + 4 <= codeSize;
+			entry.relocs.push_back(at);
+		}
+		if (good)
+			entries.push_back(entry);
+	}
+	if (!good || in.pos != image.size()) {
+		entries.clear();
+		remove(file.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Write the blocks for a page to the cache, replacing whatever was cached for it, then trim the cache to size. The
+ * file is written under another name first and renamed into place, so that nothing ever reads half of one.
+ * @param key Page's key
+ * @param entries Blocks to cache
+ */
+void JitCache::store(uint64_t key, const std::vector<JitCacheEntry>& entries) const {
+	CacheWriter body;
+	body.put((uint32_t)entries.size());
+	for (const JitCacheEntry& entry : entries) {
+		body.put(entry.start);
+		body.put(entry.end);
+		body.put(entry.length);
+		body.put((uint32_t)entry.code.size());
+		body.put((uint32_t)entry.chains.size());
+		body.put((uint32_t)entry.relocs.size());
+		body.put(entry.guest.data(), entry.guest.size() * sizeof(PWORD));
+		body.put(entry.code.data(), entry.code.size());
+		for (const JitChain& chain : entry.chains) {
+			body.put(chain.target);
+			body.put((uint32_t)chain.at);
+		}
+		for (size_t at : entry.relocs)
+			body.put((uint32_t)at);
+	}
+	CacheHeader header = {JIT_CACHE_MAGIC, JIT_CACHE_VERSION, model, key, body.bytes.size(),
+						  hash(body.bytes.data(), body.bytes.size(), model)};
+
+	std::string file = path(key);
+	std::string temp = file + ".tmp";
+	FILE* f = fopen(temp.c_str(), "wb");
+	if (f == nullptr)
+		return;
+	bool good = fwrite(&header, sizeof(header), 1, f) == 1 &&
+				fwrite(body.bytes.data(), 1, body.bytes.size(), f) == body.bytes.size();
+	good = fclose(f) == 0 && good;
+	if (!good || rename(temp.c_str(), file.c_str()) != 0) {
+		remove(temp.c_str());
+		return;
+	}
+	trim();
+}
+
+/**
+ * Switch to translations made for something else besides the guest code; the files kept for the old model stay put
+ * @param model Hash of everything besides the guest code that translations depend on
+ */
+void JitCache::remodel(uint64_t model) {
+	this->model = model;
+}
+
+/**
+ * 64 bit FNV-1a
+ * @param seed Mixed in first, so that equal data hashes differently under different seeds
+ */
+uint64_t JitCache::hash(const void* data, size_t size, uint64_t seed) {
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (int i = 0; i < 8; i++)
+		h = (h ^ (PBYTE)(seed >> (8 * i))) * 0x100000001B3ull;
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ ((const PBYTE*)data)[i]) * 0x100000001B3ull;
+	return h;
+}
+
+std::string JitCache::path(uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+	return dir + "/" + name + JIT_CACHE_SUFFIX;
+}
+
+/**
+ * Delete the least recently written cache files until the rest fit under the cap
+ */
+void JitCache::trim() const {
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr)
+		return;
+	struct CacheFile {
+		std::string path;
+		time_t written;
+		uint64_t size;
+	};
+	std::vector<CacheFile> files;
+	uint64_t total = 0;
+	size_t suffix = strlen(JIT_CACHE_SUFFIX);
+	while (struct dirent* e = readdir(d)) {
+		std::string name = e->d_name;
+		struct stat st;
+		if (name.size() <= suffix || name.compare(name.size() - suffix, suffix, JIT_CACHE_SUFFIX) != 0 ||
+			stat((dir + "/" + name).c_str(), &st) != 0)
+			continue;
+		files.push_back(CacheFile{dir + "/" + name, st.st_mtime, (uint64_t)st.st_size});
+		total += (uint64_t)st.st_size;
+	}
+	closedir(d);
+
+	std::sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) {
+		return a.written < b.written;
+	});
+	for (size_t i = 0; i < files.size() && total > cap; i++) {
+		remove(files[i].path.c_str());
+		total -= files[i].size;
+	}
+}
+
+#endif
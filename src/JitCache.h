@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "defs.h"
+
+#define		JIT_CACHE_MAGIC		0x4A504450	//!< "PDPJ", at the start of every cache file
+#define		JIT_CACHE_VERSION	12			//!< Bump whenever the code the translator generates changes
+#define		JIT_CACHE_SUFFIX	".pdpj"
+
+/**
+ * A jump out of a block to a fixed guest address, which can be pointed at the translation of the block there
+ */
+struct JitChain {
+	PWORD target;
+	size_t at;	//!< Position of the jump's rel32 field in the block's code
+};
+
+/**
+ * A translated block as it's kept on disk: the guest words it was built from, to check against core before it's used,
+ * and its host code, with chained jumps unlinked and the rel32 fields that point outside the block holding offsets
+ * from the start of the code buffer instead
+ */
+struct JitCacheEntry {
+	PWORD start;
+	PWORD end;
+	PWORD length;
+	std::vector<PWORD> guest;
+	std::vector<PBYTE> code;
+	std::vector<JitChain> chains;
+	std::vector<size_t> relocs;
+};
+
+/**
+ * Directory of translated blocks, one file per page of guest code, named for a hash of the page's contents and of
+ * whatever else the code generated for it depends on. Files that are the wrong version, don't match their name or
+ * fail their checksum are deleted when they're read; the oldest files are deleted whenever the directory grows past
+ * its size cap.
+ */
+class JitCache {
+public:
+	JitCache(const std::string& dir, uint64_t cap, uint64_t model);
+
+	uint64_t key(const PWORD* page, size_t words, int index) const;
+	bool load(uint64_t key, std::vector<JitCacheEntry>& entries) const;
+	void store(uint64_t key, const std::vector<JitCacheEntry>& entries) const;
+	void remodel(uint64_t model);
+	static uint64_t hash(const void* data, size_t size, uint64_t seed);
+
+private:
+	std::string path(uint64_t key) const;
+	void trim() const;
+
+	std::string dir;
+	uint64_t cap;	//!< Most bytes the directory's cache files may take up
+	uint64_t model;	//!< Hash of everything besides the guest code that translations depend on
+};
@@ -0,0 +1,631 @@
+#include <algorithm>
+#include <string>
+#include "Jit.h"
+
+/*
+ * Optimizer for the translator. A scanned block is lowered into its intermediate form, operation by operation in the
+ * same order the code generator will emit them, so that the nth load or check of an instruction here is the nth one
+ * Jit::load() and Jit::check() are asked for there. The passes then go over it in turn:
+ *
+ * - fold() turns offsets from constants into constants, so PC-relative and absolute operands (modes 67, 77, 27 and
+ *   37), and operands through registers set to constants earlier in the block, come out at known addresses. Loads and
+ *   checks of those that are even and in core can't fault, so they're translated without any checks at all.
+ * - forward() follows values through core: a load from an address loaded from or stored to earlier in the block, with
+ *   nothing in between that might have changed it, reads the register the value is still in instead. Addresses are
+ *   compared as a value plus an offset, so autoincrement and autodecrement sequences over the same words line up. An
+ *   address the block has already got through without faulting needn't be checked again either.
+ * - eliminateFlags() works out, backwards, which condition codes are read before they're set again. Anything that can
+ *   leave the block reads them all, side exits from a trace included, since ps is in plain view whenever control is
+ *   back in Processor::runJit(), and so does anything that can fault, since the trap pushes them. That includes the
+ *   start of the next block, where the deadline may run out, so codes are never assumed dead across blocks.
+ * - eliminateStores() works out, backwards, which register writes and stores to core are overwritten before anything
+ *   can see them, and leaves out instructions that do nothing else. Stores are only left out at constant addresses
+ *   outside the block, since a store over the block's own code has to be seen before that code runs.
+ *
+ * A block traced through branches is one straight line of instructions to the passes, with side exits along it. What
+ * they know about registers and core carries on past a side exit, since control only gets past one by not leaving.
+ *
+ * With devices attached, addresses past the end of core may reach one, where reading and writing can do anything, so
+ * only constant addresses in core are followed through, and nothing is followed past an access that might reach one.
+ */
+
+#ifdef PDP_JIT
+
+/**
+ * Lower a scanned block, run the passes over it, and leave what they found in its instructions for code generation.
+ * Called with building held, as it depends on how core is set up.
+ */
+void Jit::optimize(std::vector<Inst>& insts) {
+	lower(insts);
+	fold();
+	forward(insts);
+	eliminateFlags(insts);
+	eliminateStores(insts);
+	if (dumped)
+		print(insts);
+}
+
+/**
+ * Build the intermediate form of a block. Whatever the interpreter runs, and copy and clear loops it runs in bulk, are
+ * just a way out; the way out after the last instruction belongs to no instruction.
+ */
+void Jit::lower(const std::vector<Inst>& insts) {
+	ir.clear();
+	std::fill(irRegs, irRegs + PC, -1);
+	if (bulkLoop(insts)) {
+		irInst = 0;
+		irOp(IR_EXIT);
+		return;
+	}
+	for (size_t i = 0; i < insts.size(); i++) {
+		const Inst& inst = insts[i];
+		const Decoded& d = inst.d;
+		irInst = (PBYTE)i;
+		irAccesses = 0;
+		if (!native(inst)) {
+			irOp(IR_EXIT);
+			std::fill(irRegs, irRegs + PC, -1);
+			continue;
+		}
+		switch (inst.op) {
+			case OP_mov: case OP_cmp: case OP_bit: case OP_bic: case OP_bis: case OP_add: case OP_sub: {
+				int src = irSource(d.srcMode, d.srcReg, d.srcWord), dst = -1, addr = -1;
+				if (d.dstMode == MODE_REG) {
+					if (inst.op != OP_mov)
+						dst = irGet(d.dstReg);
+				}
+				else {
+					addr = irAddress(d.dstMode, d.dstReg, d.dstWord);
+					if (inst.op == OP_mov)
+						irAccess(IR_CHECK, addr);
+					else
+						dst = irAccess(IR_LOAD, addr);
+				}
+				int result = inst.op == OP_mov ? src : irOp(IR_ALU, src, dst);
+				irFlags(inst);
+				if (inst.op == OP_cmp || inst.op == OP_bit)
+					break;
+				if (d.dstMode == MODE_REG)
+					irPut(d.dstReg, result);
+				else
+					irAccess(IR_STORE, addr, result);
+				break;
+			}
+			case OP_clr: case OP_com: case OP_inc: case OP_dec: case OP_neg: case OP_adc: case OP_sbc: case OP_tst:
+			case OP_ror: case OP_rol: case OP_asr: case OP_asl: case OP_swab: case OP_sxt: {
+				bool loads = inst.op != OP_clr && inst.op != OP_sxt;
+				int val = -1, addr = -1;
+				if (d.dstMode == MODE_REG) {
+					if (loads)
+						val = irGet(d.dstReg);
+				}
+				else {
+					addr = irAddress(d.dstMode, d.dstReg, d.dstWord);
+					if (loads)
+						val = irAccess(IR_LOAD, addr);
+					else
+						irAccess(IR_CHECK, addr);
+				}
+				int result = inst.op == OP_clr ? irOp(IR_CONST) : irOp(IR_ALU, val);
+				irFlags(inst);
+				if (inst.op == OP_tst)
+					break;
+				if (d.dstMode == MODE_REG)
+					irPut(d.dstReg, result);
+				else
+					irAccess(IR_STORE, addr, result);
+				break;
+			}
+			case OP_xor_: {
+				int val = irSource(d.dstMode, d.dstReg, d.dstWord);
+				int result = irOp(IR_ALU, irGet(d.srcReg), val);
+				irFlags(inst);
+				irPut(d.srcReg, result);
+				break;
+			}
+			case OP_sob:
+				irPut(d.srcReg, irOp(IR_OFFSET, irGet(d.srcReg), -1, (PWORD)-1));
+				irOp(IR_EXIT);
+				break;
+			case OP_jmp:
+				irAddress(d.dstMode, d.dstReg, d.dstWord);
+				irOp(IR_EXIT);
+				break;
+			case OP_jsr: {
+				irAddress(d.dstMode, d.dstReg, d.dstWord);
+				int val = d.srcReg == PC ? irOp(IR_CONST, -1, -1, inst.next) : irGet(d.srcReg);
+				int sp = irOp(IR_OFFSET, irGet(SP), -1, (PWORD)-2);
+				irPut(SP, sp);
+				if (d.srcReg != PC)
+					irPut(d.srcReg, irOp(IR_CONST, -1, -1, inst.next));
+				if (bussed)
+					irAccess(IR_CHECK, sp);
+				irAccess(IR_STORE, sp, val);
+				irOp(IR_EXIT);
+				break;
+			}
+			case OP_rts: {
+				if (d.dstReg != PC)
+					irGet(d.dstReg);
+				int sp = irGet(SP);
+				int val = irAccess(IR_LOAD, sp);
+				irPut(SP, irOp(IR_OFFSET, sp, -1, 2));
+				if (d.dstReg != PC)
+					irPut(d.dstReg, val);
+				irOp(IR_EXIT);
+				break;
+			}
+			default:
+				//Condition code operators, and branches, which only read them. A branch the block is traced through
+				//only leaves it for the other side, and a BR traced through doesn't leave it at all.
+				irFlags(inst);
+				if (inst.op == OP_ccop || (inst.onto && inst.op == OP_br))
+					break;
+				if (inst.onto)
+					irOp(IR_SIDE, -1, -1, inst.onto == inst.next ? (PWORD)(inst.next + 2 * d.offset) : inst.next);
+				else
+					irOp(IR_EXIT);
+				break;
+		}
+	}
+	if (!endsBlock(insts.back().op)) {
+		irInst = (PBYTE)insts.size();
+		irOp(IR_EXIT);
+	}
+}
+
+/**
+ * Add an operation for the instruction being lowered
+ * @return Its value
+ */
+int Jit::irOp(IrCode code, int a, int b, PWORD k) {
+	ir.push_back(IrOp{code, irInst, 0, -1, 0, 0, a, b, k, -1, -1, false, false});
+	return (int)ir.size() - 1;
+}
+
+/**
+ * Read a register. The first read of one whose value isn't known names the value it has.
+ */
+int Jit::irGet(PBYTE r) {
+	int v = irOp(IR_GET, irRegs[r]);
+	ir[v].reg = r;
+	if (irRegs[r] < 0)
+		irRegs[r] = v;
+	return v;
+}
+
+void Jit::irPut(PBYTE r, int v) {
+	ir[irOp(IR_PUT, v)].reg = r;
+	irRegs[r] = v;
+}
+
+/**
+ * Load from, check or store to core, numbering loads and checks in the order they're made
+ */
+int Jit::irAccess(IrCode code, int addr, int val) {
+	int v = irOp(code, addr, val);
+	if (code != IR_STORE)
+		ir[v].access = irAccesses++;
+	return v;
+}
+
+/**
+ * Work out the effective address of an operand, with its side effects, as Jit::address() does
+ */
+int Jit::irAddress(PBYTE mode, PBYTE r, PWORD word) {
+	int addr;
+	switch (mode) {
+		case MODE_DEF:
+			return irGet(r);
+		case MODE_AINC:
+		case MODE_AINCDEF:
+			addr = irGet(r);
+			irPut(r, irOp(IR_OFFSET, addr, -1, 2));
+			return mode == MODE_AINCDEF ? irAccess(IR_LOAD, addr) : addr;
+		case MODE_ADEC:
+		case MODE_ADECDEF:
+			addr = irOp(IR_OFFSET, irGet(r), -1, (PWORD)-2);
+			irPut(r, addr);
+			return mode == MODE_ADECDEF ? irAccess(IR_LOAD, addr) : addr;
+		case MODE_ABS:
+		case MODE_REL:
+		case MODE_RELDEF:
+			addr = irOp(IR_CONST, -1, -1, word);
+			return mode == MODE_RELDEF ? irAccess(IR_LOAD, addr) : addr;
+		default:
+			//MODE_IDX, MODE_IDXDEF
+			addr = irOp(IR_OFFSET, irGet(r), -1, word);
+			return mode == MODE_IDXDEF ? irAccess(IR_LOAD, addr) : addr;
+	}
+}
+
+/**
+ * Read a source operand's value, as Jit::source() does
+ */
+int Jit::irSource(PBYTE mode, PBYTE r, PWORD word) {
+	if (mode == MODE_REG)
+		return irGet(r);
+	if (mode == MODE_IMM)
+		return irOp(IR_CONST, -1, -1, word);
+	return irAccess(IR_LOAD, irAddress(mode, r, word));
+}
+
+void Jit::irFlags(const Inst& inst) {
+	PBYTE reads;
+	IrOp& op = ir[irOp(IR_FLAGS)];
+	op.mask = flagEffects(inst, reads);
+	op.reads = reads;
+}
+
+/**
+ * Constant folding: offsets from constants become constants, and loads and checks of constant addresses that are even
+ * and in core are marked safe
+ */
+void Jit::fold() {
+	for (IrOp& op : ir) {
+		PWORD k;
+		if (op.code == IR_OFFSET && base(op.a, k) < 0) {
+			op.code = IR_CONST;
+			op.a = -1;
+			op.k = (PWORD)(k + op.k);
+		}
+		else if ((op.code == IR_LOAD || op.code == IR_CHECK || op.code == IR_STORE) && base(op.a, k) < 0)
+			op.safe = !(k & 1) && k < cpu.coreSizeBytes;
+	}
+}
+
+/**
+ * Redundant load elimination: loads of values still in a register are read from the register instead, and accesses
+ * to addresses already got through without faulting are marked safe
+ */
+void Jit::forward(std::vector<Inst>& insts) {
+	std::vector<int> known;		//Loads and stores whose values core still holds
+	std::vector<int> checked;	//Addresses accessed without faulting
+	std::vector<int> checking;	//Addresses accessed by the instruction so far, which doesn't trap until it's done
+	int holds[PC];				//Value in each register, or -1 if it isn't known
+	std::fill(holds, holds + PC, -1);
+	for (size_t i = 0; i < ir.size(); i++) {
+		IrOp& op = ir[i];
+		if (i > 0 && op.inst != ir[i - 1].inst) {
+			checked.insert(checked.end(), checking.begin(), checking.end());
+			checking.clear();
+		}
+		switch (op.code) {
+			case IR_GET:
+				if (op.a < 0)
+					holds[op.reg] = (int)i;
+				break;
+			case IR_PUT:
+				holds[op.reg] = value(op.a);
+				break;
+			case IR_EXIT:
+				std::fill(holds, holds + PC, -1);
+				known.clear();
+				break;
+			case IR_LOAD:
+			case IR_CHECK:
+			case IR_STORE: {
+				for (size_t c = 0; c < checked.size() && !op.safe; c++)
+					op.safe = sameAddress(checked[c], op.a);
+				bool followed = op.safe || !bussed;
+				if (op.code == IR_LOAD && followed) {
+					auto earlier = std::find_if(known.rbegin(), known.rend(), [&](int j) {
+						return sameAddress(ir[j].a, op.a);
+					});
+					if (earlier != known.rend()) {
+						int v = value(ir[*earlier].code == IR_LOAD ? *earlier : ir[*earlier].b);
+						for (int r = R0; r < PC && op.from < 0; r++) {
+							if (holds[r] == v) {
+								op.same = v;
+								op.from = (int8_t)r;
+								op.safe = true;
+							}
+						}
+					}
+				}
+				//Anything that might reach a device might have its hooks write to core
+				if (!followed)
+					known.clear();
+				else if (op.code == IR_STORE) {
+					known.erase(std::remove_if(known.begin(), known.end(), [&](int j) {
+						return mayAlias(ir[j].a, op.a);
+					}), known.end());
+				}
+				if (followed && op.code != IR_CHECK)
+					known.push_back((int)i);
+				if (!bussed)
+					checking.push_back(op.a);
+				break;
+			}
+			default:
+				break;
+		}
+	}
+
+	for (const IrOp& op : ir) {
+		if (op.code != IR_LOAD && op.code != IR_CHECK)
+			continue;
+		Inst& inst = insts[op.inst];
+		inst.accesses = std::max(inst.accesses, (PBYTE)(op.access + 1));
+		if (op.safe)
+			inst.safe |= 1 << op.access;
+		inst.from[op.access] = op.from;
+	}
+}
+
+/**
+ * Flag elimination: which condition codes each instruction sets are read before they're set again
+ */
+void Jit::eliminateFlags(std::vector<Inst>& insts) {
+	PBYTE live = JIT_ALL_CODES;
+	for (size_t i = ir.size(); i-- > 0;) {
+		const IrOp& op = ir[i];
+		switch (op.code) {
+			case IR_FLAGS:
+				insts[op.inst].live = live;
+				live = (PBYTE)((live & ~op.mask) | op.reads);
+				break;
+			case IR_LOAD:
+			case IR_CHECK:
+				if (!op.safe)
+					live = JIT_ALL_CODES;
+				break;
+			case IR_STORE:
+			case IR_SIDE:
+			case IR_EXIT:
+				//Stores can leave the block, if they're over code
+				live = JIT_ALL_CODES;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/**
+ * Dead store elimination, an instruction at a time from the end of the block: registers written again before they're
+ * read, and constant addresses outside the block stored to again before they're loaded from, with nothing in between
+ * that could leave the block or fault. An instruction doing nothing else that's seen is left out altogether.
+ */
+void Jit::eliminateStores(std::vector<Inst>& insts) {
+	bool needed[PC];				//Whether each register's value is read before it's next written
+	std::vector<PWORD> covered;		//Constant addresses stored to before they're next loaded from
+	std::fill(needed, needed + PC, true);
+	auto seen = [&] {
+		std::fill(needed, needed + PC, true);
+		covered.clear();
+	};
+	auto overwritten = [&](const IrOp& op) {
+		PWORD k;
+		return base(op.a, k) < 0 && (k < insts[0].pc || k >= insts.back().next) &&
+			   std::find(covered.begin(), covered.end(), k) != covered.end();
+	};
+
+	for (size_t end = ir.size(), start; end > 0; end = start) {
+		PBYTE n = ir[end - 1].inst;
+		for (start = end; start > 0 && ir[start - 1].inst == n;)
+			start--;
+
+		bool dead = n < insts.size();
+		for (size_t i = start; i < end && dead; i++) {
+			const IrOp& op = ir[i];
+			switch (op.code) {
+				case IR_PUT: dead = !needed[op.reg]; break;
+				case IR_FLAGS: dead = !(op.mask & insts[n].live); break;
+				case IR_LOAD: case IR_CHECK: dead = op.safe; break;
+				case IR_STORE: dead = overwritten(op); break;
+				case IR_SIDE: case IR_EXIT: dead = false; break;
+				default: break;
+			}
+		}
+		if (dead) {
+			insts[n].dead = true;
+			for (size_t i = start; i < end; i++)
+				ir[i].dead = true;
+			continue;
+		}
+
+		for (size_t i = end; i-- > start;) {
+			IrOp& op = ir[i];
+			PWORD k;
+			switch (op.code) {
+				case IR_GET:
+					needed[op.reg] = true;
+					break;
+				case IR_PUT:
+					needed[op.reg] = false;
+					break;
+				case IR_LOAD:
+					if (op.from >= 0) {
+						needed[op.from] = true;
+						break;
+					}
+					if (!op.safe)
+						seen();
+					else if (base(op.a, k) < 0)
+						covered.erase(std::remove(covered.begin(), covered.end(), k), covered.end());
+					else
+						covered.clear();
+					break;
+				case IR_CHECK:
+					if (!op.safe)
+						seen();
+					break;
+				case IR_STORE:
+					if (overwritten(op)) {
+						op.dead = true;
+						insts[n].unstored = true;
+						break;
+					}
+					seen();
+					if (base(op.a, k) < 0)
+						covered.push_back(k);
+					break;
+				case IR_SIDE:
+				case IR_EXIT:
+					seen();
+					break;
+				default:
+					break;
+			}
+		}
+	}
+}
+
+/**
+ * Earliest value a value is known to equal, looking through register reads and loads of values already in registers
+ */
+int Jit::value(int v) const {
+	for (;;) {
+		const IrOp& op = ir[v];
+		if (op.code == IR_GET && op.a >= 0)
+			v = op.a;
+		else if (op.code == IR_LOAD && op.same >= 0)
+			v = op.same;
+		else
+			return v;
+	}
+}
+
+/**
+ * Split a value into a base value plus a constant offset
+ * @param offset Set to the offset
+ * @return Base value, or -1 if the value is the constant offset
+ */
+int Jit::base(int v, PWORD& offset) const {
+	offset = 0;
+	for (;;) {
+		const IrOp& op = ir[value(v)];
+		if (op.code == IR_CONST) {
+			offset = (PWORD)(offset + op.k);
+			return -1;
+		}
+		if (op.code != IR_OFFSET)
+			return value(v);
+		offset = (PWORD)(offset + op.k);
+		v = op.a;
+	}
+}
+
+/**
+ * Whether two values are known to be the same address
+ */
+bool Jit::sameAddress(int a, int b) const {
+	PWORD ka, kb;
+	return base(a, ka) == base(b, kb) && ka == kb;
+}
+
+/**
+ * Whether a store to one address could change the word at another. Words at different offsets from the same base
+ * can't overlap, since one of them would have to be odd, and accessing it would have faulted.
+ */
+bool Jit::mayAlias(int a, int b) const {
+	PWORD ka, kb;
+	return base(a, ka) != base(b, kb) || ka == kb;
+}
+
+/**
+ * Condition codes in a mask, by letter
+ */
+static std::string codes(PBYTE mask) {
+	static const PWORD order[] = {SN, SZ, SV, SC};
+	std::string letters;
+	for (int i = 0; i < 4; i++)
+		if (mask & order[i])
+			letters += "nzvc"[i];
+	return letters.empty() ? "-" : letters;
+}
+
+/**
+ * Write a block's intermediate form to the dump, an instruction at a time, with what the passes made of it
+ */
+void Jit::print(const std::vector<Inst>& insts) {
+	static const char* const names[] = {"get", "put", "const", "offset", "load", "check", "store", "", "flags",
+										"side", "exit"};
+	char line[128];
+	snprintf(line, sizeof(line), "block %06o-%06o\n", insts[0].pc, insts.back().next);
+	std::string text = line;
+	for (size_t i = 0; i < ir.size(); i++) {
+		const IrOp& op = ir[i];
+		if (i == 0 || op.inst != ir[i - 1].inst) {
+			if (op.inst < insts.size()) {
+				const Inst& inst = insts[op.inst];
+				snprintf(line, sizeof(line), "%06o %s%s%s\n", inst.pc, opName(inst.op),
+						 native(inst) ? "" : " (interpreted)", inst.dead ? " (dead)" : "");
+			}
+			else
+				snprintf(line, sizeof(line), "%06o end\n", insts.back().next);
+			text += line;
+		}
+
+		const char* name = op.code == IR_ALU ? opName(insts[op.inst].op) : names[op.code];
+		int n = snprintf(line, sizeof(line), "\t%3d  %s", (int)i, name);
+		switch (op.code) {
+			case IR_GET:
+				n += snprintf(line + n, sizeof(line) - n, " r%d", op.reg);
+				if (op.a >= 0)
+					n += snprintf(line + n, sizeof(line) - n, " = v%d", op.a);
+				break;
+			case IR_PUT:
+				n += snprintf(line + n, sizeof(line) - n, " r%d, v%d", op.reg, op.a);
+				break;
+			case IR_CONST:
+			case IR_SIDE:
+				n += snprintf(line + n, sizeof(line) - n, " %06o", op.k);
+				break;
+			case IR_OFFSET:
+				n += snprintf(line + n, sizeof(line) - n, " v%d, %d", op.a, (SPWORD)op.k);
+				break;
+			case IR_LOAD:
+			case IR_CHECK:
+				n += snprintf(line + n, sizeof(line) - n, " v%d", op.a);
+				break;
+			case IR_STORE:
+				n += snprintf(line + n, sizeof(line) - n, " v%d, v%d", op.a, op.b);
+				break;
+			case IR_ALU:
+				if (op.a >= 0)
+					n += snprintf(line + n, sizeof(line) - n, op.b >= 0 ? " v%d, v%d" : " v%d", op.a, op.b);
+				break;
+			case IR_FLAGS:
+				n += snprintf(line + n, sizeof(line) - n, " %s", codes(op.mask).c_str());
+				if (op.reads)
+					n += snprintf(line + n, sizeof(line) - n, " from %s", codes(op.reads).c_str());
+				break;
+			default:
+				break;
+		}
+
+		std::string notes;
+		if (op.from >= 0)
+			notes += " in r" + std::to_string(op.from) + " as v" + std::to_string(op.same) + ",";
+		else if (op.safe && op.code != IR_STORE)
+			notes += " safe,";
+		if (op.code == IR_FLAGS && op.mask && !(op.mask & insts[op.inst].live))
+			notes += " unread,";
+		if (op.dead)
+			notes += " dead,";
+		text += line;
+		if (!notes.empty())
+			text += "\t;" + notes.substr(0, notes.size() - 1);
+		text += "\n";
+	}
+	fputs(text.c_str(), dumped);
+	fflush(dumped);
+}
+
+/**
+ * Write the intermediate form of every block translated from now on to a file, after the passes over it, marking what
+ * they found could be left out. Blocks read back from the disk cache weren't translated, so aren't written.
+ * @param path File to write, emptied first; empty to stop
+ * @return Whether it could be opened
+ */
+bool Jit::dump(const std::string& path) {
+	std::lock_guard<std::mutex> hold(building);
+	if (dumped)
+		fclose(dumped);
+	dumped = path.empty() ? nullptr : fopen(path.c_str(), "w");
+	return dumped != nullptr;
+}
+
+#endif
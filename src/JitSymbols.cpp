@@ -0,0 +1,177 @@
+#include "JitSymbols.h"
+#include "Processor.h"
+
+#ifdef PDP_JIT
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define		JITDUMP_X86_64		62	//!< ELF machine number the code is for
+
+/*
+ * jitdump files are a header followed by records, in host byte order, laid out as in perf's
+ * tools/perf/util/jitdump.h
+ */
+
+//Start of the file
+struct DumpHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		//!< Bytes of header
+	uint32_t machine;
+	uint32_t pad;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+
+//JITDUMP_CODE_LOAD record, followed by the name, with its terminator, and the code
+struct DumpLoad {
+	uint32_t id;
+	uint32_t size;		//!< Bytes of record, name and code included
+	uint64_t timestamp;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t address;
+	uint64_t codeSize;
+	uint64_t index;		//!< Unique to each load
+};
+
+static std::mutex startLock;
+static std::set<std::string> started;	//!< Files opened by this process so far, under startLock
+static std::atomic<uint64_t> loads(0);
+
+static uint64_t now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t thread() {
+#ifdef __linux__
+	return (uint32_t)syscall(SYS_gettid);
+#else
+	return (uint32_t)getpid();
+#endif
+}
+
+/**
+ * Open the files for naming translated code in
+ * @param formats SYMBOLS_PERF_MAP and/or SYMBOLS_JITDUMP
+ * @param dir Directory to put them in; perf only looks for perf maps in /tmp
+ */
+JitSymbols::JitSymbols(int formats, const std::string& dir) : map(-1), dump(-1), marker(nullptr) {
+	std::string pid = std::to_string(getpid());
+	if (formats & SYMBOLS_PERF_MAP)
+		map = open(dir + "/perf-" + pid + ".map");
+	if (formats & SYMBOLS_JITDUMP) {
+		dump = open(dir + "/jit-" + pid + ".dump");
+		if (dump < 0)
+			return;
+		marker = mmap(nullptr, (size_t)sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, dump, 0);
+		if (marker == MAP_FAILED) {
+			marker = nullptr;
+			::close(dump);
+			dump = -1;
+		}
+	}
+}
+
+JitSymbols::~JitSymbols() {
+	if (marker)
+		munmap(marker, (size_t)sysconf(_SC_PAGESIZE));
+	if (map >= 0)
+		::close(map);
+	if (dump >= 0)
+		::close(dump);
+}
+
+/**
+ * Open one of the files for appending to, emptying it first if this process hasn't written to it yet; a file with the
+ * same name can only be left over from an earlier process with the same pid. A new jitdump gets its header.
+ * @return Descriptor, or -1 if it couldn't be opened
+ */
+int JitSymbols::open(const std::string& path) {
+	std::lock_guard<std::mutex> hold(startLock);
+	bool fresh = started.insert(path).second;
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | (fresh ? O_TRUNC : 0), 0644);
+	if (fd < 0) {
+		started.erase(path);
+		return -1;
+	}
+	if (fresh && path.compare(path.size() - 5, 5, ".dump") == 0) {
+		DumpHeader header = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(DumpHeader), JITDUMP_X86_64, 0,
+							 (uint32_t)getpid(), now(), 0};
+		if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+			::close(fd);
+			started.erase(path);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/**
+ * Whether either file could be opened
+ */
+bool JitSymbols::usable() const {
+	return map >= 0 || dump >= 0;
+}
+
+/**
+ * Name a stretch of host code. Each goes out in a single write, so that processors on other threads can't split it;
+ * a file that can't be written to any more is given up on.
+ * @param name What to call it
+ * @param code Host code
+ * @param size Bytes of it
+ */
+void JitSymbols::name(const char* name, const PBYTE* code, size_t size) {
+	if (map >= 0) {
+		char line[128];
+		int n = snprintf(line, sizeof(line), "%lx %zx %s\n", (unsigned long)(uintptr_t)code, size, name);
+		if (write(map, line, (size_t)n) != n) {
+			::close(map);
+			map = -1;
+		}
+	}
+	if (dump >= 0) {
+		size_t nameSize = strlen(name) + 1;
+		DumpLoad load = {JITDUMP_CODE_LOAD, (uint32_t)(sizeof(DumpLoad) + nameSize + size), now(),
+						 (uint32_t)getpid(), thread(), (uint64_t)(uintptr_t)code, (uint64_t)(uintptr_t)code, size,
+						 loads++};
+		std::vector<PBYTE> record((const PBYTE*)&load, (const PBYTE*)(&load + 1));
+		record.insert(record.end(), (const PBYTE*)name, (const PBYTE*)name + nameSize);
+		record.insert(record.end(), code, code + size);
+		if (write(dump, record.data(), record.size()) != (ssize_t)record.size()) {
+			munmap(marker, (size_t)sysconf(_SC_PAGESIZE));
+			marker = nullptr;
+			::close(dump);
+			dump = -1;
+		}
+	}
+}
+
+/**
+ * Name a translated block for the guest code it was built from. Guest addresses are physical ones; there's no memory
+ * management to map them.
+ * @param start Address of its first instruction
+ * @param end Address just past its last word
+ */
+void JitSymbols::block(PWORD start, PWORD end, const PBYTE* code, size_t size) {
+	char label[32];
+	snprintf(label, sizeof(label), "pdp11 %06o-%06o", start, end);
+	name(label, code, size);
+}
+
+#endif
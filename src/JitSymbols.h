@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include "defs.h"
+
+#define		JITDUMP_MAGIC		0x4A695444	//!< "JiTD", at the start of every jitdump file
+#define		JITDUMP_VERSION		1
+#define		JITDUMP_CODE_LOAD	0			//!< Record for code put somewhere in memory
+
+/**
+ * Names translated code for host profilers, which otherwise only see addresses in an anonymous mapping. Every block
+ * is named for the guest addresses it was built from, and written down as it's installed:
+ *
+ * - perf-<pid>.map, a line per block of its host address, size and name, which perf report reads by itself
+ * - jit-<pid>.dump, perf's jitdump format, a record per block with a copy of its code and the time it was installed,
+ *   for perf inject --jit to turn into objects perf report can disassemble. Once the buffer is capped, blocks get put
+ *   where others were evicted from, and only the timestamps tell which was there when a sample was taken; perf has to
+ *   record with -k mono for them to line up.
+ *
+ * Every processor in the process writes to the same two files; the first to open either starts it afresh.
+ */
+class JitSymbols {
+public:
+	JitSymbols(int formats, const std::string& dir);
+	~JitSymbols();
+	JitSymbols(const JitSymbols&) = delete;
+	void operator=(const JitSymbols&) = delete;
+
+	bool usable() const;
+	void name(const char* name, const PBYTE* code, size_t size);
+	void block(PWORD start, PWORD end, const PBYTE* code, size_t size);
+
+private:
+	int open(const std::string& path);
+
+	int map;		//!< perf map, or -1
+	int dump;		//!< jitdump, or -1
+	void* marker;	//!< Executable mapping of the jitdump, which is how perf record finds it
+};
@@ -0,0 +1,130 @@
+#include <cstring>
+#include "Native.h"
+
+#ifdef PDP_NATIVE
+#include <dlfcn.h>
+#endif
+
+/**
+ * @param cpu Processor to run recompiled code on
+ */
+Native::Native(Processor& cpu) : cpu(cpu), dirty(false), ran(0) {
+	blocks = new const NativeBlock*[cpu.coreSizeBytes / 2]();
+}
+
+Native::~Native() {
+	delete[] blocks;
+#ifdef PDP_NATIVE
+	for (void* handle : handles)
+		dlclose(handle);
+#endif
+}
+
+/**
+ * Load a shared object built by the recompiler, and use whichever of its blocks match what's in core. Blocks loaded
+ * earlier for the same addresses are replaced.
+ * @param path Shared object
+ * @return Number of blocks put to use, or -1 if the shared object couldn't be loaded or was built for a different
+ * version of the emulator
+ */
+int Native::load(const char* path) {
+#ifdef PDP_NATIVE
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == nullptr)
+		return -1;
+	auto entry = (const NativeImage* (*)())dlsym(handle, NATIVE_ENTRY);
+	const NativeImage* image = entry ? entry() : nullptr;
+	if (image == nullptr || image->abi != NATIVE_ABI || image->layout != sizeof(Processor)) {
+		dlclose(handle);
+		return -1;
+	}
+	handles.push_back(handle);
+
+	int used = 0;
+	for (uint32_t i = 0; i < image->count; i++) {
+		const NativeBlock& block = image->blocks[i];
+		if ((block.start & 1) || block.end > cpu.coreSizeBytes || block.end <= block.start ||
+			memcmp(block.words, cpu.core.word + (block.start >> 1), (size_t)(block.end - block.start)) != 0)
+			continue;
+		blocks[block.start >> 1] = &block;
+		used++;
+
+		//Writes to the words it was built from have to drop it, as if they'd been predecoded
+		for (int page = block.start >> ICACHE_PAGE_BITS; page <= (block.end - 1) >> ICACHE_PAGE_BITS; page++)
+			cpu.holdsCode(page);
+	}
+	return used;
+#else
+	(void)path;
+	return -1;
+#endif
+}
+
+/**
+ * Run the recompiled block at PC, if there is one and the processor's deadline covers it, taking what it ran off the
+ * deadline. Blocks only come back to run() between them, so an interrupt waits for the end of the block it came in
+ * during.
+ * @return Whether there was a block to run
+ */
+bool Native::run() {
+	PWORD pc = cpu.registers[PC];
+	if ((pc & 1) || pc >= cpu.coreSizeBytes)
+		return false;
+	const NativeBlock* block = blocks[pc >> 1];
+	if (block == nullptr || (int64_t)block->length > cpu.deadline)
+		return false;
+	dirty = false;
+	ran++;
+
+	//Device hooks in the block time interrupts from its start, and mustn't cut the deadline short of its end
+	cpu.deadline -= (int64_t)block->length;
+	cpu.ahead = (int64_t)block->length;
+	uint64_t ran = block->code(cpu, cpu.registers, dirty);
+	cpu.ahead = 0;
+	cpu.deadline += (int64_t)(block->length - ran);
+	return true;
+}
+
+/**
+ * Number of blocks run so far
+ */
+uint64_t Native::runs() const {
+	return ran;
+}
+
+/**
+ * Drop any blocks built from words in the same page as addr
+ * @param addr Byte address written to
+ */
+void Native::invalidate(PWORD addr) {
+	int first = addr >> ICACHE_PAGE_BITS << ICACHE_PAGE_BITS;
+	int last = first + (1 << ICACHE_PAGE_BITS);
+	if (last > cpu.coreSizeBytes)
+		last = cpu.coreSizeBytes;
+	for (int a = first < NATIVE_BLOCK_SPAN ? 0 : first - NATIVE_BLOCK_SPAN; a < last; a += 2) {
+		const NativeBlock* block = blocks[a >> 1];
+		if (block && block->end > first) {
+			blocks[a >> 1] = nullptr;
+			dirty = true;
+		}
+	}
+}
+
+/**
+ * Load guest code recompiled ahead of time into a shared object (see Recompiler), to be run in place of whatever
+ * engine mode() picks wherever it matches what's in core
+ * @param path Shared object
+ * @return Number of blocks put to use, or -1 if it couldn't be loaded
+ */
+int Processor::loadNative(const char* path) {
+	if (native == nullptr)
+		native = new Native(*this);
+	return native->load(path);
+}
+
+/**
+ * Number of times blocks loaded by loadNative() have been run, all told
+ */
+uint64_t Processor::nativeRuns() const {
+	return native ? native->runs() : 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <vector>
+#include "Processor.h"
+
+/*
+ * Interface between the runtime and guest code recompiled ahead of time into a shared object (see Recompiler). The
+ * generated code includes this header, and only calls Processor's public interface, through the running executable.
+ */
+
+#define		NATIVE_ABI			1					//!< Bump whenever the interface below changes
+#define		NATIVE_ENTRY		"pdpNativeImage"	//!< Function every shared object exports, returning its NativeImage
+#define		NATIVE_BLOCK_LIMIT	64					//!< Most guest instructions in one block
+#define		NATIVE_BLOCK_SPAN	(NATIVE_BLOCK_LIMIT * 6)	//!< Most bytes of guest code one block can be built from
+
+/**
+ * Run a block of recompiled code, from its start up to and including its last instruction, or until control goes
+ * somewhere else, the processor halts or code is written over
+ * @param r The processor's registers
+ * @param dirty Set if an instruction run through the interpreter writes over code that may be recompiled
+ * @return Number of instructions run
+ */
+typedef uint64_t (*NativeCode)(Processor& cpu, PWORD* r, const volatile bool& dirty);
+
+/**
+ * A recompiled basic block, along with the guest words it was built from, which have to be in core for it to be used
+ */
+struct NativeBlock {
+	PWORD start;
+	PWORD end;			//!< Address just past the last word it was built from
+	PWORD length;		//!< Most instructions it runs
+	const PWORD* words;	//!< Guest code from start to end
+	NativeCode code;
+};
+
+/**
+ * Everything a shared object has to offer
+ */
+struct NativeImage {
+	uint32_t abi;		//!< NATIVE_ABI it was built with
+	uint32_t layout;	//!< sizeof(Processor) it was built with
+	uint32_t count;
+	const NativeBlock* blocks;
+};
+
+/**
+ * Recompiled code loaded into a Processor. Blocks are only used while core holds the code they were built from; a
+ * write to any of it drops them for good.
+ */
+class Native {
+public:
+	explicit Native(Processor& cpu);
+	~Native();
+	Native(const Native&) = delete;
+	void operator=(const Native&) = delete;
+
+	int load(const char* path);
+	bool run();
+	void invalidate(PWORD addr);
+	uint64_t runs() const;
+
+private:
+	Processor& cpu;
+	std::vector<void*> handles;			//!< Shared objects loaded
+	const NativeBlock** blocks;			//!< Block starting at each word of core, if there is one
+	volatile bool dirty;
+	uint64_t ran;						//!< Blocks run so far
+};
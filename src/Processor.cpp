@@ -1,5 +1,29 @@
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include "Processor.h"
+#include "Jit.h"
+#include "Native.h"
+#include "WriteGuard.h"
+
+/*
+ * With PDP_VERIFY_FLAGS, shifts and rotates are rerun on the host and checked against the x86 result and flags. Only
+ * the flags in mask are compared, since x86 rotates leave N and Z alone and the PDP 11 rotates force C.
+ */
+#ifdef PDP_VERIFY_FLAGS
+#define		X86_VERIFY(insn, before, after, mask) { \
+	PWORD host = (before); \
+	uint64_t flags; \
+	asm(insn " $1, %0\n\t" \
+		"pushf\n\t" \
+		"popq %1" \
+		: "+r" (host), "=r" (flags)); \
+	assert(host == (after)); \
+	assert((x86Flags(flags) & (mask)) == (ps & (mask))); \
+}
+#else
+#define		X86_VERIFY(insn, before, after, mask)
+#endif
 
 
 /**
@@ -9,9 +33,31 @@ Processor::Processor(){
 	for (int i = 0; i < REGCOUNT; i++) // NOLINT
 		registers[i] = 0;
 	ps = 0;
-	core.byte = new PBYTE[1<<15];
+	flagOp = FLAGS_NONE;
+	core.byte = WriteGuard::allocate(1<<15);
 	coreSizeBytes = 1<<15;
 	halted = false;
+	fault = false;
+	scratch = 0;
+	dispatch = dispatchTable();
+	execMode = EXEC_THREADED;
+	icache = new Decoded[coreSizeBytes / 2]();
+	codePages = new bool[(coreSizeBytes >> ICACHE_PAGE_BITS) + 1]();
+	jit = nullptr;
+	deadline = 0;
+	slice = 0;
+	ahead = 0;
+	stopped = false;
+	waiting = false;
+	clock = 0;
+	heat = new uint32_t[coreSizeBytes / 2]();
+	warmAt = TIER_WARM;
+	hotAt = TIER_HOT;
+	native = nullptr;
+	guard = nullptr;
+	codeWritten = false;
+	ports = nullptr;
+	latches = nullptr;
 }
 
 /**
@@ -21,25 +67,90 @@ Processor::Processor(){
 Processor::Processor(const Processor& cpu){
 	for (int i = 0; i < REGCOUNT; i++)
 		registers[i] = cpu.registers[i];
-	ps = cpu.ps;
-	core.byte = new PBYTE[cpu.coreSizeBytes];
+	ps = (PBYTE)cpu.pstat();
+	flagOp = FLAGS_NONE;
+	core.byte = WriteGuard::allocate(cpu.coreSizeBytes);
 	memcpy(core.byte, cpu.core.byte, (size_t)cpu.coreSizeBytes);
 	coreSizeBytes = cpu.coreSizeBytes;
 	halted = false;
+	fault = false;
+	scratch = 0;
+	dispatch = dispatchTable();
+	execMode = cpu.execMode;
+	icache = new Decoded[coreSizeBytes / 2]();
+	codePages = new bool[(coreSizeBytes >> ICACHE_PAGE_BITS) + 1]();
+	jit = nullptr;
+	deadline = 0;
+	slice = 0;
+	ahead = 0;
+	stopped = false;
+	waiting = false;
+	clock = 0;
+	heat = new uint32_t[coreSizeBytes / 2]();
+	warmAt = cpu.warmAt;
+	hotAt = cpu.hotAt;
+	native = nullptr;
+	guard = nullptr;
+	codeWritten = false;
+	ports = nullptr;
+	latches = nullptr;
 }
 
 Processor::~Processor() {
-	delete core.byte;
+	delete jit; //First, since it may save translations of what's in core
+	delete native;
+	delete guard;
+	WriteGuard::free(core.byte, coreSizeBytes);
+	delete[] icache;
+	delete[] codePages;
+	delete[] heat;
+	delete[] ports;
+	delete[] latches;
 }
 
 void Processor::operator=(const Processor& cpu){ // NOLINT
+	if (this == &cpu)
+		return;
 	for (int i = 0; i < REGCOUNT; i++)
 		registers[i] = cpu.registers[i];
-	ps = cpu.ps;
-	core.byte = new PBYTE[cpu.coreSizeBytes];
+	ps = (PBYTE)cpu.pstat();
+	flagOp = FLAGS_NONE;
+	delete jit;
+	delete native;
+	delete guard;
+	WriteGuard::free(core.byte, coreSizeBytes);
+	delete[] icache;
+	delete[] codePages;
+	delete[] heat;
+	delete[] ports;
+	delete[] latches;
+	core.byte = WriteGuard::allocate(cpu.coreSizeBytes);
 	memcpy(core.byte, cpu.core.byte, (size_t)cpu.coreSizeBytes);
 	coreSizeBytes = cpu.coreSizeBytes;
 	halted = false;
+	fault = false;
+	scratch = 0;
+	dispatch = dispatchTable();
+	execMode = cpu.execMode;
+	icache = new Decoded[coreSizeBytes / 2]();
+	codePages = new bool[(coreSizeBytes >> ICACHE_PAGE_BITS) + 1]();
+	jit = nullptr;
+	deadline = 0;
+	slice = 0;
+	ahead = 0;
+	stopped = false;
+	waiting = false;
+	clock = 0;
+	heat = new uint32_t[coreSizeBytes / 2]();
+	warmAt = cpu.warmAt;
+	hotAt = cpu.hotAt;
+	native = nullptr;
+	guard = nullptr;
+	codeWritten = false;
+	ports = nullptr;
+	latches = nullptr;
+	requests.clear();
+	scheduled.clear();
 }
 
 /**
@@ -65,6 +176,7 @@ void Processor::reg(RegCode reg, PWORD val) {
  * @return Processor status word
  */
 PWORD Processor::pstat() const{
+	settleFlags();
 	return ps;
 }
 
@@ -79,13 +191,19 @@ bool Processor::pstat_carry() const {
  * Whether the operation caused an arithmetic overflow
  */
 bool Processor::pstat_overf() const {
-	return (bool)(ps & SV);
+	switch (flagOp) {
+		case FLAGS_VAL: return overflow(flagSrc, flagDst, flagRes);
+		case FLAGS_BIT: return false;
+		default: return (bool)(ps & SV);
+	}
 }
 
 /**
  * Whether the result of the last operation was zero
  */
 bool Processor::pstat_zero() const {
+	if (flagOp != FLAGS_NONE)
+		return flagRes == 0;
 	return (bool)(ps & SZ);
 }
 
@@ -93,6 +211,8 @@ bool Processor::pstat_zero() const {
  * Whether the result of the last operation was negative
  */
 bool Processor::pstat_neg() const {
+	if (flagOp != FLAGS_NONE)
+		return (bool)(flagRes & NEG_BIT);
 	return (bool)(ps & SN);
 }
 
@@ -116,6 +236,387 @@ void Processor::priority(PWORD prty) {
 		return;
 	prty <<= 5;
 	ps = (ps & (PWORD)~0xe0) | prty;
+	recheck();
+}
+
+/**
+ * Read a word from core. Addresses are rounded down to a word boundary, and anything past the end of core reads as
+ * zero.
+ * @param addr Byte address to read from
+ * @return Word at that address
+ */
+PWORD Processor::mem(PWORD addr) const {
+	if (addr >= coreSizeBytes)
+		return 0;
+	return core.word[addr >> 1];
+}
+
+/**
+ * Write a word to core. Addresses are rounded down to a word boundary, and writes past the end of core are dropped.
+ * @param addr Byte address to write to
+ * @param val Word to write
+ */
+void Processor::mem(PWORD addr, PWORD val) {
+	if (addr >= coreSizeBytes)
+		return;
+	core.word[addr >> 1] = val;
+	written(addr);
+}
+
+/**
+ * Size of core in bytes
+ */
+int Processor::coreSize() const {
+	return coreSizeBytes;
+}
+
+static PWORD unreadable(void*, PWORD) {
+	return 0;
+}
+
+static void unwritable(void*, PWORD, PWORD) {
+}
+
+/**
+ * Attach a device register to an address in the I/O page. Whenever an instruction resolves an operand there, even one
+ * it only writes to, read is asked for its value, and whenever an instruction stores there, write is given what it
+ * stored. Translated code keeps each site that reaches a register bound straight to its hooks, so that polling one
+ * doesn't cost a lookup every time round. Only call this from the thread that runs the processor.
+ * @param addr Address of the register
+ * @param device Passed to the hooks
+ * @param read Null for a register that reads as zero
+ * @param write Null for a register that ignores writes
+ * @return Whether a register can go at addr: it has to be even, in the I/O page and past the end of core
+ */
+bool Processor::attach(PWORD addr, void* device, PortRead read, PortWrite write) {
+	if ((addr & 1) || addr < IOPAGE || addr < coreSizeBytes)
+		return false;
+	if (ports == nullptr) {
+		ports = new Port[IOPAGE_WORDS]();
+		latches = new PWORD[IOPAGE_WORDS]();
+	}
+	ports[(addr - IOPAGE) >> 1] = Port{device, read ? read : unreadable, write ? write : unwritable};
+#ifdef PDP_JIT
+	if (jit)
+		jit->reconfigure();
+#endif
+	return true;
+}
+
+/**
+ * Take away the device register at addr, leaving the address to fault again
+ */
+void Processor::detach(PWORD addr) {
+	if (port(addr) == nullptr)
+		return;
+	ports[(addr - IOPAGE) >> 1] = Port();
+#ifdef PDP_JIT
+	if (jit)
+		jit->reconfigure();
+#endif
+}
+
+/**
+ * Device register at addr, or null if there isn't one
+ */
+const Port* Processor::port(PWORD addr) const {
+	if (ports == nullptr || (addr & 1) || addr < IOPAGE || addr < coreSizeBytes)
+		return nullptr;
+	const Port* p = &ports[(addr - IOPAGE) >> 1];
+	return p->read ? p : nullptr;
+}
+
+/**
+ * Whether the processor has been stopped by a HALT or WAIT. A processor stopped by a WAIT carries on by itself in
+ * run() once an interrupt it lets through comes in.
+ */
+bool Processor::isHalted() const {
+	return halted || waiting;
+}
+
+/**
+ * Let a halted processor continue from its current PC
+ */
+void Processor::resume() {
+	halted = false;
+	waiting = false;
+}
+
+/**
+ * Post an interrupt request, as a device on the bus would. It's taken between instructions as soon as the processor's
+ * priority is below its level, trapping through its vector; higher levels go first, and requests at the same level
+ * in the order they were posted. Only call this from the thread that runs the processor.
+ * @param vector Address of the interrupt vector
+ * @param level Bus request level, 1-7
+ */
+void Processor::interrupt(PWORD vector, PWORD level) {
+	if (level == 0 || level > 7)
+		return;
+	requests.push_back(Request{now(), vector, level});
+	recheck();
+}
+
+/**
+ * Post an interrupt request after the processor has run some more instructions, as a clock or other device that takes
+ * time to finish would. A processor waiting for it skips ahead to when it comes in. Called from a device hook while an
+ * engine is running, it counts from the instruction the hook was called for, and cuts the engine's slice short to
+ * come back to run() when it's due; translated and recompiled code runs on to the end of its block first, as it does
+ * for stop().
+ * @param delay Instructions from now
+ * @param vector Address of the interrupt vector
+ * @param level Bus request level, 1-7
+ */
+void Processor::schedule(uint64_t delay, PWORD vector, PWORD level) {
+	if (level == 0 || level > 7)
+		return;
+	Request request = {now() + delay, vector, level};
+	auto at = scheduled.begin();
+	while (at != scheduled.end() && at->due <= request.due)
+		++at;
+	scheduled.insert(at, request);
+	if (delay == 0)
+		stop();
+	else if (!stopped && deadline > 0 && delay < (uint64_t)(deadline + ahead)) {
+		//What's been taken off for the rest of a block can't be given back, so the block finishes late at worst
+		int64_t early = std::min(deadline + ahead - (int64_t)delay, deadline);
+		deadline -= early;
+		slice -= early;
+	}
+}
+
+/**
+ * Instructions run so far, counting those the running engine has got through in its slice
+ */
+uint64_t Processor::now() const {
+	int64_t left = (stopped ? deadline + DEADLINE_STOP : deadline) + ahead;
+	return clock + (uint64_t)(slice - left);
+}
+
+/**
+ * Make whatever engine is running come back to run() at its next check, which is after every instruction in the
+ * interpreters and at the start of every block in translated code
+ */
+void Processor::stop() {
+	if (stopped)
+		return;
+	stopped = true;
+	deadline -= DEADLINE_STOP;
+}
+
+/**
+ * Stop, if the status word now calls for run() to step in: an interrupt posted earlier is let through, or tracing is
+ * on. Call this whenever the priority or the trace bit may have changed.
+ */
+void Processor::recheck() {
+	if (ps & ST) {
+		stop();
+		return;
+	}
+	for (const Request& request : requests) {
+		if (request.level > priority()) {
+			stop();
+			return;
+		}
+	}
+}
+
+/**
+ * Post scheduled interrupts that have come due, and take the most urgent posted interrupt the processor's priority
+ * lets through, waking it from a WAIT
+ * @return Whether the processor can run
+ */
+bool Processor::service() {
+	while (!scheduled.empty() && scheduled.front().due <= clock) {
+		requests.push_back(scheduled.front());
+		scheduled.erase(scheduled.begin());
+	}
+	if (halted)
+		return false;
+	auto taken = requests.end();
+	for (auto at = requests.begin(); at != requests.end(); ++at)
+		if (at->level > priority() && (taken == requests.end() || at->level > taken->level))
+			taken = at;
+	if (taken != requests.end()) {
+		PWORD vector = taken->vector;
+		requests.erase(taken);
+		waiting = false;
+		trap(vector);
+	}
+	return !halted && !waiting;
+}
+
+/**
+ * Translate a bus address into a pointer into core. A device register is read into its latch, and a pointer to that
+ * returned instead; written() hands anything stored there on to the device. There's only the one latch per register,
+ * so an instruction with both operands on the same register has to copy its source value out before resolving its
+ * destination reads the register again, as the dispatch handlers and translated code both do. Odd addresses and any
+ * other addresses past the end of core raise a fault, in which case a pointer to a scratch word is returned so that the
+ * caller can carry on without special casing.
+ * @param addr Byte address
+ * @return Pointer to the word at addr
+ */
+PWORD* Processor::memory(PWORD addr) {
+	if ((addr & 1) || addr >= coreSizeBytes) {
+		const Port* p = port(addr);
+		if (p == nullptr) {
+			fault = true;
+			return &scratch;
+		}
+		PWORD* latch = &latches[(addr - IOPAGE) >> 1];
+		*latch = p->read(p->device, addr);
+		return latch;
+	}
+	return &core.word[addr >> 1];
+}
+
+/**
+ * Resolve an operand in the given addressing mode, applying any side effects (autoincrement, index words, etc.)
+ * @param mode AdrMode
+ * @param reg Register the mode applies to
+ * @param word Predecoded index word, for the pseudo modes
+ * @return Pointer to the operand
+ */
+PWORD* Processor::operand(PBYTE mode, PBYTE reg, PWORD word) {
+	if (mode == MODE_REG)
+		return &registers[reg];
+	if (mode == MODE_IMM) {
+		registers[PC] += 2;
+		scratch = word;
+		return &scratch;
+	}
+	return memory(effective(mode, reg, word));
+}
+
+/**
+ * Compute the effective address of an operand in one of the memory addressing modes. Register mode has no address,
+ * so asking for one raises a fault.
+ * @param mode AdrMode other than MODE_REG
+ * @param reg Register the mode applies to
+ * @param word Predecoded index word, for the pseudo modes
+ * @return Effective address
+ */
+PWORD Processor::effective(PBYTE mode, PBYTE reg, PWORD word) {
+	PWORD addr;
+	switch (mode) {
+		case 1:
+			return registers[reg];
+		case 2:
+			addr = registers[reg];
+			registers[reg] += 2;
+			return addr;
+		case 3:
+			addr = *memory(registers[reg]);
+			registers[reg] += 2;
+			return addr;
+		case 4:
+			registers[reg] -= 2;
+			return registers[reg];
+		case 5:
+			registers[reg] -= 2;
+			return *memory(registers[reg]);
+		case 6:
+			addr = *memory(registers[PC]);
+			registers[PC] += 2;
+			return registers[reg] + addr;
+		case 7:
+			addr = *memory(registers[PC]);
+			registers[PC] += 2;
+			return *memory(registers[reg] + addr);
+		case MODE_ABS:
+		case MODE_REL:
+			registers[PC] += 2;
+			return word;
+		case MODE_RELDEF:
+			registers[PC] += 2;
+			return *memory(word);
+		case MODE_IDX:
+			registers[PC] += 2;
+			return registers[reg] + word;
+		case MODE_IDXDEF:
+			registers[PC] += 2;
+			return *memory(registers[reg] + word);
+		default:
+			fault = true;
+			return 0;
+	}
+}
+
+/**
+ * Note a write to core, throwing away any predecoded instructions that might have been built from it, or a write to a
+ * device register's latch, passing it on
+ * @param addr Byte address written to
+ */
+void Processor::written(PWORD addr) {
+	if (addr < coreSizeBytes) {
+		if (codeWritten)
+			guard->settle();
+		if (codePages[addr >> ICACHE_PAGE_BITS])
+			invalidate(addr);
+	}
+	else if (const Port* p = port(addr))
+		p->write(p->device, addr, latches[(addr - IOPAGE) >> 1]);
+}
+
+/**
+ * Note a write through an operand pointer, which may or may not point into core or at a device register
+ * @param dst Operand written to
+ */
+void Processor::written(const PWORD* dst) {
+	uintptr_t offset = (uintptr_t)dst - (uintptr_t)core.word;
+	if (offset < (uintptr_t)coreSizeBytes)
+		written((PWORD)offset);
+	else if (latches && (uintptr_t)(dst - latches) < IOPAGE_WORDS)
+		written((PWORD)(IOPAGE + 2 * (dst - latches)));
+}
+
+/**
+ * Note that a page of core has had code found in it, so that writes to it are watched for
+ * @param page Page number, as in codePages
+ */
+void Processor::newCodePage(int page) {
+	codePages[page] = true;
+	if (guard)
+		guard->protect(page);
+}
+
+/**
+ * Throw away the predecoded instructions in the page containing addr. Instructions are up to three words long, so the
+ * last two entries of the previous page may have been built from words in this one and go too. Blocks there start
+ * out cold again, so that code that keeps rewriting itself doesn't keep getting translated.
+ * @param addr Byte address written to
+ */
+void Processor::invalidate(PWORD addr) {
+	int page = addr >> ICACHE_PAGE_BITS;
+	int first = page * ICACHE_PAGE_WORDS - 2;
+	for (int i = first < 0 ? 0 : first; i < (page + 1) * ICACHE_PAGE_WORDS; i++) {
+		icache[i].handler = nullptr;
+		heat[i] = 0;
+	}
+	codePages[page] = false;
+	if (native)
+		native->invalidate(addr);
+#ifdef PDP_JIT
+	if (jit)
+		jit->invalidate(addr);
+#endif
+}
+
+/**
+ * Push a word onto the stack
+ */
+void Processor::push(PWORD val) {
+	registers[SP] -= 2;
+	*memory(registers[SP]) = val;
+	written(registers[SP]);
+}
+
+/**
+ * Pop a word off of the stack
+ */
+PWORD Processor::pop() {
+	PWORD val = *memory(registers[SP]);
+	registers[SP] += 2;
+	return val;
 }
 
 //
@@ -129,14 +630,15 @@ void Processor::priority(PWORD prty) {
  */
 void Processor::halt() {
 	halted = true;
+	stop();
 }
 
 /**
  * Halt the CPU until restarted or interrupted
  */
 void Processor::wait() {
-	//TODO Allow processor to be restarted by interrupt
-	halted = true;
+	waiting = true;
+	stop();
 }
 
 /**
@@ -157,9 +659,7 @@ void Processor::nop() {
  */
 void Processor::clr(PWORD *o1) {
 	*o1 = 0;
-	sez();
-	cln();
-	clv();
+	bitFlags(0, 0, 0);
 	clc();
 }
 
@@ -205,9 +705,7 @@ void Processor::sbc(PWORD *o1) {
  * Set condition codes by value.
  */
 void Processor::tst(const PWORD *o1) {
-	*o1 & NEG_BIT	? sen() : cln();
-	*o1 == 0		? sez() : clz();
-	clv();
+	bitFlags(*o1, 0, *o1);
 	clc();
 }
 
@@ -235,83 +733,51 @@ void Processor::com(PWORD *o1) {
 /**
  * Rotate value right. NZ set by result, C set (???), V=N^C
  */
-void Processor::ror(const PWORD *o1) {
-	uint64_t flags;
-	asm("rorw $1, (%0)\n\t"
-		"pushf\n\t"
-		"popq %1"
-		: "=r" (o1), "=r" (flags)
-		: "r" (o1)
-		);
-	x86Flags(flags);
-	sec(); //What?
-	pstat_neg() ^ pstat_carry() ? sev() : clv();
+void Processor::ror(PWORD *o1) {
+	PWORD old = *o1;
+	*o1 = (PWORD)(old >> 1 | old << 15);
+	shiftFlags(*o1, 1); //What?
+	X86_VERIFY("rorw", old, *o1, 0);
 }
 
 /**
  * Rotate value left. NZ set by result, C set (???), V=N^C
  */
-void Processor::rol(const PWORD *o1) {
-	uint64_t flags;
-	asm("rolw $1, (%0)\n\t"
-		"pushf\n\t"
-		"popq %1"
-		: "=r" (o1), "=r" (flags)
-		: "r" (o1)
-		);
-	x86Flags(flags);
-	sec(); //What?
-	pstat_neg() ^ pstat_carry() ? sev() : clv(); //The specs say that V=N^C. I happen to disagree, and so does x86. But, whatver.
+void Processor::rol(PWORD *o1) {
+	PWORD old = *o1;
+	*o1 = (PWORD)(old << 1 | old >> 15);
+	shiftFlags(*o1, 1); //The specs say that V=N^C. I happen to disagree, and so does x86. But, whatver.
+	X86_VERIFY("rolw", old, *o1, 0);
 }
 
 /**
  * Arithmetic right shift. NZ set by result, C set by old low bit, V=N^C
  */
-void Processor::asr(const PWORD *o1) {
-	//<<= doesn't work and I'm too lazy to figure out why
-	uint64_t flags;
-	asm("sarw $1, (%0)\n\t"
-		"pushf\n\t"
-		"popq %1"
-		: "=r" (o1), "=r" (flags)
-		: "r" (o1)
-		);
-	x86Flags(flags);
-	pstat_neg() ^ pstat_carry() ? sev() : clv();
+void Processor::asr(PWORD *o1) {
+	PWORD old = *o1;
+	*o1 = (PWORD)(old >> 1 | (old & NEG_BIT));
+	shiftFlags(*o1, (PBYTE)(old & 1));
+	X86_VERIFY("sarw", old, *o1, SN | SZ | SC);
 }
 
 /**
  * Left shift. NZ set by result, C set by old high bit, V=N^C
  */
-void Processor::asl(const PWORD *o1) {
-	uint64_t flags;
-	asm("salw $1, (%0)\n\t"
-		"pushf\n\t"
-		"popq %1"
-		: "=r" (o1), "=r" (flags)
-		: "r" (o1)
-		);
-	x86Flags(flags);
-	pstat_neg() ^ pstat_carry() ? sev() : clv();
+void Processor::asl(PWORD *o1) {
+	PWORD old = *o1;
+	*o1 = (PWORD)(old << 1);
+	shiftFlags(*o1, (PBYTE)(old >> 15));
+	X86_VERIFY("salw", old, *o1, SN | SZ | SC);
 }
 
 /**
  * Swap bytes in a word. CV reset, NZ set by low byte of result.
  */
-void Processor::swab(const PWORD *o1) {
+void Processor::swab(PWORD *o1) {
 	//TODO spec unclear, claims "CV reset, NV set by low byte". Corrected to NZ?
-	asm("movw (%0), %%ax\n\t"
-		"xchgb %%ah, %%al\n\t"
-		"movw %%ax, (%0)\n\t"
-		: "=r" (o1)
-		: "r" (o1)
-		: "%ax"
-		);
-
+	*o1 = (PWORD)(*o1 << 8 | *o1 >> 8);
+	bitFlags(*o1, 0, (PWORD)(*o1 << 8)); //Low byte moved to where the flag logic looks
 	clc();
-	clv();
-	(*o1 & (PWORD)0x00FF) == 0 ? sez() : clz();
-	*o1 & NEG_BIT>>8 ? sen() : cln();
 }
 
 /**
@@ -328,9 +794,7 @@ void Processor::sxt(PWORD *o1) {
  */
 void Processor::mul(const RegCode reg, const PWORD *o2) {
 	registers[reg] *= *o2;
-	registers[reg] == 0			? sez() : clz();
-	registers[reg] & NEG_BIT 	? sen() : cln();
-	clv();
+	bitFlags(registers[reg], *o2, registers[reg]);
 }
 
 /**
@@ -393,9 +857,8 @@ void Processor::xor_(const RegCode reg, const PWORD *o2) {
  * @param o2 dst
  */
 void Processor::mov(const PWORD *o1, PWORD *o2) {
-	valFlags(*o1, *o2, *o1);
+	bitFlags(*o1, *o2, *o1);
 	*o2 = *o1;
-	clv();
 }
 
 /**
@@ -637,9 +1100,7 @@ void Processor::sob(const RegCode reg, const PWORD *ost) {
  */
 void Processor::jsr(const RegCode reg, const PWORD *ost) {
 	//Push contents of reg to stack
-	registers[SP] -= 2;
-	core.byte[registers[SP]] = LOWER_W(registers[reg]);
-	core.byte[registers[SP] + 1] = UPPER_W(registers[reg]);
+	push(registers[reg]);
 	//Copy PC register to reg
 	registers[reg] = registers[PC];
 	//Transfer control
@@ -650,32 +1111,36 @@ void Processor::jsr(const RegCode reg, const PWORD *ost) {
  * Return from subroutine; copies contents of reg into pc and pops top of stack into reg
  */
 void Processor::rts(const RegCode reg) {
-	registers[PC] = reg;
-	registers[reg] = COMPOSE(core.byte[registers[SP] + 1], core.byte[registers[SP]]);
-	registers[SP] += 2;
+	registers[PC] = registers[reg];
+	registers[reg] = pop();
 }
 
 /**
- * Return from interrupt (or trap)
+ * Return from interrupt (or trap); pops PC, then the status word
  */
 void Processor::rti() {
-	registers[PC] = core.word[SP/2]; //TODO: check if this works... might be awkward if it doesn't, and it probably doesn't.
-	registers[SP] += 2;
-	ps = core.byte[SP];
-	registers[SP] += 2;
+	registers[PC] = pop();
+	ps = (PBYTE)pop();
+	flagOp = FLAGS_NONE;
+	recheck();
 }
 
 /**
- * Trap
- * @param n From
+ * Trap; pushes the status word and PC, then loads both from the vector. A fault while doing so (e.g. the stack
+ * pointer is off in the weeds) is a double fault and halts the processor.
+ * @param n Address of the trap vector
  */
 void Processor::trap(const PWORD n) {
-	registers[PC] -= 2;
-	registers[PC] = ps;
-	registers[PC] -= 2;
-	registers[SP] = registers[PC];
-	registers[PC] = n; //TODO: Check, this trap routine can't possibly be right
-	registers[PC] = n + (PWORD)2;
+	fault = false;
+	push(pstat());
+	push(registers[PC]);
+	registers[PC] = *memory(n);
+	ps = (PBYTE)*memory(n + (PWORD)2);
+	flagOp = FLAGS_NONE;
+	if (fault)
+		halt();
+	fault = false;
+	recheck();
 }
 
 /**
@@ -714,7 +1179,8 @@ void Processor::rtt() {
  * @param lvl Level to set
  */
 void Processor::spl(const PBYTE* lvl) {
-	ps = (*lvl << 4) | (ps * (PBYTE)0b11111);
+	ps = (PBYTE)((*lvl & 07) << 5) | (ps & (PBYTE)0b11111);
+	recheck();
 }
 
 /**
@@ -728,6 +1194,7 @@ void Processor::clc() {
  * Clear the overflow flag
  */
 void Processor::clv() {
+	settleFlags();
 	ps &= ~SV;
 }
 
@@ -735,6 +1202,7 @@ void Processor::clv() {
  * Clear the zero flag
  */
 void Processor::clz() {
+	settleFlags();
 	ps &= ~SZ;
 }
 
@@ -742,6 +1210,7 @@ void Processor::clz() {
  * Clear the negative flag
  */
 void Processor::cln() {
+	settleFlags();
 	ps &= ~SN;
 }
 
@@ -756,6 +1225,7 @@ void Processor::sec() {
  * Set the overflow flag
  */
 void Processor::sev() {
+	settleFlags();
 	ps |= SV;
 }
 
@@ -763,6 +1233,7 @@ void Processor::sev() {
  * Set the zero flag
  */
 void Processor::sez() {
+	settleFlags();
 	ps |= SZ;
 }
 
@@ -770,6 +1241,7 @@ void Processor::sez() {
  * Set the negative flag
  */
 void Processor::sen() {
+	settleFlags();
 	ps |= SN;
 }
 
@@ -777,6 +1249,7 @@ void Processor::sen() {
  * Clear all condition codes
  */
 void Processor::ccc() {
+	flagOp = FLAGS_NONE;
 	ps = (ps & (PWORD)~(SZ | SV | SC | SN));
 }
 
@@ -784,7 +1257,8 @@ void Processor::ccc() {
  * Set all condition codes
  */
 void Processor::scc() {
-	ps |= (SZ & SV & SC & SN);
+	flagOp = FLAGS_NONE;
+	ps |= (SZ | SV | SC | SN);
 }
 
 /**
@@ -794,7 +1268,7 @@ void Processor::scc() {
  * @param res Result of operation using given operands
  * @return True if overflow, false otherwise
  */
-bool Processor::overflow(PWORD o1, PWORD o2, PWORD res) {
+bool Processor::overflow(PWORD o1, PWORD o2, PWORD res) const {
 	if (!(NEG_BIT & o1) && !(NEG_BIT & o2) && (NEG_BIT & res))
 		return true;
 	else if ((NEG_BIT & o1) && (NEG_BIT & o2) && !(NEG_BIT & res))
@@ -803,36 +1277,69 @@ bool Processor::overflow(PWORD o1, PWORD o2, PWORD res) {
 }
 
 /**
- * Use value scheme to set status word flags
+ * Use value scheme to set status word flags. N, Z and V aren't worked out until something asks for them, since the
+ * next instruction usually sets them again first.
  * @param o1 First argument
  * @param o2 Second argument
  * @param res Result of operation
  */
 void Processor::valFlags(PWORD o1, PWORD o2, PWORD res) {
-	res & NEG_BIT			? sen() : cln();
-	res == 0				? sez() : clz();
-	overflow(o1, o2, res)	? sev() : clv();
+	flagOp = FLAGS_VAL;
+	flagSrc = o1;
+	flagDst = o2;
+	flagRes = res;
 }
 
 /**
- * Use bit scheme to set status word flags
+ * Use bit scheme to set status word flags. Like valFlags, N and Z are left for later; V is always reset.
  * @param o1 First argument
  * @param o2 Second argument
  * @param res Result of operation
  */
 void Processor::bitFlags(PWORD o1, PWORD o2, PWORD res) {
-	res & NEG_BIT	? sen() : cln();
-	res == 0		? sez() : clz();
-	clv();
+	flagOp = FLAGS_BIT;
+	flagSrc = o1;
+	flagDst = o2;
+	flagRes = res;
+}
+
+/**
+ * Work out N, Z and V from the last operation that set them, and fold them into the status word
+ */
+void Processor::settleFlags() const {
+	if (flagOp == FLAGS_NONE)
+		return;
+	PBYTE nzv = 0;
+	if (flagRes & NEG_BIT)
+		nzv |= SN;
+	if (flagRes == 0)
+		nzv |= SZ;
+	if (flagOp == FLAGS_VAL && overflow(flagSrc, flagDst, flagRes))
+		nzv |= SV;
+	ps = (PBYTE)((ps & ~(SN | SZ | SV)) | nzv);
+	flagOp = FLAGS_NONE;
+}
+
+/**
+ * Set all four condition codes after a shift or rotate: NZ by result, C as given, V=N^C. Replaces any pending lazy
+ * flags.
+ * @param res Result of operation
+ * @param carry New C, 0 or 1
+ */
+void Processor::shiftFlags(PWORD res, PBYTE carry) {
+	PBYTE n = (PBYTE)(res >> 15);
+	PBYTE z = (PBYTE)(res == 0);
+	ps = (PBYTE)((ps & ~(SN | SZ | SV | SC)) | n << 3 | z << 2 | (n ^ carry) << 1 | carry);
+	flagOp = FLAGS_NONE;
 }
 
+#ifdef PDP_VERIFY_FLAGS
 /**
  * Convert an x86 processor's status word into a PDP 11's status word.
  * @param flags x86 processor status word
  */
-void Processor::x86Flags(uint64_t flags) {
-	flags & SC_86	?	sec() : clc();
-	flags & SV_86	?	sev() : clv();
-	flags & SZ_86	?	sez() : clz();
-	flags & SN_86	?	sen() : cln();
+PBYTE Processor::x86Flags(uint64_t flags) {
+	return (PBYTE)((flags & SC_86 ? SC : 0) | (flags & SV_86 ? SV : 0) | (flags & SZ_86 ? SZ : 0) |
+				   (flags & SN_86 ? SN : 0));
 }
+#endif
@@ -1,4 +1,5 @@
 #pragma once
+#include <vector>
 #include "defs.h"
 
 #define 	REGCOUNT	8
@@ -8,7 +9,42 @@
 #define		SN			(PWORD)(1<<3)
 #define		ST			(PWORD)(1<<4)
 
-//Flags for the status word of an x86 processor, since inline asm is used in some places
+//Trap vectors
+#define		VEC_BUSERR	(PWORD)004
+#define		VEC_RESVD	(PWORD)010
+#define		VEC_BPT		(PWORD)014
+#define		VEC_IOT		(PWORD)020
+#define		VEC_EMT		(PWORD)030
+#define		VEC_TRAP	(PWORD)034
+
+#define		DISPATCH_SIZE	(1<<16)
+
+//Device registers live in the I/O page, the top 8KB of the address space, where core doesn't reach
+#define		IOPAGE			(PWORD)0160000
+#define		IOPAGE_WORDS	4096
+
+//Predecoded instruction cache; writes invalidate whole pages of cached instructions
+#define		ICACHE_PAGE_BITS	8
+#define		ICACHE_PAGE_WORDS	(1 << (ICACHE_PAGE_BITS - 1))
+
+//Default number of times a block has to be entered before the tiered engine predecodes it, and before it translates it
+#define		TIER_WARM			2
+#define		TIER_HOT			50
+
+//Files Processor::profilerSymbols() names translated code in for host profilers
+#define		SYMBOLS_PERF_MAP	1	//!< perf-<pid>.map
+#define		SYMBOLS_JITDUMP		2	//!< jit-<pid>.dump
+
+//Instructions run() hands an engine at most at a time, and what stop() takes off the deadline to end its slice early;
+//a stopped deadline is well below zero however far into its slice the engine was
+#define		DEADLINE_SLICE		((int64_t)1 << 40)
+#define		DEADLINE_STOP		((int64_t)1 << 50)
+
+//Which operands an instruction has, and so which may be followed by an index or immediate word
+#define		OPND_SRC	(PBYTE)1
+#define		OPND_DST	(PBYTE)2
+
+//Flags for the status word of an x86 processor, for checking shift and rotate flags against the host (PDP_VERIFY_FLAGS)
 #define		SC_86		1
 #define		SV_86		(1<<11)
 #define		SZ_86		(1<<6)
@@ -17,7 +53,90 @@
 
 //r7 reserved for use as program counter, r6 reserved for stack pointer
 enum RegCode {R0 = 0, R1, R2, R3, R4, R5, R6, R7, SP = R6, PC = R7};
-enum AdrMode {};
+
+/**
+ * Addressing modes. The first eight are the real ones; the rest are pseudo modes that predecoded instructions use for
+ * operands whose index or immediate word has already been read, and for PC-relative operands, resolved.
+ */
+enum AdrMode {
+	MODE_REG = 0,	//!< Rn
+	MODE_DEF,		//!< (Rn)
+	MODE_AINC,		//!< (Rn)+
+	MODE_AINCDEF,	//!< @(Rn)+
+	MODE_ADEC,		//!< -(Rn)
+	MODE_ADECDEF,	//!< @-(Rn)
+	MODE_INDEX,		//!< X(Rn)
+	MODE_INDEXDEF,	//!< @X(Rn)
+	MODE_IMM,		//!< #n, mode 27 source; the value is in the predecoded word
+	MODE_ABS,		//!< @#a, mode 37; the address is in the predecoded word
+	MODE_REL,		//!< a, mode 67; the resolved address is in the predecoded word
+	MODE_RELDEF,	//!< @a, mode 77; the resolved pointer address is in the predecoded word
+	MODE_IDX,		//!< X(Rn), mode 6; the index is in the predecoded word
+	MODE_IDXDEF,	//!< @X(Rn), mode 7; the index is in the predecoded word
+	MODE_COUNT
+};
+
+//What the pending condition codes should be worked out from
+enum FlagOp : PBYTE {FLAGS_NONE, FLAGS_VAL, FLAGS_BIT};
+
+//How run() dispatches instructions: a call through the dispatch table, direct threaded code, a switch, translation
+//to host code, or each of those in turn as code gets hotter
+enum ExecMode {EXEC_CALL, EXEC_THREADED, EXEC_SWITCH, EXEC_JIT, EXEC_TIERED};
+
+class Processor;
+class Jit;
+class Native;
+class WriteGuard;
+struct Decoded;
+typedef void (*Handler)(Processor& cpu, const Decoded& d);
+
+//Device register hooks, given the device the register was attached for and its address
+typedef PWORD (*PortRead)(void* device, PWORD addr);
+typedef void (*PortWrite)(void* device, PWORD addr, PWORD val);
+
+/**
+ * A device register in the I/O page
+ */
+struct Port {
+	void* device;
+	PortRead read;		//!< Null if nothing is attached
+	PortWrite write;
+};
+
+/**
+ * Everything that can be learned about an instruction from its word alone. The dispatch table holds one of these for
+ * every possible instruction word, so decoding is a single indexed load.
+ */
+struct Decoded {
+	Handler handler;	//!< Specialized handler for this instruction
+	PBYTE op;			//!< Handler number, for the threaded and switch interpreters
+	PBYTE srcMode;		//!< Source addressing mode (or unused)
+	PBYTE srcReg;		//!< Source register, or the register field of JSR, SOB and one-and-a-half operand instructions
+	PBYTE dstMode;		//!< Destination addressing mode
+	PBYTE dstReg;		//!< Destination register
+	SPWORD offset;		//!< Sign-extended branch offset in words, SOB offset, SPL level or condition code mask
+	PBYTE operands;		//!< OPND_* flags
+	PWORD srcWord;		//!< Immediate value, index or resolved address of the source (predecoded entries only)
+	PWORD dstWord;		//!< Index or resolved address of the destination (predecoded entries only)
+	PBYTE pair;			//!< Handler number of the branch fused onto a superinstruction, or the register of a fused SOB
+};
+
+/**
+ * How the translator's code buffer is doing
+ */
+struct JitStats {
+	uint64_t lookups;		//!< Blocks asked for
+	uint64_t hits;			//!< Blocks asked for that were translated already
+	uint64_t translations;	//!< Blocks translated, or read back from the disk cache
+	uint64_t evictions;		//!< Blocks evicted to make room for others
+	uint64_t flushes;		//!< Times the whole buffer was thrown away
+	uint64_t capacity;		//!< Bytes translations may take up
+	uint64_t live;			//!< Bytes taken up by translations in use
+	uint64_t dead;			//!< Bytes still taken up by translations of code that has since been written over
+	uint64_t free;			//!< Bytes not taken up at all
+	uint64_t largestFree;	//!< Longest stretch of free bytes; the further it falls short of free, the more fragmented
+	uint64_t diverted;		//!< Device register accesses past the end of a fenced core sent on by the SIGSEGV handler
+};
 
 class Processor {
 public:
@@ -38,6 +157,33 @@ public:
 	PWORD priority() const;
 	void priority(PWORD prty);
 
+	//Memory access
+	PWORD mem(PWORD addr) const;
+	void mem(PWORD addr, PWORD val);
+	int coreSize() const;
+	bool attach(PWORD addr, void* device, PortRead read, PortWrite write);
+	void detach(PWORD addr);
+
+	//Execution engine
+	bool step();
+	uint64_t run(uint64_t budget);
+	bool isHalted() const;
+	void resume();
+	void interrupt(PWORD vector, PWORD level);
+	void schedule(uint64_t delay, PWORD vector, PWORD level);
+	ExecMode mode() const;
+	void mode(ExecMode mode);
+	void tiers(uint32_t warm, uint32_t hot);
+	void translationCache(const char* dir, uint64_t cap);
+	void translationLimit(uint64_t bytes);
+	JitStats translationStats() const;
+	bool profilerSymbols(int formats, const char* dir);
+	bool translationDump(const char* path);
+	int loadNative(const char* path);
+	uint64_t nativeRuns() const;
+	bool writeGuard() const;
+	bool writeGuard(bool on);
+
 	/**************
 	 * INSTRUCTIONS
 	 **************/
@@ -51,6 +197,7 @@ public:
 	/*
 	 * Note that from here on out, everything here will expect *pointers* to memory locations to be provided. Therefore,
 	 * addressing modes need to be handled by the *calling* entity. This is done to avoid excessive code duplication.
+	 * step() and run() do this with handlers specialized on each addressing mode; see Dispatch.cpp.
 	 */
 
 	//One-operand instructions
@@ -62,11 +209,11 @@ public:
 	void tst(const PWORD* o1);
 	void neg(PWORD* o1);
 	void com(PWORD* o1);
-	void ror(const PWORD* o1);
-	void rol(const PWORD* o1);
-	void asr(const PWORD* o1);
-	void asl(const PWORD* o1);
-	void swab(const PWORD* o1);
+	void ror(PWORD* o1);
+	void rol(PWORD* o1);
+	void asr(PWORD* o1);
+	void asl(PWORD* o1);
+	void swab(PWORD* o1);
 	void sxt(PWORD* o1);
 
 	//One-and-a-half-operand instructions
@@ -130,15 +277,92 @@ public:
 	void scc();
 
 private:
+	friend class Dispatcher;
+	friend class Jit;
+	friend class Native;
+	friend class Recompiler;
+	friend class WriteGuard;
+
+	static const Decoded* dispatchTable();
+	PWORD* memory(PWORD addr);
+	PWORD* operand(PBYTE mode, PBYTE reg, PWORD word);
+	PWORD effective(PBYTE mode, PBYTE reg, PWORD word);
+	void push(PWORD val);
+	PWORD pop();
+	const Decoded& predecode(PWORD pc);
+	const Decoded* fetch();
+	const Decoded* decode();
+	void runCall();
+	void runSwitch();
+	void runThreaded();
+	void runJit();
+	void runTiered();
+	void runNative();
+	void runBlock(bool predecoded);
+	bool runTranslated(bool background);
+	uint64_t stepFused(uint64_t room);
+	bool service();
+	void stop();
+	uint64_t now() const;
+	void recheck();
+	void written(PWORD addr);
+	void written(const PWORD* dst);
+	const Port* port(PWORD addr) const;
+	void invalidate(PWORD addr);
+	inline void holdsCode(int page) { if (!codePages[page]) newCodePage(page); }
+	void newCodePage(int page);
+
 	inline void branch(PWORD offset) { registers[PC] += 2* offset;} //<! Laziness.
-	inline bool overflow(PWORD o1, PWORD o2, PWORD res);
+	inline bool overflow(PWORD o1, PWORD o2, PWORD res) const;
 	inline void valFlags(PWORD o1, PWORD o2, PWORD res);
 	inline void bitFlags(PWORD o1, PWORD o2, PWORD res);
-	inline void x86Flags(uint64_t flags);
+	inline void shiftFlags(PWORD res, PBYTE carry);
+#ifdef PDP_VERIFY_FLAGS
+	static PBYTE x86Flags(uint64_t flags);
+#endif
+	void settleFlags() const;
 
 	PWORD registers[REGCOUNT];
-	PBYTE ps;
+	mutable PBYTE ps;
+
+	//Lazily evaluated N, Z and V; C is always kept up to date in ps
+	mutable PBYTE flagOp;	//!< FlagOp that set the pending codes, or FLAGS_NONE if ps is up to date
+	PWORD flagSrc;
+	PWORD flagDst;
+	PWORD flagRes;
+
 	bool halted;
+	bool fault;			//!< Set when an operand or fetch ran off the end of core or hit an odd address
+	PWORD scratch;		//!< Stand-in target for operands that faulted
+	const Decoded* dispatch;
+	ExecMode execMode;
+	Decoded* icache;	//!< Predecoded instruction per word of core; empty entries have no handler
+	Decoded fresh;		//!< Instruction decode() last decoded, when it had index or immediate words
+	bool* codePages;	//!< Pages of core that have predecoded instructions in them
+	Jit* jit;			//!< Translator, made the first time run() is asked to translate
+	int64_t deadline;	//!< Instructions the running engine may still run before it has to come back to run()
+	int64_t slice;		//!< What run() set deadline to, less what schedule() took off since; 0 between slices
+	int64_t ahead;		//!< Taken off deadline for a block that's running but hasn't got that far yet
+	bool stopped;		//!< Whether DEADLINE_STOP has been taken off deadline since run() last set it
+	bool waiting;		//!< Stopped by WAIT, until an interrupt comes in
+	uint64_t clock;		//!< Instructions run so far, that scheduled interrupts are timed by
+
+	//Interrupt requested by a device, on the bus until the processor's priority drops below its level
+	struct Request {
+		uint64_t due;	//!< Value of clock at which it's posted, for scheduled requests
+		PWORD vector;
+		PWORD level;
+	};
+	std::vector<Request> requests;	//!< Posted, oldest first
+	std::vector<Request> scheduled;	//!< To be posted, soonest first
+	Port* ports;		//!< Device register at each word of the I/O page, made by the first attach()
+	PWORD* latches;		//!< What operands in the I/O page point to: each register as last read, then as written
+	uint32_t* heat;		//!< Times the tiered engine has entered a block at each word of core, up to hotAt
+	uint32_t warmAt;	//!< Entries before a block is run predecoded rather than decoded afresh every time
+	uint32_t hotAt;		//!< Entries before a block is translated
+	Native* native;		//!< Code recompiled ahead of time, if any has been loaded
+	WriteGuard* guard;	//!< Write protection on pages of core with code in them, if it's turned on
+	volatile bool codeWritten;	//!< Set when a write hits a protected page, until WriteGuard::settle() sees to it
 	union {
 		PBYTE* byte;
 		PWORD* word;
@@ -0,0 +1,274 @@
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include "Native.h"
+#include "Recompiler.h"
+
+#ifdef PDP_NATIVE
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/**
+ * printf() into a string
+ */
+static std::string format(const char* fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	return buf;
+}
+
+/**
+ * @param cpu Processor with the program to recompile loaded into its core
+ */
+Recompiler::Recompiler(Processor& cpu) : cpu(cpu) {
+}
+
+/**
+ * Find every block reachable from an entry point through branches, SOBs, and jumps, calls and traps to fixed
+ * addresses. Returns from calls and traps are assumed to come back to the instruction after them; a halt is assumed
+ * to be the end of the program.
+ * @param entry Address to start from
+ */
+void Recompiler::discover(PWORD entry) {
+	std::vector<PWORD> work = {entry};
+	while (!work.empty()) {
+		PWORD pc = work.back();
+		work.pop_back();
+		if ((pc & 1) || pc >= cpu.coreSizeBytes || blocks.count(pc))
+			continue;
+		std::vector<Inst> insts = scan(pc);
+		if (insts.empty())
+			continue;
+		successors(insts, work);
+		blocks[pc] = insts;
+	}
+}
+
+/**
+ * Number of blocks found so far
+ */
+size_t Recompiler::size() const {
+	return blocks.size();
+}
+
+/**
+ * Collect the instructions of the block starting at pc: up to and including the first control transfer, stopping
+ * early at the block size limit or the end of core
+ */
+std::vector<Recompiler::Inst> Recompiler::scan(PWORD pc) {
+	std::vector<Inst> insts;
+	while (insts.size() < NATIVE_BLOCK_LIMIT && !(pc & 1) && pc < cpu.coreSizeBytes) {
+		const Decoded& d = cpu.predecode(pc);
+		Inst inst = {pc, (PWORD)(pc + 2), d, plainOp(d.op)};
+		if ((d.operands & OPND_SRC) && extraWord(d.srcMode, d.srcReg))
+			inst.next += 2;
+		if ((d.operands & OPND_DST) && extraWord(d.dstMode, d.dstReg))
+			inst.next += 2;
+		if (inst.next > cpu.coreSizeBytes)
+			break;
+		insts.push_back(inst);
+		pc = inst.next;
+		if (endsBlock(inst.op))
+			break;
+	}
+	return insts;
+}
+
+/**
+ * Where control can go after a block
+ * @param targets Receives the addresses
+ */
+void Recompiler::successors(const std::vector<Inst>& insts, std::vector<PWORD>& targets) const {
+	const Inst& last = insts.back();
+	const Decoded& d = last.d;
+	PWORD vector = 0;
+	switch (last.op) {
+		case OP_br:
+			targets.push_back((PWORD)(last.next + 2 * d.offset));
+			return;
+		case OP_sob:
+			targets.push_back((PWORD)(last.next - 2 * d.offset));
+			targets.push_back(last.next);
+			return;
+		case OP_jmp:
+		case OP_jsr:
+			if (d.dstMode == MODE_ABS || d.dstMode == MODE_REL)
+				targets.push_back(d.dstWord);
+			if (last.op == OP_jsr)
+				targets.push_back(last.next);
+			return;
+		case OP_halt:
+		case OP_rts:
+		case OP_rti:
+		case OP_rtt:
+		case OP_reserved:
+		case OP_buserr:
+			return;
+		case OP_bpt: vector = VEC_BPT; break;
+		case OP_iot: vector = VEC_IOT; break;
+		case OP_emt: vector = VEC_EMT; break;
+		case OP_trap: vector = VEC_TRAP; break;
+		default:
+			if (last.op >= OP_bne && last.op <= OP_bcs)
+				targets.push_back((PWORD)(last.next + 2 * d.offset));
+			break;
+	}
+	if (vector)
+		targets.push_back(cpu.mem(vector));
+	targets.push_back(last.next);
+}
+
+/**
+ * Whether an instruction is recompiled into a direct call to its Processor method: anything working only on registers
+ * other than SP and PC, immediates, and branches. Everything else goes through the interpreter.
+ */
+bool Recompiler::inlined(const Inst& inst) {
+	const Decoded& d = inst.d;
+	auto reg = [](PBYTE mode, PBYTE r) { return mode == MODE_REG && r < SP; };
+	switch (inst.op) {
+		case OP_mov: case OP_cmp: case OP_bit: case OP_bic: case OP_bis: case OP_add: case OP_sub:
+			return (reg(d.srcMode, d.srcReg) || d.srcMode == MODE_IMM) && reg(d.dstMode, d.dstReg);
+		case OP_clr: case OP_com: case OP_inc: case OP_dec: case OP_neg: case OP_adc: case OP_sbc: case OP_tst:
+		case OP_ror: case OP_rol: case OP_asr: case OP_asl: case OP_swab: case OP_sxt:
+			return reg(d.dstMode, d.dstReg);
+		case OP_mul: case OP_div: case OP_ash: case OP_ashc: case OP_xor_:
+			return d.srcReg < SP && reg(d.dstMode, d.dstReg);
+		case OP_sob:
+			return d.srcReg != PC;
+		case OP_ccop:
+			return true;
+		default:
+			return inst.op == OP_br || (inst.op >= OP_bne && inst.op <= OP_bcs);
+	}
+}
+
+/**
+ * C++ expression for a register or immediate operand's value
+ */
+std::string Recompiler::operand(PBYTE mode, PBYTE reg, PWORD word) {
+	return mode == MODE_IMM ? format("0%06o", word) : format("r[%d]", reg);
+}
+
+/**
+ * C++ statement running an inlined instruction, once PC has been set past it
+ */
+std::string Recompiler::statement(const Inst& inst) {
+	const Decoded& d = inst.d;
+	const char* name = opName(inst.op);
+	switch (inst.op) {
+		case OP_mov: case OP_cmp: case OP_bit: case OP_bic: case OP_bis: case OP_add: case OP_sub:
+			return format("{ PWORD s = %s; cpu.%s(&s, &r[%d]); }", operand(d.srcMode, d.srcReg, d.srcWord).c_str(),
+						  name, d.dstReg);
+		case OP_mul: case OP_div: case OP_ash: case OP_ashc: case OP_xor_:
+			return format("{ PWORD s = r[%d]; cpu.%s((RegCode)%d, &s); }", d.dstReg, name, d.srcReg);
+		case OP_sob:
+			return format("{ PWORD t = 0%06o; cpu.sob((RegCode)%d, &t); }", (PWORD)(inst.next - 2 * d.offset),
+						  d.srcReg);
+		case OP_ccop: {
+			static const char* const set[] = {"sec", "sev", "sez", "sen"};
+			static const char* const clear[] = {"clc", "clv", "clz", "cln"};
+			std::string calls;
+			for (int bit = 0; bit < 4; bit++)
+				if (d.offset & (1 << bit))
+					calls += format("cpu.%s(); ", (d.offset & 020) ? set[bit] : clear[bit]);
+			return calls.empty() ? "{}" : calls.substr(0, calls.size() - 1);
+		}
+		default:
+			if (inst.op == OP_br || (inst.op >= OP_bne && inst.op <= OP_bcs))
+				return format("{ PWORD o = 0%06o; cpu.%s(&o); }", (PWORD)d.offset, name);
+			return format("cpu.%s(&r[%d]);", name, d.dstReg);
+	}
+}
+
+/**
+ * C++ source for every block found, for compiling into a shared object
+ */
+std::string Recompiler::source() const {
+	std::string out = "//Guest code recompiled by the PDP-1186 static recompiler\n#include \"Native.h\"\n";
+	for (const auto& entry : blocks) {
+		const std::vector<Inst>& insts = entry.second;
+		PWORD start = entry.first, end = insts.back().next;
+
+		out += format("\nstatic const PWORD words_%06o[] = {", start);
+		for (PWORD a = start; a < end; a += 2)
+			out += format("%s0%06o", a == start ? "" : ", ", cpu.mem(a));
+		out += "};\n\n";
+		bool checks = false;
+		for (size_t i = 0; i + 1 < insts.size(); i++)
+			checks = checks || !inlined(insts[i]);
+		out += format("static uint64_t block_%06o(Processor& cpu, PWORD* r, const volatile bool&%s) {\n", start,
+					  checks ? " dirty" : "");
+		for (size_t i = 0; i < insts.size(); i++) {
+			const Inst& inst = insts[i];
+			out += format("\t//%06o: %s\n", inst.pc, opName(inst.op));
+			if (inlined(inst)) {
+				out += format("\tr[PC] = 0%06o;\n\t%s\n", inst.next, statement(inst).c_str());
+				continue;
+			}
+			out += format("\tr[PC] = 0%06o;\n\tcpu.step();\n", inst.pc);
+			if (i + 1 < insts.size())
+				out += format("\tif (r[PC] != 0%06o || dirty || cpu.isHalted())\n\t\treturn %d;\n", inst.next,
+							  (int)i + 1);
+		}
+		out += format("\treturn %d;\n}\n", (int)insts.size());
+	}
+
+	out += "\nstatic const NativeBlock blocks[] = {\n";
+	for (const auto& entry : blocks)
+		out += format("\t{0%06o, 0%06o, %d, words_%06o, block_%06o},\n", entry.first, entry.second.back().next,
+					  (int)entry.second.size(), entry.first, entry.first);
+	out += "\t{0, 0, 0, nullptr, nullptr}\n};\n\n";
+	out += "extern \"C\" const NativeImage* " NATIVE_ENTRY "() {\n";
+	out += format("\tstatic const NativeImage image = {NATIVE_ABI, sizeof(Processor), %d, blocks};\n",
+				  (int)blocks.size());
+	out += "\treturn &image;\n}\n";
+	return out;
+}
+
+/**
+ * Compile recompiled code into a shared object, with the compiler the emulator was built with. The source is kept
+ * next to it, with .cpp added to its name. The compiler is run directly rather than through a shell, so the path is
+ * taken as it is, whatever's in it.
+ * @param source C++ from source()
+ * @param path Shared object to write
+ * @return Whether it compiled
+ */
+bool Recompiler::build(const std::string& source, const std::string& path) {
+#ifdef PDP_NATIVE
+	if (path.empty())
+		return false;
+	std::string out = path[0] == '-' ? "./" + path : path; //Not to be taken for an option
+	std::string cpp = out + ".cpp";
+	FILE* f = fopen(cpp.c_str(), "w");
+	if (f == nullptr)
+		return false;
+	bool written = fwrite(source.data(), 1, source.size(), f) == source.size();
+	if (fclose(f) != 0 || !written)
+		return false;
+
+	std::string include = std::string("-I") + PDP_NATIVE_INCLUDE;
+	const char* argv[] = {PDP_NATIVE_CXX, "-std=c++14", "-O2", "-fPIC", "-shared", include.c_str(), "-o", out.c_str(),
+						  cpp.c_str(), nullptr};
+	pid_t child = fork();
+	if (child < 0)
+		return false;
+	if (child == 0) {
+		execvp(argv[0], (char* const*)argv);
+		_exit(127);
+	}
+	int status;
+	while (waitpid(child, &status, 0) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+	(void)source;
+	(void)path;
+	return false;
+#endif
+}
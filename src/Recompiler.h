@@ -0,0 +1,41 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "Dispatch.h"
+
+/**
+ * Static recompiler. Starting from a program's entry point in core, it follows every branch, jump and call to a fixed
+ * address to find the program's basic blocks, and writes C++ for each of them against the interface in Native.h.
+ * Instructions on registers and immediates become direct calls to Processor's instruction methods; anything else is
+ * run through Processor::step(). The C++ is compiled into a shared object for Processor::loadNative().
+ *
+ * Code only reached through a register or a table isn't found, and is left to the interpreter.
+ */
+class Recompiler {
+public:
+	explicit Recompiler(Processor& cpu);
+
+	void discover(PWORD entry);
+	size_t size() const;
+	std::string source() const;
+	static bool build(const std::string& source, const std::string& path);
+
+private:
+	//One guest instruction of a block
+	struct Inst {
+		PWORD pc;
+		PWORD next;
+		Decoded d;
+		PBYTE op;	//!< Plain handler number
+	};
+
+	std::vector<Inst> scan(PWORD pc);
+	void successors(const std::vector<Inst>& insts, std::vector<PWORD>& targets) const;
+	static bool inlined(const Inst& inst);
+	static std::string operand(PBYTE mode, PBYTE reg, PWORD word);
+	static std::string statement(const Inst& inst);
+
+	Processor& cpu;
+	std::map<PWORD, std::vector<Inst>> blocks;	//!< Blocks found, by address
+};
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include "Jit.h"
+#include "WriteGuard.h"
+
+#ifdef PDP_JIT
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+//Processors being guarded; the handler only ever reads this, and everything else changes it under registryLock
+static std::atomic<WriteGuard*> registry[WRITE_GUARD_MAX];
+static std::mutex registryLock;
+static int registered = 0;
+static struct sigaction previous;	//!< SIGSEGV action from before the first guard was made, put back after the last
+
+static size_t hostPage() {
+	static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+/**
+ * Start guarding a processor's core
+ * @return The guard, or null if SIGSEGV belongs to someone else or too many processors are guarded already
+ */
+WriteGuard* WriteGuard::make(Processor& cpu) {
+	std::lock_guard<std::mutex> hold(registryLock);
+	if (registered == WRITE_GUARD_MAX)
+		return nullptr;
+	if (registered == 0) {
+		struct sigaction action = {};
+		sigaction(SIGSEGV, nullptr, &action);
+		if (!(action.sa_flags & SA_SIGINFO) && action.sa_handler != SIG_DFL)
+			return nullptr;
+		if ((action.sa_flags & SA_SIGINFO) && action.sa_sigaction != handler)
+			return nullptr;
+		previous = action;
+		action.sa_sigaction = handler;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		if (sigaction(SIGSEGV, &action, nullptr) != 0)
+			return nullptr;
+	}
+
+	WriteGuard* guard = new WriteGuard(cpu);
+	for (auto& slot : registry) {
+		if (slot.load() == nullptr) {
+			slot.store(guard);
+			break;
+		}
+	}
+	registered++;
+	return guard;
+}
+
+/**
+ * Stop guarding, unprotecting every page
+ */
+WriteGuard::~WriteGuard() {
+	settle();
+	std::lock_guard<std::mutex> hold(registryLock);
+	for (auto& slot : registry)
+		if (slot.load() == this)
+			slot.store(nullptr);
+	if (--registered == 0)
+		sigaction(SIGSEGV, &previous, nullptr);
+	mprotect(cpu.core.byte, (size_t)cpu.coreSizeBytes, PROT_READ | PROT_WRITE);
+	close();
+	delete[] pending;
+}
+
+/**
+ * Bytes of host address space reserved for a core of a given size
+ */
+static size_t reserved(int size) {
+	size_t bytes = ((size_t)size + hostPage() - 1) & ~(hostPage() - 1);
+	return std::max(bytes, ((size_t)WRITE_GUARD_SPACE + hostPage() - 1) & ~(hostPage() - 1));
+}
+
+/**
+ * Allocate core, zeroed, in whole host pages of its own so that it can be protected, at the start of an inaccessible
+ * reservation for the whole address space
+ */
+PBYTE* WriteGuard::allocate(int size) {
+	void* core = mmap(nullptr, reserved(size), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (core == MAP_FAILED)
+		throw std::bad_alloc();
+	if (mprotect(core, ((size_t)size + hostPage() - 1) & ~(hostPage() - 1), PROT_READ | PROT_WRITE) != 0) {
+		munmap(core, reserved(size));
+		throw std::bad_alloc();
+	}
+	return (PBYTE*)core;
+}
+
+void WriteGuard::free(PBYTE* core, int size) {
+	munmap(core, reserved(size));
+}
+
+/**
+ * Write-protect the host page holding a page of core that code has been found in
+ * @param page Page of core, as in Processor::codePages
+ */
+void WriteGuard::protect(int page) {
+	size_t host = ((size_t)page << ICACHE_PAGE_BITS) / hostPage();
+	if (guarded[host])
+		return;
+	guarded[host] = true;
+	mprotect(cpu.core.byte + host * hostPage(), hostPage(), PROT_READ);
+}
+
+/**
+ * Whether so many writes have hit protected pages that checking stores would be cheaper
+ */
+bool WriteGuard::thrashing() const {
+	return faults >= WRITE_GUARD_FAULTS;
+}
+
+/**
+ * Whether every address past the end of core faults, so that translated code needn't check for them
+ */
+bool WriteGuard::fenced() const {
+	return (size_t)cpu.coreSizeBytes % hostPage() == 0;
+}
+
+/**
+ * Whether the handler can send translated code that faulted past the end of core on to a device register instead,
+ * which takes changing where the faulting thread carries on from
+ */
+bool WriteGuard::diverts() {
+#if defined(__linux__) && defined(__x86_64__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Make the pages past the end of core that faults have opened up inaccessible again, and zero, dropping whatever was
+ * stored to them
+ */
+void WriteGuard::close() {
+	if (openings == 0)
+		return;
+	for (size_t page = 0; page < opened.size(); page++) {
+		if (!opened[page])
+			continue;
+		mmap(cpu.core.byte + page * hostPage(), hostPage(), PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		opened[page] = false;
+	}
+	openings = 0;
+}
+
+WriteGuard::WriteGuard(Processor& cpu) : cpu(cpu), openings(0), faults(0) {
+	guarded.resize(((size_t)cpu.coreSizeBytes + hostPage() - 1) / hostPage());
+	pending = new std::atomic<bool>[guarded.size()]();
+	opened.resize(reserved(cpu.coreSizeBytes) / hostPage());
+}
+
+/**
+ * A write hit a protected page: unprotect it, and leave the code in it for settle() to throw away
+ * @param offset Byte offset into core of the write
+ */
+void WriteGuard::fault(uintptr_t offset) {
+	size_t host = offset / hostPage();
+	mprotect(cpu.core.byte + host * hostPage(), hostPage(), PROT_READ | PROT_WRITE);
+	pending[host].store(true, std::memory_order_relaxed);
+	cpu.codeWritten = true;
+}
+
+/**
+ * Throw away all the code in pages the handler has unprotected since this was last called, letting translated code
+ * know it may have to leave its block. Called outside the handler, whenever Processor::codeWritten is found set.
+ */
+void WriteGuard::settle() {
+	cpu.codeWritten = false;
+	for (size_t host = 0; host < guarded.size(); host++) {
+		if (!pending[host].exchange(false, std::memory_order_relaxed))
+			continue;
+		guarded[host] = false;
+		faults++;
+
+		int first = (int)(host * hostPage()) >> ICACHE_PAGE_BITS;
+		int last = (int)((host + 1) * hostPage()) >> ICACHE_PAGE_BITS;
+		for (int page = first; page < last && page << ICACHE_PAGE_BITS < cpu.coreSizeBytes; page++)
+			if (cpu.codePages[page])
+				cpu.invalidate((PWORD)(page << ICACHE_PAGE_BITS));
+	}
+}
+
+/**
+ * An access went past the end of core: make it fault as Processor::memory() would, and let it go ahead on a page of
+ * zeroes until the trap closes it again
+ * @param offset Byte offset from the start of core of the access
+ */
+void WriteGuard::outside(uintptr_t offset) {
+	size_t page = offset / hostPage();
+	mprotect(cpu.core.byte + page * hostPage(), hostPage(), PROT_READ | PROT_WRITE);
+	opened[page] = true;
+	openings++;
+	cpu.fault = true;
+}
+
+/**
+ * Send an access past the end of core by translated code on to the device register it may be, if it's one that was
+ * marked for it
+ * @param context Context the handler was given, whose instruction pointer is moved on
+ * @return Whether it was
+ */
+bool WriteGuard::divert(void* context) {
+#if defined(__linux__) && defined(__x86_64__)
+	if (cpu.jit == nullptr)
+		return false;
+	greg_t& rip = ((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+	uintptr_t to = cpu.jit->divert((uintptr_t)rip);
+	if (to == 0)
+		return false;
+	rip = (greg_t)to;
+	return true;
+#else
+	(void)context;
+	return false;
+#endif
+}
+
+/**
+ * SIGSEGV handler. Faults in a guarded core are writes to code, and faults in the rest of its reservation are accesses
+ * past its end, which may be sent on to device registers; all of those are dealt with. Anything else is a real crash,
+ * so the previous action is put back and the faulting instruction left to fault again under it.
+ */
+void WriteGuard::handler(int sig, siginfo_t* info, void* context) {
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	for (auto& slot : registry) {
+		WriteGuard* guard = slot.load();
+		if (guard == nullptr)
+			continue;
+		uintptr_t offset = addr - (uintptr_t)guard->cpu.core.byte;
+		if (offset < (uintptr_t)guard->cpu.coreSizeBytes && guard->guarded[offset / hostPage()]) {
+			guard->fault(offset);
+			return;
+		}
+		if (offset >= (uintptr_t)guard->cpu.coreSizeBytes && offset < guard->opened.size() * hostPage() &&
+			guard->fenced()) {
+			if (!guard->divert(context))
+				guard->outside(offset);
+			return;
+		}
+	}
+	sigaction(sig, &previous, nullptr);
+}
+
+#else
+
+/**
+ * Write protection needs the translator's host support; stores are always checked without it
+ */
+WriteGuard* WriteGuard::make(Processor&) {
+	return nullptr;
+}
+
+WriteGuard::~WriteGuard() {
+}
+
+PBYTE* WriteGuard::allocate(int size) {
+	return new PBYTE[size]();
+}
+
+void WriteGuard::free(PBYTE* core, int) {
+	delete[] core;
+}
+
+void WriteGuard::protect(int) {
+}
+
+void WriteGuard::settle() {
+}
+
+bool WriteGuard::thrashing() const {
+	return false;
+}
+
+bool WriteGuard::fenced() const {
+	return false;
+}
+
+bool WriteGuard::diverts() {
+	return false;
+}
+
+void WriteGuard::close() {
+}
+
+#endif
+
+/**
+ * Whether writes to code are being caught by write protection
+ */
+bool Processor::writeGuard() const {
+	return guard != nullptr;
+}
+
+/**
+ * Catch writes to code by write-protecting the pages of core it's in, so that translated code can store to core without
+ * checking first whether there's code there. Needs SIGSEGV to itself; otherwise, and on hosts without the translator,
+ * stores carry on being checked.
+ * @param on Whether to
+ * @return Whether writes to code are now caught by write protection
+ */
+bool Processor::writeGuard(bool on) {
+	if (on == (guard != nullptr))
+		return on;
+	if (on) {
+		guard = WriteGuard::make(*this);
+		if (guard == nullptr)
+			return false;
+		for (int page = 0; page < coreSizeBytes >> ICACHE_PAGE_BITS; page++)
+			if (codePages[page])
+				guard->protect(page);
+	}
+	else {
+		delete guard;
+		guard = nullptr;
+	}
+#ifdef PDP_JIT
+	if (jit)
+		jit->reconfigure();
+#endif
+	return on;
+}
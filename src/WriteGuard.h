@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#ifdef PDP_JIT
+#include <csignal>
+#endif
+#include "Processor.h"
+
+#define		WRITE_GUARD_MAX		16	//!< Most processors that can be guarded at once
+#define		WRITE_GUARD_FAULTS	64	//!< Faults a processor may take before guarding is given up on as a loss
+#define		WRITE_GUARD_SPACE	(1 << 16)	//!< Host address space reserved for every core, all a PWORD reaches
+
+/**
+ * Catches writes to code by write-protecting the host pages of core that hold it, so that translated code can store
+ * to core without looking up whether there's code there first. A write to a protected page raises SIGSEGV; the
+ * handler unprotects the page, marks it pending and sets Processor::codeWritten, then lets the write go ahead. None of
+ * the work of throwing away what was built from code in it is safe in a signal handler, so that's left to settle(),
+ * which whatever made the write calls as soon as it sees codeWritten: Processor::written() after every store the
+ * interpreters make, and translated code straight after its own stores.
+ *
+ * Host pages are bigger than the pages of core that code is tracked in, so data sharing a host page with code costs a
+ * fault and the code there. Once a processor has taken WRITE_GUARD_FAULTS faults it's reckoned to be mixing the two
+ * too much, and Processor::run() turns guarding off next time it's called.
+ *
+ * Core is allocated at the start of a reservation covering every address a guest can name, and the rest of it is left
+ * inaccessible. With guarding on, translated code loads and stores at any even address without checking it against
+ * the size of core first: one past the end faults, and the handler sets Processor::fault and opens up the page it hit
+ * to read as zero and soak up the store, as the interpreter's scratch word would. The trap that fault always leads to
+ * closes it again. Cores that don't end on a host page boundary aren't fenced off that way, and stay checked.
+ *
+ * With devices attached, addresses past the end of core may be device registers rather than faults. Where the handler
+ * can move the faulting thread on (see diverts()), each translated access that may go there is marked for it to be
+ * sent on to the same device access it would have made had it checked the address; elsewhere, translated code goes
+ * back to checking addresses once a device is attached.
+ *
+ * The SIGSEGV handler is process-wide, so guarding is only ever turned on if nothing else has a handler installed,
+ * and faults anywhere but a guarded core go to the default action. Otherwise Processor::writeGuard() reports that it
+ * couldn't guard, and stores carry on being checked against Processor::codePages.
+ */
+class WriteGuard {
+public:
+	static WriteGuard* make(Processor& cpu);
+	~WriteGuard();
+	WriteGuard(const WriteGuard&) = delete;
+	void operator=(const WriteGuard&) = delete;
+
+	static PBYTE* allocate(int size);
+	static void free(PBYTE* core, int size);
+
+	void protect(int page);
+	void settle();
+	bool thrashing() const;
+	bool fenced() const;
+	static bool diverts();
+	void close();
+
+private:
+	explicit WriteGuard(Processor& cpu);
+	void fault(uintptr_t offset);
+	void outside(uintptr_t offset);
+	bool divert(void* context);
+#ifdef PDP_JIT
+	static void handler(int sig, siginfo_t* info, void* context);
+#endif
+
+	Processor& cpu;
+	std::vector<bool> guarded;	//!< Host pages of core that are write-protected
+	std::atomic<bool>* pending;	//!< Host pages of core the handler has unprotected, whose code is still to go
+	std::vector<bool> opened;	//!< Host pages past the end of core that a fault has made accessible, by page of space
+	int openings;				//!< Pages set in opened
+	int faults;
+};
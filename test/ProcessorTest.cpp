@@ -1,5 +1,19 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef PDP_JIT
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef PDP_NATIVE
+#include <unistd.h>
+#endif
 #include "gtest/gtest.h"
+#include "../src/JitSymbols.h"
 #include "../src/Processor.h"
+#include "../src/Recompiler.h"
 
 /**
  * Basic register assignment, copy, and priority tests
@@ -179,6 +193,39 @@ TEST(processor_test, one_arg_instructions){
 	ASSERT_TRUE(proc.pstat_zero());
 }
 
+TEST(processor_test, shift_flags){
+	Processor proc;
+	for (int i = 0; i < 0x10000; i++) {
+		PWORD o1 = (PWORD)i;
+		proc.scc();
+		proc.asl(&o1);
+		ASSERT_EQ(o1, (PWORD)(i << 1));
+		ASSERT_EQ(proc.pstat_carry(), (i & 0x8000) != 0);
+		ASSERT_EQ(proc.pstat_neg(), (o1 & 0x8000) != 0);
+		ASSERT_EQ(proc.pstat_zero(), o1 == 0);
+		ASSERT_EQ(proc.pstat_overf(), proc.pstat_neg() != proc.pstat_carry());
+
+		o1 = (PWORD)i;
+		proc.ccc();
+		proc.asr(&o1);
+		ASSERT_EQ(o1, (PWORD)((SPWORD)i >> 1));
+		ASSERT_EQ(proc.pstat_carry(), (i & 1) != 0);
+		ASSERT_EQ(proc.pstat_neg(), (o1 & 0x8000) != 0);
+		ASSERT_EQ(proc.pstat_zero(), o1 == 0);
+		ASSERT_EQ(proc.pstat_overf(), proc.pstat_neg() != proc.pstat_carry());
+
+		o1 = (PWORD)i;
+		proc.ccc();
+		proc.ror(&o1);
+		proc.rol(&o1);
+		ASSERT_EQ(o1, (PWORD)i);
+		ASSERT_TRUE(proc.pstat_carry());
+		ASSERT_EQ(proc.pstat_neg(), (o1 & 0x8000) != 0);
+		ASSERT_EQ(proc.pstat_zero(), o1 == 0);
+		ASSERT_EQ(proc.pstat_overf(), !proc.pstat_neg());
+	}
+}
+
 TEST(processor_test, one_half_arg_instructions){
 	Processor proc;
 	PWORD o1 = 5;
@@ -286,4 +333,1495 @@ TEST(processor_test, two_arg_instructions){
 	proc.bit(&o1, &o2);
 	ASSERT_TRUE(proc.pstat_zero());
 	ASSERT_FALSE(proc.pstat_neg());
-}
\ No newline at end of file
+}
+/**
+ * Copy a program (or data) into core, starting at addr
+ */
+static void load(Processor& proc, PWORD addr, std::initializer_list<PWORD> words) {
+	for (PWORD word : words) {
+		proc.mem(addr, word);
+		addr += 2;
+	}
+}
+
+#ifdef PDP_JIT
+/**
+ * Make an empty file in /tmp for something under test to write to
+ * @param name Start of its name
+ * @return Path to the file, or an empty string if it couldn't be made
+ */
+static std::string tempFile(const char* name) {
+	std::string path = std::string("/tmp/") + name + "XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd < 0)
+		return std::string();
+	close(fd);
+	return path;
+}
+
+/**
+ * Read back a file made by tempFile(), and remove it
+ * @param path Path to the file
+ * @return Everything in it
+ */
+static std::string takeFile(const std::string& path) {
+	std::string contents;
+	FILE* f = fopen(path.c_str(), "r");
+	if (f == nullptr)
+		return contents;
+	int c;
+	while ((c = fgetc(f)) != EOF)
+		contents += (char)c;
+	fclose(f);
+	remove(path.c_str());
+	return contents;
+}
+#endif
+
+TEST(processor_test, run_program){
+	Processor proc;
+
+	//Sum 1..10 into R1
+	load(proc, 01000, {
+		012700, 000012,		//mov #10, r0
+		005001,				//clr r1
+		060001,				//1$: add r0, r1
+		077002,				//sob r0, 1$
+		000000				//halt
+	});
+	proc.reg(PC, 01000);
+	ASSERT_EQ(proc.run(1000), 23);
+	ASSERT_TRUE(proc.isHalted());
+	ASSERT_EQ(proc.reg(R1), 55);
+	ASSERT_EQ(proc.reg(R0), 0);
+	ASSERT_EQ(proc.reg(PC), 01014);
+
+	//Halted processors don't run until resumed
+	ASSERT_EQ(proc.run(1000), 0);
+	ASSERT_FALSE(proc.step());
+	proc.resume();
+	proc.reg(PC, 01000);
+	ASSERT_EQ(proc.run(5), 5);
+	ASSERT_FALSE(proc.isHalted());
+}
+
+TEST(processor_test, addressing_modes){
+	Processor proc;
+	load(proc, 02000, {1, 2, 3});
+	load(proc, 01000, {
+		012700, 002000,		//mov #2000, r0
+		012701, 003000,		//mov #3000, r1
+		012702, 000003,		//mov #3, r2
+		012021,				//1$: mov (r0)+, (r1)+
+		077202,				//sob r2, 1$
+		016103, 0177776,		//mov -2(r1), r3
+		014104,				//mov -(r1), r4
+		013705, 003000,		//mov @#3000, r5
+		000000				//halt
+	});
+	proc.reg(PC, 01000);
+	proc.run(1000);
+	ASSERT_TRUE(proc.isHalted());
+	ASSERT_EQ(proc.mem(03000), 1);
+	ASSERT_EQ(proc.mem(03002), 2);
+	ASSERT_EQ(proc.mem(03004), 3);
+	ASSERT_EQ(proc.reg(R0), 02006);
+	ASSERT_EQ(proc.reg(R1), 03004);
+	ASSERT_EQ(proc.reg(R2), 0);
+	ASSERT_EQ(proc.reg(R3), 3);
+	ASSERT_EQ(proc.reg(R4), 3);
+	ASSERT_EQ(proc.reg(R5), 1);
+}
+
+TEST(processor_test, deferred_and_relative_modes){
+	for (ExecMode mode : {EXEC_CALL, EXEC_THREADED, EXEC_SWITCH, EXEC_JIT, EXEC_TIERED}) {
+		Processor proc;
+		proc.mode(mode);
+		load(proc, 02000, {1, 2, 3});
+		load(proc, 02100, {02002, 02004});
+		load(proc, 01000, {
+			012700, 002100,		//mov #2100, r0
+			013001,				//mov @(r0)+, r1
+			013002,				//mov @(r0)+, r2
+			015003,				//mov @-(r0), r3
+			017004, 0177776,	//mov @-2(r0), r4
+			011005,				//mov (r0), r5
+			060105,				//add r1, r5
+			010567, 000012,		//mov r5, 1040
+			017705, 000010,		//mov @1042, r5
+			000000,				//halt
+			000000, 000000,
+			000000,				//1040
+			002000				//1042
+		});
+		proc.reg(PC, 01000);
+		ASSERT_EQ(proc.run(1000), 10);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R0), 02102);
+		ASSERT_EQ(proc.reg(R1), 2);
+		ASSERT_EQ(proc.reg(R2), 3);
+		ASSERT_EQ(proc.reg(R3), 3);
+		ASSERT_EQ(proc.reg(R4), 2);
+		ASSERT_EQ(proc.reg(R5), 1);
+		ASSERT_EQ(proc.mem(01040), 02006);
+		ASSERT_EQ(proc.reg(PC), 01034);
+	}
+}
+
+TEST(processor_test, subroutines_and_traps){
+	Processor proc;
+
+	//jsr/rts
+	load(proc, 01000, {
+		012706, 001000,		//mov #1000, sp
+		004737, 001020,		//jsr pc, @#1020
+		000000,				//halt
+		000000, 000000, 000000,
+		005200,				//1020: inc r0
+		000207				//rts pc
+	});
+	proc.reg(PC, 01000);
+	proc.run(100);
+	ASSERT_TRUE(proc.isHalted());
+	ASSERT_EQ(proc.reg(R0), 1);
+	ASSERT_EQ(proc.reg(SP), 01000);
+	ASSERT_EQ(proc.reg(PC), 01012);
+
+	//trap/rti
+	load(proc, VEC_TRAP, {02000, 0});
+	load(proc, 01000, {
+		012706, 001000,		//mov #1000, sp
+		0104400,				//trap 0
+		000000				//halt
+	});
+	load(proc, 02000, {
+		012701, 000007,		//mov #7, r1
+		000002				//rti
+	});
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(100);
+	ASSERT_TRUE(proc.isHalted());
+	ASSERT_EQ(proc.reg(R1), 7);
+	ASSERT_EQ(proc.reg(SP), 01000);
+	ASSERT_EQ(proc.reg(PC), 01010);
+
+	//Odd addresses and addresses past the end of core trap through 4, unimplemented instructions through 10
+	load(proc, VEC_BUSERR, {03000, 0, 03010, 0});
+	load(proc, 03000, {005202, 000000});	//inc r2; halt
+	load(proc, 03010, {005203, 000000});	//inc r3; halt
+	load(proc, 01000, {
+		013700, 000001		//mov @#1, r0
+	});
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(100);
+	ASSERT_EQ(proc.reg(R2), 1);
+	load(proc, 01000, {
+		013700, 0177776		//mov @#177776, r0
+	});
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(100);
+	ASSERT_EQ(proc.reg(R2), 2);
+	load(proc, 01000, {
+		0110001				//movb r0, r1
+	});
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(100);
+	ASSERT_EQ(proc.reg(R3), 1);
+}
+
+TEST(processor_test, self_modifying_code){
+	Processor proc;
+
+	//The first pass through the loop turns the inc into a dec, which the second pass has to see
+	load(proc, 01000, {
+		005200,					//1$: inc r0
+		012737, 005300, 001000,	//mov #5300, @#1000
+		005701,					//tst r1
+		001002,					//bne 2$
+		005201,					//inc r1
+		000770,					//br 1$
+		000000					//2$: halt
+	});
+	proc.reg(PC, 01000);
+	proc.run(1000);
+	ASSERT_TRUE(proc.isHalted());
+	ASSERT_EQ(proc.reg(R0), 0);
+	ASSERT_EQ(proc.reg(R1), 1);
+
+	//Writes from outside, and to immediate words, count too
+	load(proc, 01000, {
+		012702, 000005,			//mov #5, r2
+		000000					//halt
+	});
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(1000);
+	ASSERT_EQ(proc.reg(R2), 5);
+	proc.mem(01002, 6);
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(1000);
+	ASSERT_EQ(proc.reg(R2), 6);
+
+	//Stack pushes land on code too; the halt gets decoded, then turned into a bne by the jsr
+	load(proc, 01000, {
+		012706, 001012,			//mov #1012, sp
+		004767, 000000,			//jsr pc, 1$
+		000000					//1$: halt
+	});
+	proc.resume();
+	proc.reg(PC, 01010);
+	proc.run(1000);
+	ASSERT_EQ(proc.reg(PC), 01012);
+	proc.resume();
+	proc.reg(PC, 01000);
+	proc.run(1000);
+	ASSERT_EQ(proc.mem(01010), 01010);
+	ASSERT_EQ(proc.reg(PC), 01034);
+}
+
+TEST(processor_test, exec_modes){
+	//Every interpreter has to agree on where a program ends up, down to the instruction count
+	ExecMode modes[] = {EXEC_CALL, EXEC_THREADED, EXEC_SWITCH, EXEC_JIT, EXEC_TIERED};
+	for (ExecMode mode : modes) {
+		Processor proc;
+		proc.mode(mode);
+		ASSERT_EQ(proc.mode(), mode);
+		load(proc, 02000, {1, 2, 3});
+		load(proc, 01000, {
+			012700, 002000,		//mov #2000, r0
+			012701, 003000,		//mov #3000, r1
+			012702, 000003,		//mov #3, r2
+			012021,				//1$: mov (r0)+, (r1)+
+			077202,				//sob r2, 1$
+			005005,				//clr r5
+			062705, 000007,		//add #7, r5
+			020527, 000007,		//cmp r5, #7
+			001401,				//beq 2$
+			000000,				//halt
+			000000				//2$: halt
+		});
+		proc.reg(PC, 01000);
+		ASSERT_EQ(proc.run(5), 5);
+		ASSERT_EQ(proc.run(1000), 9);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.mem(03004), 3);
+		ASSERT_EQ(proc.reg(R5), 7);
+		ASSERT_EQ(proc.reg(PC), 01040);
+	}
+}
+
+TEST(processor_test, fused_pairs){
+	//Superinstructions have to stop between their two halves when the budget says so, and the copy step has to notice
+	//when it copies over its own SOB
+	for (ExecMode mode : {EXEC_THREADED, EXEC_SWITCH}) {
+		for (uint64_t slice : {1, 2, 3, 1000}) {
+			Processor ref, proc;
+			ref.mode(EXEC_CALL);
+			proc.mode(mode);
+			for (Processor* p : {&ref, &proc}) {
+				load(*p, 02000, {1, 2, 3, 4});
+				load(*p, 04000, {0});
+				load(*p, 01000, {
+					012700, 002000,			//mov #2000, r0
+					012701, 003000,			//mov #3000, r1
+					012702, 000004,			//mov #4, r2
+					012021,					//1$: mov (r0)+, (r1)+
+					077202,					//sob r2, 1$
+					005003,					//clr r3
+					005203,					//2$: inc r3
+					020327, 000005,			//cmp r3, #5
+					001374,					//bne 2$
+					005704,					//tst r4
+					001401,					//beq 3$
+					000000,					//halt
+					012705, 000003,			//3$: mov #3, r5
+					005305,					//4$: dec r5
+					003376,					//bgt 4$
+					032705, 000001,			//bit #1, r5
+					001001,					//bne 5$
+					005204,					//inc r4
+					012700, 004000,			//5$: mov #4000, r0
+					012701, 001102,			//mov #6$+2, r1
+					012702, 000005,			//mov #5, r2
+					000137, 001100,			//jmp @#6$
+				});
+				load(*p, 01100, {
+					012021,					//6$: mov (r0)+, (r1)+
+					077202,					//sob r2, 6$
+					000000					//halt
+				});
+				p->reg(PC, 01000);
+			}
+			while (!ref.isHalted()) {
+				ASSERT_EQ(ref.run(slice), proc.run(slice));
+				for (int r = R0; r <= PC; r++)
+					ASSERT_EQ(ref.reg((RegCode)r), proc.reg((RegCode)r));
+				ASSERT_EQ(ref.pstat(), proc.pstat());
+				ASSERT_EQ(ref.isHalted(), proc.isHalted());
+			}
+			ASSERT_EQ(proc.mem(03006), 4);
+			ASSERT_EQ(proc.reg(R3), 5);
+			ASSERT_EQ(proc.reg(R4), 1);
+			ASSERT_EQ(proc.reg(R2), 5);
+			ASSERT_EQ(proc.reg(PC), 01104);
+		}
+	}
+}
+
+TEST(processor_test, bulk_loops){
+	//Copy and clear loops run in bulk have to end up exactly where running them a lap at a time would, including when
+	//they overlap, write over code, fault or run out of budget partway
+	struct Loop {
+		PWORD src, dst, count;
+		bool copy;
+	};
+	Processor probe;
+	PWORD top = (PWORD)probe.coreSize();
+	Loop loops[] = {
+		{02000, 03000, 100, true},
+		{02000, 02002, 50, true},
+		{02200, 02000, 200, true},
+		{0, 02000, 300, false},
+		{02000, 0776, 20, true},
+		{02001, 03000, 10, true},
+		{02000, (PWORD)(top - 10), 100, true},
+		{0, (PWORD)(top - 10), 100, false},
+	};
+	for (const Loop& loop : loops) {
+		for (ExecMode mode : {EXEC_THREADED, EXEC_SWITCH, EXEC_JIT}) {
+			for (uint64_t slice : {37, 100000}) {
+				Processor ref, proc;
+				ref.mode(EXEC_CALL);
+				proc.mode(mode);
+				for (Processor* p : {&ref, &proc}) {
+					for (PWORD addr = 02000; addr < 04000; addr += 2)
+						p->mem(addr, (PWORD)(0240 | (addr / 2 % 32)));
+					load(*p, 04, {01020, 0});
+					load(*p, 01000, {
+						012700, loop.src,					//mov #src, r0
+						012701, loop.dst,					//mov #dst, r1
+						012702, loop.count,					//mov #count, r2
+						(PWORD)(loop.copy ? 012021 : 005021),	//1$: mov (r0)+, (r1)+ or clr (r1)+
+						077202,								//sob r2, 1$
+						000000								//halt
+					});
+					p->reg(SP, 0700);
+					p->reg(PC, 01000);
+				}
+				uint64_t total = 0;
+				while (!ref.isHalted() && total < 20000) {
+					uint64_t n = ref.run(slice);
+					ASSERT_EQ(n, proc.run(slice)) << loop.src << " " << loop.dst << " " << mode;
+					total += n;
+					for (int r = R0; r <= PC; r++)
+						ASSERT_EQ(ref.reg((RegCode)r), proc.reg((RegCode)r));
+					ASSERT_EQ(ref.pstat(), proc.pstat());
+				}
+				for (PWORD addr = 0; addr < top - 1; addr += 2)
+					ASSERT_EQ(ref.mem(addr), proc.mem(addr)) << addr;
+			}
+		}
+	}
+}
+
+TEST(processor_test, lazy_flags){
+	Processor proc;
+	PWORD o1 = 0x7FFF, o2 = 1;
+
+	//Codes only get worked out when asked for, but have to come out the same as if they'd been set right away
+	proc.sec();
+	proc.add(&o2, &o1);
+	ASSERT_EQ(proc.pstat(), SN | SV | SC);
+	ASSERT_TRUE(proc.pstat_neg() && proc.pstat_overf() && proc.pstat_carry());
+	proc.tst(&o2);
+	ASSERT_FALSE(proc.pstat_neg() || proc.pstat_overf() || proc.pstat_carry() || proc.pstat_zero());
+	ASSERT_EQ(proc.pstat(), 0);
+
+	//Setting or clearing one code keeps the pending others
+	o1 = 0;
+	proc.inc(&o1);
+	proc.sen();
+	ASSERT_EQ(proc.pstat(), SN);
+	proc.dec(&o1);
+	proc.clz();
+	ASSERT_EQ(proc.pstat(), 0);
+	proc.dec(&o1);
+	proc.ccc();
+	ASSERT_EQ(proc.pstat(), 0);
+	proc.inc(&o1);
+	proc.scc();
+	ASSERT_EQ(proc.pstat(), SN | SZ | SV | SC);
+
+	//Branches read pending codes directly
+	PWORD ost = 2;
+	o1 = 0x8000;
+	proc.reg(PC, 0);
+	proc.dec(&o1);
+	proc.bvs(&ost);
+	ASSERT_EQ(proc.reg(PC), 4);
+	proc.bge(&ost);
+	ASSERT_EQ(proc.reg(PC), 4);
+	proc.bpl(&ost);
+	ASSERT_EQ(proc.reg(PC), 8);
+
+	//Traps push the real status word, and RTI replaces any pending codes
+	load(proc, VEC_TRAP, {02000, 0});
+	load(proc, 02000, {000002});			//rti
+	load(proc, 01000, {
+		012706, 001000,		//mov #1000, sp
+		005000,				//clr r0
+		0104400,			//trap 0
+		000000				//halt
+	});
+	proc.reg(PC, 01000);
+	proc.run(3);
+	ASSERT_EQ(proc.mem(0776), SZ);
+	proc.mem(0776, SN | SC);
+	proc.run(100);
+	ASSERT_EQ(proc.pstat(), SN | SC);
+}
+
+/**
+ * Make up a plausible instruction or data word for the translator tests
+ */
+static PWORD randomWord(std::mt19937& rng) {
+	PWORD mode = (PWORD)(rng() % 8), reg = (PWORD)(rng() % 8 == 0 ? 7 : rng() % 6);
+	PWORD operand = (PWORD)(mode << 3 | reg);
+	static const PWORD doubles[] = {010000, 020000, 030000, 040000, 050000, 060000, 0160000};
+	switch (rng() % 10) {
+		case 0:
+		case 1:
+		case 2:
+			return (PWORD)(doubles[rng() % 7] | (rng() % 8) << 9 | (rng() % 6) << 6 | operand);
+		case 3:
+			return (PWORD)((rng() % 2 ? 0005000 : 0006000) | (rng() % 8) << 6 | operand);
+		case 4:
+			return (PWORD)((rng() % 2 ? 0100000 : 0) | (rng() % 7 + 1) << 8 | ((rng() % 16 - 8) & 0377));
+		case 5:
+			return (PWORD)(077000 | (rng() % 6) << 6 | (rng() % 8 + 1));
+		case 6:
+			switch (rng() % 5) {
+				case 0: return (PWORD)(004000 | (rng() % 6) << 6 | operand);
+				case 1: return (PWORD)(000200 | rng() % 6);
+				case 2: return (PWORD)(000240 | rng() % 040);
+				case 3: return (PWORD)(074000 | (rng() % 6) << 6 | operand);
+				default: return (PWORD)(000300 | operand);
+			}
+		case 7:
+			return (PWORD)(rng() % 0100000 & ~1);
+		default:
+			return (PWORD)rng();
+	}
+}
+
+/**
+ * Run the same random core images under the threaded interpreter and another engine, a few instructions at a time,
+ * and check that they agree on everything after every slice
+ * @param tune Sets the other engine up for each image, if need be
+ */
+static void matchImages(ExecMode mode, void (*tune)(Processor& cpu, int image)) {
+	std::mt19937 rng(1186);
+	for (int image = 0; image < 60; image++) {
+		Processor ref, jit;
+		ref.mode(EXEC_THREADED);
+		jit.mode(mode);
+		if (tune)
+			tune(jit, image);
+		for (PWORD addr = 0; addr < ref.coreSize(); addr += 2) {
+			PWORD word = image % 3 ? randomWord(rng) : (PWORD)rng();
+			ref.mem(addr, word);
+			jit.mem(addr, word);
+		}
+		for (int r = R0; r <= SP; r++) {
+			PWORD val = (PWORD)(rng() % 0100000 & ~1);
+			ref.reg((RegCode)r, val);
+			jit.reg((RegCode)r, val);
+		}
+		ref.reg(PC, 01000);
+		jit.reg(PC, 01000);
+
+		for (int slice = 0; slice < 100 && !ref.isHalted(); slice++) {
+			uint64_t budget = rng() % 64 + 1;
+			ASSERT_EQ(ref.run(budget), jit.run(budget)) << "image " << image << " slice " << slice;
+			for (int r = R0; r <= PC; r++)
+				ASSERT_EQ(ref.reg((RegCode)r), jit.reg((RegCode)r)) << "image " << image << " slice " << slice;
+			ASSERT_EQ(ref.pstat(), jit.pstat()) << "image " << image << " slice " << slice;
+			ASSERT_EQ(ref.isHalted(), jit.isHalted());
+		}
+		for (PWORD addr = 0; addr < ref.coreSize(); addr += 2)
+			ASSERT_EQ(ref.mem(addr), jit.mem(addr)) << "image " << image << " address " << addr;
+	}
+}
+
+TEST(processor_test, jit_matches_interpreter){
+	matchImages(EXEC_JIT, nullptr);
+}
+
+TEST(processor_test, tiered_matches_interpreter){
+	//Thresholds from translating everything straight away to never getting past decoding afresh
+	matchImages(EXEC_TIERED, [](Processor& cpu, int image) {
+		cpu.tiers((uint32_t)(image % 3), image % 4 == 3 ? 1000000 : (uint32_t)(image % 4 * 3));
+	});
+
+	//Index words are read from after the instruction at every tier, even once a source operand has moved PC back
+	for (uint32_t warm : {0, 1000000}) {
+		Processor ref, proc;
+		ref.mode(EXEC_THREADED);
+		proc.mode(EXEC_TIERED);
+		proc.tiers(warm, 1000000);
+		for (Processor* p : {&ref, &proc}) {
+			load(*p, 01000, {
+				014761, 000010,		//mov -(pc), 10(r1)
+				000000				//halt
+			});
+			p->reg(R1, 02000);
+			p->reg(PC, 01000);
+			ASSERT_EQ(p->run(1), 1);
+		}
+		ASSERT_EQ(proc.reg(PC), ref.reg(PC));
+		ASSERT_EQ(proc.reg(PC), 01002);
+		ASSERT_EQ(proc.mem(02010), 014761);
+	}
+}
+
+/**
+ * Blocks in different pages, jumping to each other directly and through a register, then one of them rewritten from
+ * outside; the other mustn't keep jumping into the old translation
+ */
+TEST(processor_test, jit_chained_blocks){
+	for (ExecMode mode : {EXEC_THREADED, EXEC_JIT}) {
+		Processor proc;
+		proc.mode(mode);
+		load(proc, 01000, {
+			005201,					//1$: inc r1
+			000137, 001400			//jmp @#2$
+		});
+		load(proc, 01400, {
+			005300,					//2$: dec r0
+			001403,					//beq 3$
+			012703, 001000,			//mov #1$, r3
+			000113,					//jmp (r3)
+			000000					//3$: halt
+		});
+		proc.reg(R0, 10);
+		proc.reg(PC, 01000);
+
+		//Runs out partway through a lap, and carries on from there
+		ASSERT_EQ(proc.run(9), 9);
+		ASSERT_EQ(proc.reg(PC), 01402);
+		ASSERT_EQ(proc.reg(R1), 2);
+		proc.run(1000);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R1), 10);
+
+		proc.mem(01000, 005301);	//dec r1
+		proc.resume();
+		proc.reg(R0, 10);
+		proc.reg(PC, 01000);
+		proc.run(1000);
+		ASSERT_EQ(proc.reg(R1), 0);
+	}
+}
+
+/**
+ * Calls nested deeper than the return stack, a subroutine that returns past a word after its call, and one that
+ * returns through a register past its inline argument all come back where the interpreter does
+ */
+TEST(processor_test, jit_return_stack){
+	for (ExecMode mode : {EXEC_CALL, EXEC_JIT, EXEC_TIERED}) {
+		Processor proc;
+		proc.mode(mode);
+		proc.tiers(1, 2);
+		load(proc, 01000, {
+			012704, 000024,		//mov #20., r4
+			012701, 000050,		//1$: mov #40., r1
+			004737, 002000,		//jsr pc, @#2000
+			004737, 003000,		//jsr pc, @#3000
+			005200,				//inc r0
+			004537, 004000,		//jsr r5, @#4000
+			000003,				//.word 3
+			077413,				//sob r4, 1$
+			000000				//halt
+		});
+		load(proc, 02000, {
+			060102,				//add r1, r2
+			005301,				//dec r1
+			001402,				//beq 1$
+			004737, 002000,		//jsr pc, @#2000
+			000207				//1$: rts pc
+		});
+		load(proc, 03000, {
+			062716, 000002,		//add #2, (sp)
+			000207				//rts pc
+		});
+		load(proc, 04000, {
+			062503,				//add (r5)+, r3
+			000205				//rts r5
+		});
+		proc.reg(SP, 0700);
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(1000);
+		ASSERT_EQ(proc.reg(PC), 01034);
+		ASSERT_EQ(proc.reg(SP), 0700);
+		ASSERT_EQ(proc.reg(R0), 0);
+		ASSERT_EQ(proc.reg(R2), 20 * 820);
+		ASSERT_EQ(proc.reg(R3), 20 * 3);
+	}
+}
+
+/**
+ * Condition codes nothing in the block reads still have to be right for a trap partway through it, and at the end
+ */
+TEST(processor_test, jit_condition_codes){
+	for (ExecMode mode : {EXEC_THREADED, EXEC_JIT}) {
+		Processor proc;
+		proc.mode(mode);
+		load(proc, 04, {02000, 0});
+		load(proc, 02000, {0});
+		load(proc, 01000, {
+			012700, 000002,			//mov #2, r0
+			005001,					//clr r1
+			005101,					//com r1
+			005712,					//tst (r2)
+			012703, 000005,			//mov #5, r3
+			000000					//halt
+		});
+		proc.reg(SP, 01000);
+		proc.reg(R2, 1);
+		proc.reg(PC, 01000);
+		proc.run(1000);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(PC), 02002);
+		ASSERT_EQ(proc.mem(0776) & 017, SN | SC);
+
+		proc.resume();
+		proc.reg(R2, 02000);
+		proc.reg(PC, 01000);
+		proc.run(1000);
+		ASSERT_EQ(proc.reg(PC), 01020);
+		ASSERT_EQ(proc.pstat() & 017, 0);
+	}
+}
+
+/**
+ * A subroutine that gets hot while its immediate operand is rewritten on every call, so that translations queued in
+ * the background keep going stale before they can be installed
+ */
+TEST(processor_test, tiered_background_translation){
+	for (uint64_t slice : {1, 7, 1000}) {
+		for (uint32_t hot : {1, 3, 20}) {
+			Processor proc;
+			proc.mode(EXEC_TIERED);
+			proc.tiers(0, hot);
+			load(proc, 01000, {
+				012702, 000144,		//mov #100., r2
+				004737, 002000,		//1$: jsr pc, @#2000
+				005237, 002002,		//inc @#2002
+				077205,				//sob r2, 1$
+				000000				//halt
+			});
+			load(proc, 02000, {
+				062703, 000001,		//add #1, r3
+				000207				//rts pc
+			});
+			proc.reg(SP, 0700);
+			proc.reg(PC, 01000);
+			uint64_t total = 0;
+			while (!proc.isHalted() && total < 10000)
+				total += proc.run(slice);
+			ASSERT_EQ(total, 502);
+			ASSERT_EQ(proc.reg(R3), 5050);
+			ASSERT_EQ(proc.mem(02002), 101);
+		}
+	}
+}
+
+/**
+ * A capped code buffer evicts translations to make room for new ones, without changing what the program does
+ */
+TEST(processor_test, translation_limit){
+	//Ten laps of calls to 200 different subroutines, each a block of its own, as is each call
+	auto image = [](Processor& proc) {
+		load(proc, 01000, {012702, 000012});			//mov #10., r2
+		for (PWORD i = 0; i < 200; i++) {
+			load(proc, (PWORD)(01004 + 4 * i), {004737, (PWORD)(04000 + 6 * i)});	//jsr pc, @#sub
+			load(proc, (PWORD)(04000 + 6 * i), {062703, i, 000207});				//sub: add #i, r3; rts pc
+		}
+		load(proc, 01004 + 4 * 200, {
+			005302,				//dec r2
+			001402,				//beq 1$
+			000137, 001004,		//jmp @#1004
+			000000				//1$: halt
+		});
+		proc.reg(SP, 0700);
+		proc.reg(PC, 01000);
+	};
+	Processor reference;
+	image(reference);
+	reference.mode(EXEC_CALL);
+	while (!reference.isHalted())
+		reference.run(1000);
+
+	//The program's translations don't fit in 32K, and do in 256K. How many the tiered engine gets through before the
+	//program ends is up to its background thread, so only the translator is held to evicting.
+	for (ExecMode mode : {EXEC_JIT, EXEC_TIERED}) {
+		for (uint64_t cap : {32 << 10, 256 << 10}) {
+			Processor proc;
+			image(proc);
+			proc.mode(mode);
+			proc.tiers(1, 2);
+			proc.translationLimit(cap);
+			while (!proc.isHalted())
+				proc.run(1000);
+			ASSERT_EQ(proc.reg(R3), reference.reg(R3));
+			ASSERT_EQ(proc.reg(PC), reference.reg(PC));
+
+			JitStats stats = proc.translationStats();
+#ifdef PDP_JIT
+			ASSERT_EQ(stats.capacity, cap);
+			ASSERT_LE(stats.hits, stats.lookups);
+			if (mode == EXEC_JIT)
+				ASSERT_EQ(stats.evictions > 0, cap < (256 << 10));
+			else
+				ASSERT_TRUE(stats.evictions == 0 || cap < (256 << 10));
+			ASSERT_EQ(stats.live + stats.dead + stats.free, stats.capacity);
+			ASSERT_LE(stats.largestFree, stats.free);
+#else
+			ASSERT_EQ(stats.capacity, 0);
+#endif
+		}
+	}
+}
+
+/**
+ * Interrupts are taken between instructions once the processor's priority lets them through, at the same instruction
+ * whichever engine is running, and wake a processor waiting for them; trace traps come after every instruction run
+ * with the trace bit set
+ */
+TEST(processor_test, interrupts){
+	uint64_t reference = 0;
+	for (ExecMode mode : {EXEC_CALL, EXEC_THREADED, EXEC_SWITCH, EXEC_JIT, EXEC_TIERED}) {
+		Processor proc;
+		proc.mode(mode);
+		load(proc, 0100, {02000, 0});
+		load(proc, 02000, {
+			005203,				//inc r3
+			000002				//rti
+		});
+
+		//Clock ticks, counted by the handler until there have been five
+		load(proc, 01000, {
+			012706, 001000,		//mov #1000, sp
+			005200,				//1$: inc r0
+			020327, 000005,		//cmp r3, #5
+			001374,				//bne 1$
+			000000				//halt
+		});
+		proc.reg(PC, 01000);
+		for (int tick = 1; tick <= 5; tick++)
+			proc.schedule(100 * tick, 0100, 6);
+		while (!proc.isHalted())
+			proc.run(7);
+		ASSERT_EQ(proc.reg(R3), 5);
+		ASSERT_EQ(proc.reg(SP), 01000);
+		if (mode == EXEC_CALL)
+			reference = proc.reg(R0);
+		ASSERT_EQ(proc.reg(R0), reference);
+
+		//Held off at priority 7 until spl 0
+		load(proc, 01000, {
+			012706, 001000,		//mov #1000, sp
+			000237,				//spl 7
+			012702, 000144,		//mov #100., r2
+			077201,				//1$: sob r2, 1$
+			010301,				//mov r3, r1
+			000230,				//spl 0
+			000240,				//nop
+			000000				//halt
+		});
+		proc.reg(R3, 0);
+		proc.reg(PC, 01000);
+		proc.resume();
+		proc.priority(7);
+		proc.interrupt(0100, 6);
+		proc.run(1000);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R1), 0);
+		ASSERT_EQ(proc.reg(R3), 1);
+		ASSERT_EQ(proc.priority(), 0);
+
+		//WAIT until a scheduled interrupt comes in; the time spent waiting counts towards the budget
+		load(proc, 01000, {
+			012706, 001000,		//mov #1000, sp
+			000001,				//wait
+			000000				//halt
+		});
+		proc.reg(R3, 0);
+		proc.reg(PC, 01000);
+		proc.resume();
+		proc.schedule(1000, 0100, 6);
+		ASSERT_EQ(proc.run(100), 100);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R3), 0);
+		proc.run(2000);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R3), 1);
+		ASSERT_EQ(proc.reg(PC), 01010);
+
+		//Scheduled by a device partway through a slice, ten instructions on from the one that wrote it
+		ASSERT_TRUE(proc.attach(0177400, &proc, nullptr, +[](void* p, PWORD, PWORD val) {
+			static_cast<Processor*>(p)->schedule(val, 0104, 6);
+		}));
+		load(proc, 0104, {02100, 0340});
+		load(proc, 02100, {
+			010203,				//mov r2, r3
+			000000				//halt
+		});
+		load(proc, 01000, {
+			012706, 001000,		//mov #1000, sp
+			005201,				//inc r1
+			005201,				//inc r1
+			005201,				//inc r1
+			012737, 000012,		//mov #10., @#177400
+			0177400,
+			012702, 001000,		//mov #1000, r2
+			077201,				//1$: sob r2, 1$
+			000000				//halt
+		});
+		proc.reg(R3, 0);
+		proc.reg(PC, 01000);
+		proc.resume();
+		proc.run(5000);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R3), 0770);
+
+		//Trace traps after each instruction once rtt has set the trace bit, but not after rtt itself
+		load(proc, VEC_BPT, {03000, 0});
+		load(proc, 03000, {
+			005204,				//inc r4
+			000002				//rti
+		});
+		load(proc, 01000, {
+			012706, 001000,		//mov #1000, sp
+			012746, 000020,		//mov #20, -(sp)
+			012746, 001020,		//mov #1020, -(sp)
+			000006,				//rtt
+			000000,				//halt
+			000240,				//1020: nop
+			000240,				//nop
+			000000				//halt
+		});
+		proc.reg(PC, 01000);
+		proc.resume();
+		proc.run(100);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R4), 2);
+		ASSERT_EQ(proc.reg(PC), 01026);
+	}
+}
+
+/**
+ * With core write-protected where there's code, writes to code are still seen, from translated code, the interpreter
+ * and outside alike, and code that keeps writing over itself gets guarding turned off
+ */
+TEST(processor_test, write_guard){
+	for (ExecMode mode : {EXEC_CALL, EXEC_JIT, EXEC_TIERED}) {
+		Processor proc;
+		proc.mode(mode);
+		bool guarded = proc.writeGuard(true);
+		ASSERT_EQ(proc.writeGuard(), guarded);
+
+		//Data in a page of its own leaves the code alone
+		load(proc, 01000, {
+			012701, 000144,		//mov #100., r1
+			005237, 010000,		//1$: inc @#10000
+			005200,				//inc r0
+			077104,				//sob r1, 1$
+			000000				//halt
+		});
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(50);
+		ASSERT_EQ(proc.reg(R0), 100);
+		ASSERT_EQ(proc.mem(010000), 100);
+		ASSERT_EQ(proc.writeGuard(), guarded);
+
+		//Written from outside
+		proc.mem(01010, 005300);
+		proc.resume();
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(50);
+		ASSERT_EQ(proc.reg(R0), 0);
+		ASSERT_EQ(proc.mem(010000), 200);
+
+		//Every lap writes the instruction after next, alternating between inc r2 and inc r3
+		load(proc, 01000, {
+			012701, 000144,		//mov #100., r1
+			012704, 005202,		//mov #5202, r4
+			012705, 000001,		//mov #1, r5
+			010437, 001026,		//1$: mov r4, @#1026
+			074405,				//xor r4, r5
+			005237, 010000,		//inc @#10000
+			000240,				//overwritten
+			077107,				//sob r1, 1$
+			000000				//halt
+		});
+		proc.resume();
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(50);
+		ASSERT_EQ(proc.reg(R2), 50);
+		ASSERT_EQ(proc.reg(R3), 50);
+		ASSERT_EQ(proc.mem(010000), 300);
+		ASSERT_FALSE(proc.writeGuard());
+
+		//The same with the data in the host page the code is in, so that writing it unprotects the code too
+		Processor shared;
+		shared.mode(mode);
+		shared.writeGuard(true);
+		load(shared, 01000, {
+			012701, 000144,		//mov #100., r1
+			012704, 005202,		//mov #5202, r4
+			012705, 000001,		//mov #1, r5
+			005237, 001400,		//1$: inc @#1400
+			010437, 001026,		//mov r4, @#1026
+			074405,				//xor r4, r5
+			000240,				//overwritten
+			077107,				//sob r1, 1$
+			000000				//halt
+		});
+		shared.reg(PC, 01000);
+		while (!shared.isHalted())
+			shared.run(50);
+		ASSERT_EQ(shared.reg(R2), 50);
+		ASSERT_EQ(shared.reg(R3), 50);
+		ASSERT_EQ(shared.mem(01400), 100);
+	}
+}
+
+/**
+ * With core fenced off past its end, translated loads and stores there still trap through 4, every time, and leave
+ * core alone
+ */
+TEST(processor_test, fenced_core){
+	Processor reference;
+	for (ExecMode mode : {EXEC_CALL, EXEC_JIT, EXEC_TIERED}) {
+		Processor proc;
+		proc.mode(mode);
+		proc.writeGuard(true);
+		load(proc, VEC_BUSERR, {03000, 0});
+		load(proc, 03000, {
+			005203,				//inc r3
+			000002				//rti
+		});
+		load(proc, 01000, {
+			012706, 001000,		//mov #1000, sp
+			012702, 000062,		//mov #50., r2
+			013701, 0100000,	//1$: mov @#100000, r1
+			010237, 0177776,	//mov r2, @#177776
+			060237, 002000,		//add r2, @#2000
+			005237, 0100002,	//inc @#100002
+			077211,				//sob r2, 1$
+			000000				//halt
+		});
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(50);
+		ASSERT_EQ(proc.reg(R3), 150);
+		ASSERT_EQ(proc.mem(02000), 1275);
+		ASSERT_EQ(proc.reg(SP), 01000);
+		ASSERT_EQ(proc.reg(PC), 01034);
+		if (mode == EXEC_CALL)
+			reference = proc;
+		ASSERT_EQ(proc.reg(R1), reference.reg(R1));
+		ASSERT_EQ(proc.pstat(), reference.pstat());
+		for (PWORD addr = 0; addr < 010000; addr += 2)
+			ASSERT_EQ(proc.mem(addr), reference.mem(addr));
+	}
+}
+
+/**
+ * Device registers in the I/O page are read and written by every engine alike, once per access, and addresses there
+ * with nothing attached still trap through 4
+ */
+TEST(processor_test, device_registers){
+	//A console that has a character ready on every fifth poll, and keeps whatever is printed
+	struct Console {
+		int polls = 0;
+		PWORD next = 0;
+		std::vector<PWORD> printed;
+	};
+	for (ExecMode mode : {EXEC_CALL, EXEC_THREADED, EXEC_SWITCH, EXEC_JIT, EXEC_TIERED}) {
+		for (bool guarded : {false, true}) {
+			Processor proc;
+			Console console;
+			proc.mode(mode);
+			proc.writeGuard(guarded);
+			ASSERT_TRUE(proc.attach(0177560, &console, +[](void* c, PWORD) -> PWORD {
+				return ++((Console*)c)->polls % 5 ? 0 : 0200;
+			}, nullptr));
+			ASSERT_TRUE(proc.attach(0177562, &console, +[](void* c, PWORD) -> PWORD {
+				return ++((Console*)c)->next;
+			}, nullptr));
+			ASSERT_TRUE(proc.attach(0177566, &console, nullptr, +[](void* c, PWORD, PWORD val) {
+				((Console*)c)->printed.push_back(val);
+			}));
+			ASSERT_FALSE(proc.attach(0177565, &console, nullptr, nullptr));
+			ASSERT_FALSE(proc.attach(0100000, &console, nullptr, nullptr));
+			load(proc, VEC_BUSERR, {03000, 0});
+			load(proc, 03000, {
+				005204,				//inc r4
+				000002				//rti
+			});
+			load(proc, 01000, {
+				012706, 001000,			//mov #1000, sp
+				005002,					//clr r2
+				032737, 000200, 0177560,	//1$: bit #200, @#177560
+				001774,					//beq 1$
+				013700, 0177562,		//mov @#177562, r0
+				010037, 0177566,		//mov r0, @#177566
+				005202,					//inc r2
+				020227, 000012,			//cmp r2, #10.
+				001364,					//bne 1$
+				013703, 0177570,		//mov @#177570, r3
+				000000					//halt
+			});
+			proc.reg(PC, 01000);
+			while (!proc.isHalted())
+				proc.run(100);
+			ASSERT_EQ(console.polls, 50);
+			ASSERT_EQ(console.printed, std::vector<PWORD>({1, 2, 3, 4, 5, 6, 7, 8, 9, 10}));
+			ASSERT_EQ(proc.reg(R4), 1);
+			ASSERT_EQ(proc.reg(PC), 01044);
+#if defined(PDP_JIT) && defined(__linux__) && defined(__x86_64__)
+			//A fenced core stays fenced, with the handler sending translated code on to the devices
+			if (mode == EXEC_JIT) {
+				ASSERT_EQ(proc.translationStats().diverted > 0, proc.writeGuard());
+			}
+#endif
+
+			//Gone once detached
+			proc.detach(0177566);
+			proc.resume();
+			proc.reg(R2, 9);
+			proc.reg(PC, 01022);
+			proc.run(100);
+			ASSERT_TRUE(proc.isHalted());
+			ASSERT_EQ(proc.reg(R4), 3);
+			ASSERT_EQ(console.printed.size(), 10);
+
+			//Both operands on one register read it twice, and the source is the first read, not the last
+			ASSERT_TRUE(proc.attach(0177564, &console, +[](void* c, PWORD) -> PWORD {
+				return ++((Console*)c)->next;
+			}, +[](void* c, PWORD, PWORD val) {
+				((Console*)c)->printed.push_back(val);
+			}));
+			load(proc, 01100, {
+				013737, 0177564, 0177564,	//mov @#177564, @#177564
+				063737, 0177564, 0177564,	//add @#177564, @#177564
+				000000						//halt
+			});
+			proc.resume();
+			proc.reg(PC, 01100);
+			proc.run(100);
+			ASSERT_TRUE(proc.isHalted());
+			ASSERT_EQ(console.next, 14);
+			ASSERT_EQ(console.printed, std::vector<PWORD>({1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 13 + 14}));
+		}
+	}
+}
+
+#ifdef PDP_JIT
+/**
+ * Inode of every translation cache file in a directory, so that rewritten files show up as changed
+ */
+static std::vector<ino_t> cacheFiles(const char* dir) {
+	std::vector<ino_t> files;
+	DIR* d = opendir(dir);
+	while (struct dirent* e = readdir(d)) {
+		std::string name = e->d_name;
+		struct stat st;
+		std::string path = std::string(dir) + "/" + name;
+		if (name.size() > 5 && name.substr(name.size() - 5) == ".pdpj" && stat(path.c_str(), &st) == 0)
+			files.push_back(st.st_ino);
+	}
+	closedir(d);
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+/**
+ * Translations written out by one run are read back by the next instead of being redone, and cache files that don't
+ * check out are thrown away
+ */
+TEST(processor_test, translation_cache){
+	char dir[] = "/tmp/pdp1186-cacheXXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	auto run = [&](ExecMode mode, uint64_t cap, PWORD step) {
+		Processor proc;
+		proc.mode(mode);
+		proc.translationCache(dir, cap);
+		load(proc, 01000, {
+			012702, 000144,		//mov #100., r2
+			004737, 002000,		//1$: jsr pc, @#2000
+			077203,				//sob r2, 1$
+			000000				//halt
+		});
+		load(proc, 02000, {
+			062703, step,		//add #step, r3
+			000207				//rts pc
+		});
+		proc.reg(SP, 0700);
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(1000);
+		ASSERT_EQ(proc.reg(R3), (PWORD)(100 * step));
+		ASSERT_EQ(proc.reg(PC), 01014);
+	};
+
+	//One file per page of code, left alone by a warm run that finds everything it needs in them
+	run(EXEC_JIT, 1 << 20, 1);
+	std::vector<ino_t> cold = cacheFiles(dir);
+	ASSERT_EQ(cold.size(), 2);
+	run(EXEC_JIT, 1 << 20, 1);
+	run(EXEC_TIERED, 1 << 20, 1);
+	ASSERT_EQ(cacheFiles(dir), cold);
+
+	//Different code in a page means a different file
+	run(EXEC_JIT, 1 << 20, 2);
+	ASSERT_EQ(cacheFiles(dir).size(), 3);
+
+	//Damaged files are deleted and the code translated afresh
+	DIR* d = opendir(dir);
+	while (struct dirent* e = readdir(d)) {
+		std::string path = std::string(dir) + "/" + e->d_name;
+		if (e->d_name[0] != '.') {
+			ASSERT_EQ(truncate(path.c_str(), 50), 0);
+		}
+	}
+	closedir(d);
+	run(EXEC_JIT, 1 << 20, 1);
+	ASSERT_EQ(cacheFiles(dir).size(), 3);
+	ASSERT_NE(cacheFiles(dir), cold);
+
+	//Nothing's kept past the size cap
+	run(EXEC_JIT, 1, 3);
+	ASSERT_EQ(cacheFiles(dir).size(), 0);
+	rmdir(dir);
+}
+
+/**
+ * Every block translated is named in the perf map and the jitdump for the guest addresses it was built from, as are
+ * the entry and exit code, in the same order in both
+ */
+TEST(processor_test, profiler_symbols){
+	char dir[] = "/tmp/pdp1186-symbolsXXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	{
+		Processor proc;
+		proc.mode(EXEC_JIT);
+		ASSERT_TRUE(proc.profilerSymbols(SYMBOLS_PERF_MAP | SYMBOLS_JITDUMP, dir));
+		load(proc, 01000, {
+			012702, 000144,		//mov #100., r2
+			004737, 002000,		//1$: jsr pc, @#2000
+			077203,				//sob r2, 1$
+			000000				//halt
+		});
+		load(proc, 02000, {
+			062703, 000001,		//add #1, r3
+			000207				//rts pc
+		});
+		proc.reg(SP, 0700);
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(1000);
+		ASSERT_EQ(proc.reg(R3), 100);
+	}
+	std::string prefix = std::string(dir) + "/";
+	std::string pid = std::to_string(getpid());
+
+	std::vector<std::string> names;
+	FILE* f = fopen((prefix + "perf-" + pid + ".map").c_str(), "r");
+	ASSERT_NE(f, nullptr);
+	unsigned long addr, size;
+	char name[64];
+	while (fscanf(f, "%lx %lx %63[^\n]\n", &addr, &size, name) == 3) {
+		ASSERT_GT(size, 0);
+		names.push_back(name);
+	}
+	fclose(f);
+	for (const char* expected : {"pdp11 entry", "pdp11 exit", "pdp11 001000-001010", "pdp11 002000-002006",
+								 "pdp11 001010-001012", "pdp11 001004-001010"})
+		ASSERT_NE(std::find(names.begin(), names.end(), expected), names.end());
+
+	f = fopen((prefix + "jit-" + pid + ".dump").c_str(), "rb");
+	ASSERT_NE(f, nullptr);
+	std::vector<PBYTE> dump;
+	int c;
+	while ((c = fgetc(f)) != EOF)
+		dump.push_back((PBYTE)c);
+	fclose(f);
+	uint32_t header[6];
+	ASSERT_GE(dump.size(), sizeof(header));
+	memcpy(header, dump.data(), sizeof(header));
+	ASSERT_EQ(header[0], JITDUMP_MAGIC);
+	ASSERT_EQ(header[5], (uint32_t)getpid());
+	size_t at = header[2], record = 0;
+	while (at < dump.size()) {
+		uint32_t kind[2];
+		memcpy(kind, &dump[at], sizeof(kind));
+		ASSERT_EQ(kind[0], JITDUMP_CODE_LOAD);
+		ASSERT_LT(record, names.size());
+		ASSERT_STREQ((const char*)&dump[at + 56], names[record].c_str());
+		at += kind[1];
+		record++;
+	}
+	ASSERT_EQ(at, dump.size());
+	ASSERT_EQ(record, names.size());
+
+	remove((prefix + "perf-" + pid + ".map").c_str());
+	remove((prefix + "jit-" + pid + ".dump").c_str());
+	rmdir(dir);
+}
+
+/**
+ * What the optimizer leaves out makes no difference to what the code does, and the dump shows it was left out: a load
+ * of a word already in a register, an instruction overwritten before anything sees it, and a store stored over. An
+ * odd constant address still faults, and a word loaded again after a device has had the chance to write it is read
+ * from core again.
+ */
+TEST(processor_test, translation_optimizer){
+	std::string path = tempFile("pdp1186-ir");
+	ASSERT_FALSE(path.empty());
+
+	Processor results[2];
+	for (int jit = 0; jit < 2; jit++) {
+		Processor& proc = results[jit];
+		proc.mode(jit ? EXEC_JIT : EXEC_THREADED);
+		if (jit) {
+			ASSERT_TRUE(proc.translationDump(path.c_str()));
+		}
+		load(proc, 01000, {
+			012700, 002000,		//mov #2000, r0
+			012001,				//mov (r0)+, r1
+			024001,				//cmp -(r0), r1
+			012702, 000001,		//mov #1, r2
+			012702, 000002,		//mov #2, r2
+			005037, 002002,		//clr @#2002
+			010137, 002002,		//mov r1, @#2002
+			013703, 002001,		//mov @#2001, r3
+			000000				//halt
+		});
+		load(proc, 0500, {
+			012704, 000001,		//mov #1, r4
+			000002				//rti
+		});
+		proc.mem(004, 0500);
+		proc.mem(02000, 012345);
+		proc.mem(02002, 054321);
+		proc.reg(R3, 0777);
+		proc.reg(SP, 0700);
+		proc.reg(PC, 01000);
+		while (!proc.isHalted())
+			proc.run(1000);
+		if (jit) {
+			ASSERT_FALSE(proc.translationDump(nullptr));
+		}
+	}
+	for (int r = R0; r <= PC; r++)
+		ASSERT_EQ(results[0].reg((RegCode)r), results[1].reg((RegCode)r));
+	ASSERT_EQ(results[0].pstat(), results[1].pstat());
+	ASSERT_EQ(results[1].reg(R1), 012345);
+	ASSERT_EQ(results[1].reg(R2), 2);
+	ASSERT_EQ(results[1].reg(R4), 1);
+	ASSERT_EQ(results[1].mem(02002), 012345);
+
+	std::string dump = takeFile(path);
+	auto section = [&](const char* from, const char* to) {
+		size_t start = dump.find(from), end = dump.find(to, start);
+		return start == std::string::npos ? std::string() : dump.substr(start, end - start);
+	};
+	ASSERT_EQ(dump.find("block 001000-001036"), 0);
+	ASSERT_NE(section("001006 cmp", "001010").find("; in r1"), std::string::npos);
+	ASSERT_NE(dump.find("001010 mov (dead)"), std::string::npos);
+	ASSERT_EQ(dump.find("001014 mov (dead)"), std::string::npos);
+	ASSERT_NE(section("001020 clr", "001024").find("; dead"), std::string::npos);
+	ASSERT_EQ(section("001024 mov", "001030").find("; dead"), std::string::npos);
+	ASSERT_NE(section("001030 mov", "001034").find("load"), std::string::npos);
+	ASSERT_EQ(section("001030 mov", "001034").find("safe"), std::string::npos);
+
+	//Writing a device register that stores what it's given to core, as DMA would
+	for (int jit = 0; jit < 2; jit++) {
+		Processor proc;
+		proc.mode(jit ? EXEC_JIT : EXEC_THREADED);
+		ASSERT_TRUE(proc.attach(0177400, &proc, nullptr, +[](void* p, PWORD, PWORD val) {
+			((Processor*)p)->mem(02000, val);
+		}));
+		load(proc, 01000, {
+			013700, 002000,			//mov @#2000, r0
+			012737, 000001, 0177400,	//mov #1, @#177400
+			013701, 002000,			//mov @#2000, r1
+			000000					//halt
+		});
+		proc.mem(02000, 012345);
+		proc.reg(PC, 01000);
+		proc.run(1000);
+		ASSERT_TRUE(proc.isHalted());
+		ASSERT_EQ(proc.reg(R0), 012345);
+		ASSERT_EQ(proc.reg(R1), 1);
+	}
+}
+
+/**
+ * A loop body whose branch goes one way seven times out of eight, counted by the tiered engine, is translated as one
+ * block along the hot side, leaving for the cold side by a side exit; run a few instructions at a time, it keeps in
+ * step with the interpreter whichever way it leaves
+ */
+TEST(processor_test, translation_superblocks){
+	std::string path = tempFile("pdp1186-trace");
+	ASSERT_FALSE(path.empty());
+
+	Processor ref, proc;
+	ref.mode(EXEC_THREADED);
+	proc.mode(EXEC_TIERED);
+	proc.tiers(0, 1000000);
+	for (Processor* p : {&ref, &proc}) {
+		load(*p, 01000, {
+			012703, 000400,		//mov #400, r3
+			005000,				//clr r0
+			005001,				//clr r1
+			005002,				//clr r2
+			005200,				//1$: inc r0
+			032700, 000007,		//bit #7, r0
+			001002,				//bne 2$
+			005202,				//inc r2
+			000401,				//br 3$
+			005201,				//2$: inc r1
+			077310,				//3$: sob r3, 1$
+			000000				//halt
+		});
+		p->reg(PC, 01000);
+	}
+
+	//Counted without translating anything, then translated from those counts
+	ASSERT_EQ(ref.run(1000), proc.run(1000));
+	proc.mode(EXEC_JIT);
+	ASSERT_TRUE(proc.translationDump(path.c_str()));
+	for (uint64_t budget = 1; !ref.isHalted(); budget = budget % 37 + 1) {
+		ASSERT_EQ(ref.run(budget), proc.run(budget));
+		for (int r = R0; r <= PC; r++)
+			ASSERT_EQ(ref.reg((RegCode)r), proc.reg((RegCode)r));
+		ASSERT_EQ(ref.pstat(), proc.pstat());
+	}
+	ASSERT_TRUE(proc.isHalted());
+	ASSERT_EQ(proc.reg(R1), 0340);
+	ASSERT_EQ(proc.reg(R2), 040);
+	ASSERT_FALSE(proc.translationDump(nullptr));
+
+	std::string dump = takeFile(path);
+	size_t start = dump.find("block 001012-001032");
+	ASSERT_NE(start, std::string::npos);
+	std::string block = dump.substr(start, dump.find("block", start + 1) - start);
+	ASSERT_NE(block.find("side 001022"), std::string::npos);
+	ASSERT_NE(block.find("001026 inc"), std::string::npos);
+	ASSERT_EQ(block.find("001022 inc"), std::string::npos);
+}
+#endif
+
+#ifdef PDP_NATIVE
+/**
+ * Blocks recompiled ahead of time into a shared object run the same as the interpreter, whichever engine they're run
+ * in place of, and stop being used once the code they were built from is written over, whether by the program itself
+ * or from outside
+ */
+TEST(processor_test, native_recompiled){
+	auto image = [](Processor& proc, bool rewrite) {
+		load(proc, 01000, {
+			012702, 000144,		//mov #100., r2
+			060200,				//1$: add r2, r0
+			010001,				//mov r0, r1
+			006301,				//asl r1
+			050201,				//bis r2, r1
+			004737, 002000,		//jsr pc, @#2000
+			020127, 000400,		//cmp r1, #400
+			0103401,			//blo 2$
+			005203,				//inc r3
+			077213,				//2$: sob r2, 1$
+			000000				//halt
+		});
+		load(proc, 02000, {
+			010037, 003000,		//mov r0, @#3000
+			063704, 003000,		//add @#3000, r4
+			000240, 000240, 000240,	//nop, or mov #5303, @#1026 to turn the inc into a dec
+			000207				//rts pc
+		});
+		if (rewrite)
+			load(proc, 02010, {012737, 005303, 001026});
+		proc.reg(SP, 0700);
+		proc.reg(PC, 01000);
+	};
+	auto finish = [](Processor& proc) {
+		for (int i = 0; i < 100 && !proc.isHalted(); i++)
+			proc.run(1000);
+	};
+	auto match = [](const Processor& proc, const Processor& reference) {
+		for (int r = R0; r <= PC; r++)
+			ASSERT_EQ(proc.reg((RegCode)r), reference.reg((RegCode)r));
+		ASSERT_EQ(proc.pstat(), reference.pstat());
+		ASSERT_TRUE(proc.isHalted());
+		for (PWORD a = 0; a < proc.coreSize(); a += 2)
+			ASSERT_EQ(proc.mem(a), reference.mem(a));
+	};
+
+	char dir[] = "/tmp/pdp1186-nativeXXXXXX";
+	ASSERT_NE(mkdtemp(dir), nullptr);
+	std::string path = std::string(dir) + "/image \"$HOME`.so";	//Nothing in the name is special to the build
+	for (bool rewrite : {false, true}) {
+		Processor original;
+		image(original, rewrite);
+		Recompiler recompiler(original);
+		recompiler.discover(01000);
+		ASSERT_EQ(recompiler.size(), 7);
+		ASSERT_TRUE(Recompiler::build(recompiler.source(), path));
+
+		for (ExecMode mode : {EXEC_TIERED, EXEC_THREADED, EXEC_JIT}) {
+			Processor proc, reference;
+			image(proc, rewrite);
+			image(reference, rewrite);
+			reference.mode(EXEC_CALL);
+			proc.mode(mode);
+			ASSERT_EQ(proc.loadNative(path.c_str()), 7);
+			finish(proc);
+			finish(reference);
+			match(proc, reference);
+			uint64_t runs = proc.nativeRuns();
+			ASSERT_GT(runs, 0);
+
+			//Changed from outside; the blocks in that page have to go
+			for (Processor* p : {&proc, &reference}) {
+				p->mem(01026, 005403);
+				p->resume();
+				p->reg(PC, 01000);
+				finish(*p);
+			}
+			match(proc, reference);
+
+			//Only the subroutine is left to run natively, once a call at most
+			ASSERT_LE(proc.nativeRuns() - runs, 100);
+
+			//Blocks that don't match what's in core aren't used at all
+			ASSERT_EQ(proc.loadNative(path.c_str()), 6);
+		}
+		remove(path.c_str());
+		remove((path + ".cpp").c_str());
+	}
+	rmdir(dir);
+}
+#endif
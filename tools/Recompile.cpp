@@ -0,0 +1,48 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include "../src/Processor.h"
+#include "../src/Recompiler.h"
+using std::cerr;
+using std::cout;
+using std::endl;
+
+/**
+ * Recompile a guest image ahead of time into a shared object for Processor::loadNative().
+ *
+ * usage: recompile <image> <load address> <entry> <output>
+ *
+ * The image is raw little endian words, loaded at the given address; both addresses are octal. The C++ the shared
+ * object is built from is left next to it.
+ */
+int main(int argc, char** argv) {
+	if (argc != 5) {
+		cerr << "usage: " << argv[0] << " <image> <load address> <entry> <output>" << endl;
+		return 2;
+	}
+	PWORD load = (PWORD)strtoul(argv[2], nullptr, 8);
+	PWORD entry = (PWORD)strtoul(argv[3], nullptr, 8);
+
+	Processor cpu;
+	FILE* f = fopen(argv[1], "rb");
+	if (f == nullptr) {
+		cerr << "can't open " << argv[1] << endl;
+		return 1;
+	}
+	PBYTE word[2];
+	PWORD addr = load;
+	while (fread(word, 1, 2, f) == 2 && addr < cpu.coreSize()) {
+		cpu.mem(addr, (PWORD)(word[0] | word[1] << 8));
+		addr += 2;
+	}
+	fclose(f);
+
+	Recompiler recompiler(cpu);
+	recompiler.discover(entry);
+	if (!Recompiler::build(recompiler.source(), argv[4])) {
+		cerr << "couldn't build " << argv[4] << endl;
+		return 1;
+	}
+	cout << recompiler.size() << " blocks recompiled into " << argv[4] << endl;
+	return 0;
+}